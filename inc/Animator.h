@@ -27,9 +27,9 @@ public:
   void ManualTimestep(int _manualTimestep);
 
   unsigned int CurrentTimestep() const { return currentTimestep_; }
-  unsigned int NextTimestep() const { 
-    return currentTimestep_ < numTimesteps_-1 ? currentTimestep_+1 : 0;
-  }
+  // Timestep _steps ahead in the direction of playback, with looping
+  unsigned int TimestepAhead(unsigned int _steps) const;
+  unsigned int NextTimestep() const { return TimestepAhead(1); }
 
   void SetCurrentTimestep(unsigned int _timestep);
   void SetNumTimesteps(unsigned int _numTimesteps);
@@ -51,6 +51,10 @@ private:
   unsigned int currentTimestep_;
   bool fpsMode_;
   bool paused_;
+  // Direction of playback (1 or -1), follows the last manual step
+  int direction_;
+  // Step one timestep in the direction of playback
+  void Step();
   // Keeps track of elapsed time between timestep updates 
   float elapsedTime_;
   // Time before timestep gets updates
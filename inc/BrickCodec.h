@@ -0,0 +1,64 @@
+/*
+ * Stateless encoders/decoders for brick data. Used by the brick manager
+ * to build and read encoded sidecar files next to the TSP file.
+ *
+ */
+
+#ifndef BRICKCODEC_H_
+#define BRICKCODEC_H_
+
+#include <vector>
+
+namespace osp {
+
+class BrickCodec {
+public:
+
+  // Encode a brick as the difference to a reference brick (normally the
+  // parent BST node). Differences are taken on the float bit patterns so
+  // that decoding is exact. Runs of unchanged values are run length coded,
+  // other values are stored as zigzag variable length integers.
+  // The encoded bytes are appended to _out.
+  static void EncodeDelta(const float *_brick, const float *_reference,
+                          unsigned int _numVals,
+                          std::vector<unsigned char> &_out);
+
+  // Reverse EncodeDelta, _out must hold _numVals floats
+  static bool DecodeDelta(const unsigned char *_in, unsigned int _numBytes,
+                          const float *_reference, unsigned int _numVals,
+                          float *_out);
+
+  // In place 3D Haar transform of a _dim^3 brick. Each level averages and
+  // differences pairs along x, y and z, odd lengths keep the last value as
+  // an average. Repeats on the average cube until it is a single value.
+  static void WaveletForward(float *_brick, unsigned int _dim);
+  static void WaveletInverse(float *_brick, unsigned int _dim);
+
+  // Coefficient order for a transformed brick, coarsest band first.
+  // _order[i] is the brick index of the i:th stored coefficient and 
+  // _bandEnds[b] the number of coefficients in bands 0 to b.
+  static void WaveletBands(unsigned int _dim, 
+                           std::vector<unsigned int> &_order,
+                           std::vector<unsigned int> &_bandEnds);
+
+private:
+  BrickCodec();
+
+  // Haar step on one line of _length values, _stride apart
+  static void HaarForward(float *_line, unsigned int _length, 
+                          unsigned int _stride, float *_tmp);
+  static void HaarInverse(float *_line, unsigned int _length, 
+                          unsigned int _stride, float *_tmp);
+  // Apply a Haar step along every line of an axis in the _length^3 corner
+  static void HaarAxis(float *_brick, unsigned int _dim, unsigned int _length,
+                       unsigned int _axis, bool _inverse);
+
+  // Map float bits to an unsigned int with the same ordering as the float
+  static unsigned int OrderedBits(float _val);
+  static float FromOrderedBits(unsigned int _bits);
+
+};
+
+}
+
+#endif
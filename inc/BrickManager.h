@@ -10,6 +10,9 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <stdint.h>
 #include <fstream>
 #include <boost/timer/timer.hpp>
 #include <stdio.h>
@@ -31,7 +34,12 @@ public:
 
   Config *config_;
 
-  enum BUFFER_INDEX { EVEN = 0, ODD };
+  // Index of a buffer in the ring of in-flight frames, from 0 up to 
+  // NumBuffers()-1. Each buffer has its own brick list, staging buffer, 
+  // PBO and brick cache.
+  typedef unsigned int BUFFER_INDEX;
+  // Storage format of the streamed bricks (see brick_encoding in config)
+  enum BRICK_ENCODING { RAW = 0, DELTA, WAVELET, UNPADDED };
 
   // Read header data from file, should normally only be called once
   // unless header data changes
@@ -39,22 +47,64 @@ public:
 
   bool InitAtlas();
 
-  // Build brick list from request list
-  // Resets values in _brickRequest to 0
-  bool BuildBrickList(BUFFER_INDEX _bufIdx, std::vector<int> &_brickRequest);
+  // Build brick list from the indices of the requested bricks, which
+  // have to be in ascending order. Only the requested bricks and the ones
+  // in the previous list for the buffer are visited.
+  bool BuildBrickList(BUFFER_INDEX _bufIdx, 
+                      const std::vector<int> &_requestedBricks);
 
-  // Upload bricks from memory buffer to PBO using the brick list
+  // Read bricks that are missing from a PBO into its staging buffer, 
+  // brick after brick, and list their atlas slots. The bricks are moved
+  // into the atlas shaped PBO on the GPU by the BrickScatter kernel, or
+  // copied straight into the buffer's atlas on the transfer queue.
   bool DiskToPBO(BUFFER_INDEX _pboIndex);
 
-  // Init transfer from PBO to texture atlas
+  // Init transfer from PBO to texture atlas. Not used when the atlas is
+  // updated on the transfer queue (atlas_transfer_queue in config).
   bool PBOToAtlas(BUFFER_INDEX _pboIndex);
 
-  std::vector<int> BrickList(BUFFER_INDEX _bufIdx) { 
+  // Brick list of a buffer, three atlas coordinates (or -1) for each 
+  // brick in the tree, BrickListSize() ints in all
+  const int * BrickList(BUFFER_INDEX _bufIdx) const { 
     return brickLists_[_bufIdx]; 
   }
+  unsigned int BrickListSize() const { return numBricksTree_*3; }
+  // Incremented whenever the brick list of a buffer changes
+  unsigned int BrickListVersion(BUFFER_INDEX _bufIdx) const {
+    return brickListVersion_[_bufIdx];
+  }
+  // Keep the brick list of a buffer in _memory from now on, for example
+  // pinned memory that can be uploaded without a driver copy. _memory has
+  // to hold BrickListSize() ints. Call after ReadHeader.
+  bool SetBrickListMemory(BUFFER_INDEX _bufIdx, int *_memory);
+
+  // GL buffer handles for sharing with OpenCL
+  unsigned int PBOHandle(BUFFER_INDEX _bufIdx) const { 
+    return pboHandle_[_bufIdx]; 
+  }
+  unsigned int StagingHandle(BUFFER_INDEX _bufIdx) const {
+    return stagingHandle_[_bufIdx];
+  }
+  // With persistent staging, the next DiskToPBO into a staging buffer 
+  // waits for _fence, set when the last transfer from it was enqueued.
+  // Takes ownership of the fence.
+  void SetStagingFence(BUFFER_INDEX _bufIdx, GLsync _fence);
+  bool PersistentStaging() const { return persistentStaging_; }
+  // Linear atlas slot for each brick in the staging buffer, in order
+  const std::vector<int> & StagedSlots(BUFFER_INDEX _bufIdx) const {
+    return stagedSlots_[_bufIdx];
+  }
 
+  // NULL when the atlas is updated on the transfer queue
   Texture3D * TextureAtlas() { return textureAtlas_; }
 
+  // Number of buffers (pipeline_depth in config)
+  unsigned int NumBuffers() const { return numBuffers_; }
+
+  // Read bricks [_first, _first+_count) into _out, decoding them if needed
+  bool ReadBrickSequence(unsigned int _first, unsigned int _count, 
+                         float *_out);
+
   // Header accessors
   unsigned int GridType() const { return gridType_; }
   unsigned int NumOrigTimesteps() const { return numOrigTimesteps_; }
@@ -108,17 +158,138 @@ private:
   // Texture where the actual atlas is kept
   Texture3D *textureAtlas_;
 
-  std::vector<std::vector<int> > brickLists_;
+  // Where each brick list is kept, in brickListStorage_ unless memory
+  // was handed over with SetBrickListMemory
+  std::vector<int*> brickLists_;
+  std::vector<std::vector<int> > brickListStorage_;
+  // Bricks in the current and previous brick list of each buffer, in 
+  // ascending order. The previous ones are what the PBO holds until 
+  // DiskToPBO evicts the bricks that are no longer requested.
+  std::vector<std::vector<int> > requestedBricks_;
+  std::vector<std::vector<int> > previousBricks_;
+  std::vector<unsigned int> brickListVersion_;
 
   // C-style I/O
   std::FILE *file_;
   off dataPos_;
 
+  // Delta encoding. Leaf BST bricks are stored in a sidecar file as
+  // differences to their parent BST brick, parents stay in the TSP file.
+  BRICK_ENCODING encoding_;
+  unsigned int numOTNodes_;
+  unsigned int firstLeafBrick_;
+  std::FILE *deltaFile_;
+  off deltaDataPos_;
+  // Byte offsets (relative to deltaDataPos_) of each leaf brick record,
+  // one extra entry marks the end of the last record
+  std::vector<uint64_t> deltaOffsets_;
+  std::vector<unsigned char> deltaBuffer_;
+
+  // Host copies of parent bricks, least recently used first
+  std::list<unsigned int> parentLRU_;
+  std::unordered_map<unsigned int, 
+    std::pair<std::vector<float>, std::list<unsigned int>::iterator> > 
+    parentCache_;
+  unsigned int maxCachedParents_;
+
+  // Wavelet encoding. All bricks are stored in a sidecar file as Haar
+  // coefficients, coarse bands first, so a prefix read gives an
+  // approximation of the brick.
+  std::FILE *waveletFile_;
+  off waveletDataPos_;
+  std::vector<unsigned int> waveletOrder_;
+  std::vector<unsigned int> waveletBandEnds_;
+  unsigned int numWaveletBands_;
+  unsigned int initialBands_;
+  unsigned int refineBudget_;
+  // Number of bands of each brick that has been put in the PBOs
+  std::vector<std::vector<unsigned int> > bandsInPBO_;
+  // Number of bricks in each PBO not yet at full precision
+  std::vector<unsigned int> partialBricks_;
+  // Times first frame and full quality after new bricks were requested
+  boost::timer::cpu_timer refineTimer_;
+  bool refining_;
+
+  // Unpadded encoding. Bricks are stored in a sidecar file without their
+  // border, which is rebuilt from neighbouring bricks on upload.
+  std::FILE *unpaddedFile_;
+  off unpaddedDataPos_;
+  unsigned int unpaddedBrickSize_;
+  // First OT node index of each octree level, root level first
+  std::vector<unsigned int> levelStarts_;
+  // Host copies of the unpadded bricks that are in one of the PBOs
+  std::unordered_map<unsigned int, std::vector<float> > unpaddedBricks_;
+
+  // Streaming statistics
+  double bytesStreamed_;
+  double bytesStreamedRaw_;
+
+  // Open an encoded sidecar file and check its header. Returns NULL if the
+  // file is missing or was built for another TSP file.
+  std::FILE * OpenEncodedFile(const std::string &_filename);
+  // Size and modification time of the TSP file. Encoded files store them
+  // in their header, so they are rebuilt when the TSP file changes.
+  bool TSPStamp(uint64_t &_size, uint64_t &_time) const;
+  // Encoded files are written under a temporary name with the header 
+  // first, then renamed into place with FinishTempFile once complete.
+  std::FILE * CreateEncodedFile(const std::string &_tmpFilename);
+  // Brick count, brick size and TSP file stamp
+  static const unsigned int ENCODED_HEADER_SIZE = 
+    2*sizeof(unsigned int) + 2*sizeof(uint64_t);
+  // Open the delta file, building it first if it's missing or outdated
+  bool InitDeltaEncoding();
+  bool WriteDeltaFile(const std::string &_filename);
+  // Open the wavelet file, building it first if it's missing or outdated
+  bool InitWaveletEncoding();
+  bool WriteWaveletFile(const std::string &_filename);
+  // Read the first _numBands bands of each brick and reconstruct them
+  bool ReadWaveletBricks(unsigned int _first, unsigned int _count,
+                         unsigned int _numBands, float *_out);
+  // Reload resident bricks in a PBO that are missing bands, at most
+  // refineBudget_ of them
+  bool RefineBricks(BUFFER_INDEX _pboIndex, float *_staging);
+  // Open the unpadded file, building it first if it's missing or outdated
+  bool InitUnpaddedEncoding();
+  bool WriteUnpaddedFile(const std::string &_filename);
+  // Read unpadded bricks into the host copies and write padded versions 
+  // to _out
+  bool ReadUnpaddedBricks(unsigned int _first, unsigned int _count, 
+                          float *_out);
+  // Build a padded brick from the host copies. Border values come from the
+  // neighbouring bricks at the same level and BST node if they are
+  // resident, else the brick's own edge values are repeated.
+  void PadBrick(unsigned int _brickIndex, float *_out);
+  // Octree grid position and level of a brick, and the reverse
+  void BrickPosition(unsigned int _brickIndex, unsigned int &_level,
+                     int &_x, int &_y, int &_z);
+  int BrickAt(unsigned int _brickIndex, unsigned int _level, 
+              int _x, int _y, int _z);
+  // Read raw bricks from the TSP file
+  bool ReadRawBricks(unsigned int _first, unsigned int _count, float *_out);
+  // Make sure the parents of leaf bricks [_first, _first+_count) are cached
+  bool CacheParents(unsigned int _first, unsigned int _count);
+  // Evict least recently used parents until the cache is within bounds
+  void TrimParentCache();
+
   bool hasReadHeader_;
   bool atlasInitialized_;
 
+  unsigned int numBuffers_;
   // PBOs
-  unsigned int pboHandle_[2];
+  std::vector<unsigned int> pboHandle_;
+  // Compact brick streams, one for each PBO
+  std::vector<unsigned int> stagingHandle_;
+  std::vector<std::vector<int> > stagedSlots_;
+  // Persistent staging (persistent_staging in config). The staging 
+  // buffers are mapped once in InitAtlas and written in place.
+  bool persistentStaging_;
+  std::vector<float*> stagingPtr_;
+  std::vector<GLsync> stagingFence_;
+  // Wait for the fence of a staging buffer, if any, and delete it
+  bool WaitStagingFence(BUFFER_INDEX _bufIdx);
+  // Position of each atlas slot in the staging buffer being filled, -1 if
+  // the slot hasn't been staged. Only valid during one DiskToPBO.
+  std::vector<int> stagingPos_;
 
   // Caching, one for each PBO
   std::vector<std::vector<int> > bricksInPBO_;
@@ -131,12 +302,13 @@ private:
   // 3D coordinates from linear index
   void CoordsFromLin(int _idx, int &_x, int &_y, int &_z); 
 
-  // Fill a brick in the volume using a pointer to flattened brick data
-  bool FillVolume(float *_in, 
-                  float *_out,
-                  unsigned int _x, 
-                  unsigned int _y, 
-                  unsigned int _z);
+  // Copy a brick to the staging buffer and mark it for an atlas slot.
+  // Staging the same slot twice in a frame overwrites the first copy.
+  void StageBrick(BUFFER_INDEX _pboIndex, float *_staging, 
+                  const float *_brick, unsigned int _slot);
+  // Unmap the staging buffer being filled and clear stagingPos_, also
+  // when DiskToPBO fails half way
+  void EndStaging(BUFFER_INDEX _pboIndex);
 
   // Timer and timer constants
   boost::timer::cpu_timer timer_;
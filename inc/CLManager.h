@@ -13,6 +13,8 @@
 #endif
 #include <map>
 #include <string>
+#include <vector>
+#include <stdint.h>
 #include <KernelConstants.h>
 
 namespace osp {
@@ -27,24 +29,43 @@ public:
   static CLManager * New();
   ~CLManager();
   
-  // Different queue indices for working with asynchronous uploads/executions
-  enum QueueIndex { EXECUTE, TRANSFER, NUM_QUEUE_INDICES };
+  // Different queue indices for working with asynchronous uploads/executions.
+  // Commands on different queues may overlap on the device.
+  enum QueueIndex { EXECUTE, TRANSFER, TRAVERSAL, NUM_QUEUE_INDICES };
   enum TextureType { TEXTURE_1D, TEXTURE_2D, TEXTURE_3D };
   enum Permissions { READ_ONLY, WRITE_ONLY, READ_WRITE };
   enum AllocMode { USE_HOST_PTR, ALLOC_HOST_PTR, COPY_HOST_PTR };
 
+  // Record device timestamps for every command, see ProgramTimes. Has to
+  // be set before the command queues are created.
+  void SetProfiling(bool _profiling);
+
   // These four functions should be run in this order
   bool InitPlatform();
   bool InitDevices();
   bool CreateContext();
   bool CreateCommandQueue();
 
+  // Directory for built program binaries, reused by later runs on the 
+  // same device and driver. Empty to always build from source.
+  void SetBinaryCacheDir(const std::string &_binaryCacheDir);
+
   // Name a program and create it from source text file
   bool CreateProgram(std::string _programName, std::string _fileName);
   // Build program after creation
   bool BuildProgram(std::string _programName);
+  // Build program with compiler options, typically -D defines that 
+  // specialize the kernel. Builds are cached by source and options.
+  bool BuildProgram(std::string _programName, const std::string &_options);
   // Create kernel after building program
   bool CreateKernel(std::string _programName);
+
+  // Enqueue the commands of a program on another queue than EXECUTE
+  bool SetQueue(std::string _programName, QueueIndex _queueIndex);
+  // Make the next acquire or launch of a program wait for the last command
+  // of _dependency. Needed when programs on different queues share memory
+  // objects. Does nothing if _dependency hasn't enqueued anything yet.
+  bool AddWaitEvent(std::string _programName, std::string _dependency);
   
   // Add an OpenGL texture to a program
   bool AddTexture(std::string _programName, unsigned int _argNr,
@@ -58,15 +79,68 @@ public:
   bool AddTexture(std::string _programName, unsigned int _argNr,
                 cl_mem _texture, Permissions _permissions);
 
+  // Add an OpenGL buffer object to a program, the CL handle is returned
+  // in _clBufferMem so it can be set again later or shared
+  bool AddGLBuffer(std::string _programName, unsigned int _argNr,
+                   unsigned int _glBuffer, Permissions _permissions,
+                   cl_mem& _clBufferMem);
+
+  bool AddGLBuffer(std::string _programName, unsigned int _argNr,
+                   cl_mem _buffer);
+
   bool AddBuffer(std::string _programName, unsigned int _argNr,
                  void *_hostPtr, unsigned int _sizeInBytes,
                  AllocMode _allocMode, Permissions _permissions);
 
+  // Add a buffer and return its CL handle in _clBufferMem, so that it can
+  // be shared with other programs
+  bool AddBuffer(std::string _programName, unsigned int _argNr,
+                 void *_hostPtr, unsigned int _sizeInBytes,
+                 AllocMode _allocMode, Permissions _permissions,
+                 cl_mem& _clBufferMem);
+
+  // Set a buffer created elsewhere. Don't release it through this program.
+  bool AddBuffer(std::string _programName, unsigned int _argNr,
+                 cl_mem _buffer);
+
+  // Create a single channel float 3D image, not shared with OpenGL, and 
+  // return its CL handle in _clImageMem
+  bool AddImage3D(std::string _programName, unsigned int _argNr,
+                  unsigned int _width, unsigned int _height, 
+                  unsigned int _depth, Permissions _permissions,
+                  cl_mem& _clImageMem);
+
   bool ReadBuffer(std::string _programName, unsigned int _argNr,
                   void *_hostPtr, unsigned int _sizeInBytes,
                   bool _blocking);
 
-  // Free resources
+  // Allocate page-locked host memory (ALLOC_HOST_PTR) and keep it mapped
+  // until the manager is deleted. Reads into and writes from it go 
+  // straight to the device, without a copy through driver memory.
+  bool CreatePinnedMemory(unsigned int _sizeInBytes, void *&_hostPtr);
+
+  // Copy regions of a buffer into an image on the program's queue, after
+  // any GL objects have been acquired with PrepareProgram. Region i starts
+  // _offsets[i] bytes into the buffer and goes to the image origin 
+  // _origins[3*i..3*i+2]. Returns immediately.
+  bool CopyBufferToImage(std::string _programName, cl_mem _buffer,
+                         cl_mem _image, const std::vector<size_t> &_offsets,
+                         const std::vector<size_t> &_origins,
+                         const size_t _region[3]);
+
+  // Upload data to a pooled buffer set as argument _argNr. The buffer is
+  // kept between calls and only swapped for a larger one when the data 
+  // outgrows it, so repeated uploads don't allocate.
+  bool WriteBuffer(std::string _programName, unsigned int _argNr,
+                   void *_hostPtr, unsigned int _sizeInBytes,
+                   bool _blocking);
+
+  // As above, and return the buffer's CL handle for sharing
+  bool WriteBuffer(std::string _programName, unsigned int _argNr,
+                   void *_hostPtr, unsigned int _sizeInBytes,
+                   bool _blocking, cl_mem& _clBufferMem);
+
+  // Free resources. Pooled buffers go back to the pool.
   bool ReleaseBuffer(std::string _programName, unsigned int _argNr);
 
   // Set the value of an integer argument
@@ -80,9 +154,35 @@ public:
                      unsigned int _gx, unsigned int _gy,
                      unsigned int _lx, unsigned int _ly);
 
-  // Wait for kernel to finish, releaste any shared resources
+  // Launch program kernel in one dimension (returns immediately)
+  bool LaunchProgram(std::string _programName, 
+                     unsigned int _gx, unsigned int _lx);
+
+  // Enqueue the release of any shared GL objects after the kernel 
+  // (returns immediately)
+  bool ReleaseProgram(std::string _programName);
+
+  // Block until the last command of a program has finished
+  bool WaitForProgram(std::string _programName);
+
+  // Make the GL objects released by a program safe to use from GL. Only
+  // blocks if the device lacks cl_khr_gl_event.
+  bool SyncGL(std::string _programName);
+
+  // GL sync object that is signaled when the last command of a program
+  // is done (GL_ARB_cl_event), so that GL or the host can wait for it 
+  // later. Without the extension the command is waited for here.
+  bool FenceGL(std::string _programName, GLsync &_fence);
+
+  // Release any shared resources and wait for the kernel to finish
   bool FinishProgram(std::string _programName);
 
+  // Device start and end time in nanoseconds of the commands enqueued for
+  // a program since it was last prepared. Needs profiling, and the 
+  // commands have to be done (see WaitForProgram).
+  bool ProgramTimes(std::string _programName, cl_ulong &_start,
+                    cl_ulong &_end);
+
   // Finish all commands in a command queue
   // Can be used e.g. to sync a DMA transfer operation
   bool FinishQueue(QueueIndex _queueIndex);
@@ -105,6 +205,26 @@ private:
   // Conver CLManager::AllocMode to cl_mem_flags
   cl_mem_flags ConvertAllocMode(AllocMode _allocMode);
 
+  // Take a buffer of at least _sizeInBytes from the pool, creating one if
+  // none fits, and hand one back
+  cl_mem AcquirePooledBuffer(size_t _sizeInBytes);
+  void ReturnPooledBuffer(cl_mem _buffer);
+  // Capacity of a pooled buffer, 0 if the buffer isn't from the pool
+  size_t PooledCapacity(cl_mem _buffer) const;
+
+  // Binary cache key for source and build options on the current device
+  // and driver
+  uint64_t BinaryKey(const std::string &_source, 
+                     const std::string &_options) const;
+  std::string BinaryFilename(const std::string &_programName,
+                             uint64_t _key) const;
+  // Create and build a program from a cached binary. Returns NULL on a
+  // miss, and removes cache files that can't be used.
+  cl_program LoadProgramBinary(const std::string &_programName,
+                               uint64_t _key, const std::string &_options);
+  bool SaveProgramBinary(const std::string &_programName, uint64_t _key,
+                         cl_program _program);
+
   static const unsigned int MAX_PLATFORMS = 32;
   static const unsigned int MAX_DEVICES = 32;
   static const unsigned int MAX_NAME_LENGTH = 128;
@@ -122,9 +242,22 @@ private:
   char platformVersion_[MAX_NAME_LENGTH];
   cl_context context_;
   cl_command_queue commandQueues_[NUM_QUEUE_INDICES];
+  // Acquire and release of GL objects are synchronized with GL 
+  // (cl_khr_gl_event), so no glFinish or wait is needed around them
+  bool glEventSupport_;
+  bool profiling_;
 
   // Programs are mapped using strings
   std::map<std::string, CLProgram*> clPrograms_;
+  std::string binaryCacheDir_;
+
+  // Capacity of every pooled buffer, and the ones not in use by capacity
+  std::map<cl_mem, size_t> pooledBuffers_;
+  std::multimap<size_t, cl_mem> freeBuffers_;
+  // Buffers behind the pinned memory, by mapped pointer
+  std::map<void*, cl_mem> pinnedMemory_;
+  // Smallest pooled buffer, capacities are powers of two from here
+  static const size_t MIN_POOLED_SIZE = 4096;
 
 };
 
@@ -13,6 +13,7 @@
 #endif
 #include <map>
 #include <string>
+#include <vector>
 #include <KernelConstants.h>
 
 namespace osp {
@@ -37,8 +38,18 @@ public:
   cl_int Error() { return error_; }
 
   bool CreateProgram(std::string _fileName);
-  bool BuildProgram();
+  // Build with the given compiler options (e.g. -D defines). Binaries
+  // are cached on disk by the CL manager and reused on the next run.
+  bool BuildProgram(const std::string &_options);
   bool CreateKernel();
+
+  // Queue that all commands of the program are enqueued on
+  void SetQueue(cl_command_queue _queue);
+  // Make the next acquire or launch wait for an event, typically the last
+  // command of a program on another queue
+  bool AddWaitEvent(cl_event _event);
+  // Last command enqueued for the program, NULL if there is none yet
+  cl_event LastEvent() const { return event_; }
  
   bool AddTexture(unsigned int _argNr, Texture *_texture,
                   GLuint _textureType,
@@ -51,25 +62,70 @@ public:
   bool AddTexture(unsigned int _argNr, cl_mem _texture,
       cl_mem_flags _permissions);
 
+  // Share an OpenGL buffer object, returns the CL handle in _clBufferMem
+  bool AddGLBuffer(unsigned int _argNr, unsigned int _glBuffer,
+                   cl_mem_flags _permissions, cl_mem& _clBufferMem);
+
+  bool AddGLBuffer(unsigned int _argNr, cl_mem _buffer);
+
   bool AddBuffer(unsigned int _argNr, 
                  void *_hostPtr, 
                  unsigned int _sizeInBytes, 
                  cl_mem_flags _allocMode,
                  cl_mem_flags _permissions);
 
+  // Create a buffer and return its handle in _clBufferMem, so it can be
+  // set as an argument to other programs
+  bool AddBuffer(unsigned int _argNr,
+                 void *_hostPtr,
+                 unsigned int _sizeInBytes,
+                 cl_mem_flags _allocMode,
+                 cl_mem_flags _permissions,
+                 cl_mem& _clBufferMem);
+
+  // Set an existing buffer, the program does not take ownership
+  bool AddBuffer(unsigned int _argNr, cl_mem _buffer);
+
+  // Create a single channel float 3D image
+  bool AddImage3D(unsigned int _argNr, unsigned int _width,
+                  unsigned int _height, unsigned int _depth,
+                  cl_mem_flags _permissions, cl_mem& _clImageMem);
+
   bool ReadBuffer(unsigned int _argNr,
                   void *_hostPtr,
                   unsigned int _sizeInBytes,
                   cl_bool _blocking);
 
+  // Upload to the pooled buffer of an argument, replacing it with a 
+  // larger pooled buffer if needed
+  bool WriteBuffer(unsigned int _argNr,
+                   void *_hostPtr,
+                   unsigned int _sizeInBytes,
+                   cl_bool _blocking,
+                   cl_mem& _clBufferMem);
+
   bool ReleaseBuffer(unsigned int _argNr);
 
+  bool CopyBufferToImage(cl_mem _buffer, cl_mem _image,
+                         const std::vector<size_t> &_offsets,
+                         const std::vector<size_t> &_origins,
+                         const size_t _region[3]);
+
   bool SetInt(unsigned int _argNr, int _val);
    
   bool PrepareProgram();
   bool LaunchProgram(unsigned int _gx, unsigned int _gy,
                      unsigned int _lx, unsigned int _ly);
+  bool LaunchProgram(unsigned int _gx, unsigned int _lx);
+  // Enqueue the release of the shared GL objects (returns immediately)
+  bool ReleaseProgram();
+  // Block until the last command of the program is done
+  bool WaitForProgram();
+  // Make the released GL objects safe to use from GL
+  bool SyncGL();
   bool FinishProgram();
+  // Device times of the first and last command since PrepareProgram
+  bool ProgramTimes(cl_ulong &_start, cl_ulong &_end);
 
 private:
   CLProgram(const std::string &_programName, CLManager *_clManager);
@@ -77,17 +133,39 @@ private:
   CLProgram(const CLProgram&);
 
   char * ReadSource(const std::string &_fileName, int &_numChars) const;
+  // Replace #include "file" lines in the source with the file, relative 
+  // to the directory of _fileName. The build and binary caches are keyed
+  // by the source, so they see changes to included files too.
+  bool ExpandIncludes(const std::string &_fileName);
+  // Enqueue the kernel after any wait events
+  bool EnqueueKernel(cl_uint _dim, const size_t *_globalSize, 
+                     const size_t *_localSize);
+  // Replace the last event, and drop the wait events once enqueued
+  void SetLastEvent(cl_event _event);
+  void ClearWaitEvents();
 
   std::string programName_;
+  // Kernel source, kept for building with different options
+  std::string source_;
 
   CLManager *clManager_;
   cl_program program_;
   cl_kernel kernel_;
+  cl_command_queue queue_;
   cl_int error_;
-  // Stores device OGL textures together with their kernel arg nummer
+  // Last enqueued command, and events the next acquire or launch waits for
+  cl_event event_;
+  // First command enqueued since PrepareProgram, for profiling
+  cl_event startEvent_;
+  std::vector<cl_event> waitEvents_;
+  // Stores device OGL textures and buffers together with their kernel 
+  // arg nummer
   std::map<cl_uint, cl_mem> OGLTextures_;
   // Stores non-texture memory buffer arguments
   std::map<cl_uint, MemArg> memArgs_;
+  // What each argument is currently set to in the kernel, so that 
+  // unchanged arguments aren't set again
+  std::map<cl_uint, cl_mem> boundArgs_;
 
 };
 
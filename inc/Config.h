@@ -32,14 +32,27 @@ public:
   std::string RaycasterKernelFilename()const{return raycasterKernelFilename_;}
   std::string TSPTraversalKernelFilename() const 
     { return TSPTraversalKernelFilename_; }
+  std::string BrickScatterKernelFilename() const 
+    { return brickScatterKernelFilename_; }
+  std::string TSPCutKernelFilename() const 
+    { return TSPCutKernelFilename_; }
+  std::string BrickLookupKernelFilename() const 
+    { return brickLookupKernelFilename_; }
+  std::string ClearRequestsKernelFilename() const 
+    { return clearRequestsKernelFilename_; }
+  std::string CompactRequestsKernelFilename() const 
+    { return compactRequestsKernelFilename_; }
+  std::string KernelBinaryCacheDir() const 
+    { return kernelBinaryCacheDir_; }
   std::string CubeShaderVertFilename() const { return cubeShaderVertFilename_;}
   std::string CubeShaderFragFilename() const { return cubeShaderFragFilename_;}
   std::string QuadShaderVertFilename() const { return quadShaderVertFilename_;}
   std::string QuadShaderFragFilename() const { return quadShaderFragFilename_;}
   float SpatialErrorTolerance() const { return spatialErrorTolerance_; }
   float TemporalErrorTolerance() const { return temporalErrorTolerance_; }
-  float TSPTraversalStepsize() const { return TSPTraversalStepsize_; }
   float RaycasterStepsize() const { return raycasterStepsize_; }
+  float RaycasterOpacityThreshold() const 
+    { return raycasterOpacityThreshold_; }
   float RaycasterIntensity() const { return raycasterIntensity_; }
   float AnimatorRefreshInterval() const { return animatorRefreshInterval_; }
   float MousePitchFactor() const { return mousePitchFactor_; }
@@ -56,6 +69,18 @@ public:
   float RollSpeed() const { return rollSpeed_; }
   float YawSpeed() const { return yawSpeed_; }
   bool TakeScreenshot() const { return takeScreenshot_; }
+  float BrickAliasEpsilon() const { return brickAliasEpsilon_; }
+  int BrickEncoding() const { return brickEncoding_; }
+  int WaveletInitialBands() const { return waveletInitialBands_; }
+  int WaveletRefineBudget() const { return waveletRefineBudget_; }
+  int BrickLookupGrid() const { return brickLookupGrid_; }
+  int EmptySpaceSkipping() const { return emptySpaceSkipping_; }
+  int PreintegratedTF() const { return preintegratedTF_; }
+  int AtlasTransferQueue() const { return atlasTransferQueue_; }
+  int CLProfiling() const { return clProfiling_; }
+  int PipelineDepth() const { return pipelineDepth_; }
+  int FrameGraphReport() const { return frameGraphReport_; }
+  int PersistentStaging() const { return persistentStaging_; }
 
 private:
   Config();
@@ -74,14 +99,20 @@ private:
   std::string TFFilename_;
   std::string raycasterKernelFilename_;
   std::string TSPTraversalKernelFilename_;
+  std::string brickScatterKernelFilename_;
+  std::string TSPCutKernelFilename_;
+  std::string brickLookupKernelFilename_;
+  std::string clearRequestsKernelFilename_;
+  std::string compactRequestsKernelFilename_;
+  std::string kernelBinaryCacheDir_;
   std::string cubeShaderVertFilename_;
   std::string cubeShaderFragFilename_;
   std::string quadShaderVertFilename_;
   std::string quadShaderFragFilename_;
   float spatialErrorTolerance_;
   float temporalErrorTolerance_;
-  float TSPTraversalStepsize_;
   float raycasterStepsize_;
+  float raycasterOpacityThreshold_;
   float raycasterIntensity_;
   float animatorRefreshInterval_;
   float mousePitchFactor_;
@@ -98,6 +129,18 @@ private:
   float rollSpeed_;
   float yawSpeed_;
   bool takeScreenshot_;
+  float brickAliasEpsilon_;
+  int brickEncoding_;
+  int waveletInitialBands_;
+  int waveletRefineBudget_;
+  int brickLookupGrid_;
+  int emptySpaceSkipping_;
+  int preintegratedTF_;
+  int atlasTransferQueue_;
+  int clProfiling_;
+  int pipelineDepth_;
+  int frameGraphReport_;
+  int persistentStaging_;
 
 
 };
@@ -0,0 +1,94 @@
+#ifndef FRAMEGRAPH_H_
+#define FRAMEGRAPH_H_
+
+/*
+ * Schedules the stages of a frame from their declared dependencies.
+ * Stages run on the render thread, since the GL context and the brick
+ * reader live there, and mostly enqueue work on a GL context or CL queue.
+ * A stage runs as soon as the stages it depends on have run, and only the
+ * declared dependencies order stages. Among the ready stages, the ones 
+ * that only enqueue work go before the ones that wait for results, so 
+ * that the GPU queues are kept busy while the host waits.
+ *
+ */
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <boost/timer/timer.hpp>
+
+namespace osp {
+
+class FrameGraph {
+public:
+  static FrameGraph * New();
+  ~FrameGraph();
+
+  // What a stage mostly keeps busy. Only a label for reports: stages 
+  // with the same label are not serialized by the graph, work on one CL
+  // queue is ordered by the in-order queue itself.
+  enum Label {
+    HOST = 0,
+    GL,
+    CL_EXECUTE,
+    CL_TRANSFER,
+    CL_TRAVERSAL,
+    IO,
+    NUM_LABELS
+  };
+
+  typedef std::function<bool()> StageFunction;
+
+  // Add a stage that runs after the named stages, which have to be added
+  // before it. Set _waits if the stage blocks on results from a device,
+  // to run it as late as its dependencies allow.
+  bool AddStage(const std::string &_name,
+                Label _label,
+                const std::vector<std::string> &_dependencies,
+                bool _waits,
+                StageFunction _function);
+
+  // Run every stage once. Stops at the first stage that fails.
+  bool Run();
+
+  // Log the average host time of each stage since the last report, and the
+  // longest chain of dependent stages by host time (the critical path). 
+  // Time spent on the devices is not measured. Stages on the
+  // critical path are marked with a *.
+  void Report();
+
+  // Frames run since the last report
+  unsigned int NumRuns() const { return numRuns_; }
+
+private:
+  FrameGraph();
+  FrameGraph(const FrameGraph&);
+
+  struct Stage {
+    std::string name_;
+    Label label_;
+    std::vector<unsigned int> dependencies_;
+    bool waits_;
+    StageFunction function_;
+    // Accumulated wall time since the last report, in seconds
+    double time_;
+  };
+
+  // Index of a named stage, -1 if there is none
+  int FindStage(const std::string &_name) const;
+
+  std::vector<Stage> stages_;
+  // Stages that have not run yet this frame, and dependencies left
+  // for each stage. Kept between frames to avoid reallocations.
+  std::vector<unsigned int> pending_;
+  std::vector<unsigned int> numWaiting_;
+  std::vector<std::vector<unsigned int> > dependents_;
+
+  unsigned int numRuns_;
+  boost::timer::cpu_timer timer_;
+
+};
+
+}
+
+#endif
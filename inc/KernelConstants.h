@@ -20,16 +20,25 @@ struct KernelConstants {
   float spatialTolerance_;
   int rootLevel_;
   int paddedBrickDim_;
+  // 1 if bricks are found through the lookup grid instead of the cut
+  int useLookupGrid_;
+  // Rays stop when their opacity reaches this
+  float opacityThreshold_;
+  // 1 if samples are classified through the pre-integrated table
+  int preintegrated_;
 };
 
 struct TraversalConstants {
   int gridType_;
+  // The raycaster's step size, traversal visits the same sample points
   float stepsize_;
   int numTimesteps_;
   int numValuesPerNode_;
   int numOTNodes_;
   float temporalTolerance_;
   float spatialTolerance_;
+  // Needed to bound the opacity the raycaster accumulates
+  float opacityThreshold_;
 };
 
 }
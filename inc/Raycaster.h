@@ -33,6 +33,7 @@ class Animator;
 class BrickManager;
 class CLManager;
 class Config;
+class FrameGraph;
 
 class Raycaster : public Renderer {
 public:
@@ -44,7 +45,7 @@ public:
   // Called by the SGCT window manager
   bool Reload();
 
-  // Init pipeline for double buffered setup
+  // Init pipeline, loads the first frame
   bool InitPipeline();
 
   // Reload GLSL shaders
@@ -155,6 +156,42 @@ private:
   unsigned int lastTimestep_;
   // Used for ping pong memory buffering
   unsigned int pingPongIndex_;
+  // Timestep each buffer in the ring holds bricks for, -1 if none
+  std::vector<int> bufferTimestep_;
+  // Buffer holding a timestep, -1 if none does
+  int FindBuffer(unsigned int _timestep) const;
+  // Mark a buffer as holding a timestep. No other buffer keeps the tag,
+  // so FindBuffer always returns the latest copy.
+  void TagBuffer(unsigned int _bufIdx, unsigned int _timestep);
+  // Timestep _steps ahead of the current one in the direction of playback
+  unsigned int TimestepAhead(unsigned int _steps) const;
+  // A buffer other than _keepBuf that can be reused, preferring ones that
+  // don't hold a timestep ahead. Pass the number of buffers to keep none.
+  unsigned int EvictableBuffer(unsigned int _keepBuf) const;
+  // Pick the timestep to traverse and stream this frame, and its buffer:
+  // the nearest timestep ahead that's missing from the ring, or else the
+  // next one again with the current view
+  void ScheduleNextFrame(unsigned int _currentBuf, unsigned int &_timestep,
+                         unsigned int &_bufIdx) const;
+  // Traverse and load a timestep into a buffer, waiting for all of it
+  bool PrepareFrame(unsigned int _timestep, unsigned int _bufIdx);
+
+  // Stages of a frame, run by the frame graph in the order their
+  // dependencies allow (see BuildFrameGraph)
+  FrameGraph *frameGraph_;
+  bool BuildFrameGraph();
+  bool RenderCubes();
+  // Set the current and next buffer, and the timestep to stream
+  bool SelectBuffers();
+  bool UploadAtlas();
+  bool UploadBrickList();
+  bool LaunchRaycaster();
+  bool RenderQuad();
+  // Buffers and timestep of the frame being rendered
+  unsigned int currentBuf_;
+  unsigned int nextTimestep_;
+  unsigned int nextBuf_;
+  cl_mem brickListCLmem_;
   // Kernel constants
   KernelConstants kernelConstants_;
   TraversalConstants traversalConstants_;
@@ -165,10 +202,77 @@ private:
   // Brick manager with access to brick data
   BrickManager *brickManager_;
 
-  bool LaunchTSPTraversal(unsigned int _timestep);
+  // Build the octree cut for a timestep into the cut buffer of _bufIdx,
+  // then launch the traversal that builds the brick request list from it
+  bool LaunchTSPTraversal(unsigned int _timestep, unsigned int _bufIdx);
+  // Per octree node brick for a timestep, or -1 if the traversal should
+  // continue to the children. One for each buffer index, since the
+  // raycaster uses the current cut while the next is built.
+  std::vector<cl_mem> cutCLmem_;
+  // Timestep and constants version each cut was built with
+  std::vector<unsigned int> cutTimestep_;
+  std::vector<unsigned int> cutVersion_;
+  // Incremented when the error tolerances may have changed
+  unsigned int constantsVersion_;
+
+  // Rebuild the brick lookup grid from the cut of _bufIdx and the brick 
+  // list buffer, unless the grid already matches them
+  bool UpdateLookupGrid(unsigned int _bufIdx, cl_mem _brickList);
+  // Finest level grid of atlas box coordinates and levels
+  cl_mem lookupCLmem_;
+  // What the current lookup grid was built from
+  bool lookupValid_;
+  unsigned int lookupTimestep_;
+  unsigned int lookupVersion_;
+  unsigned int lookupBuf_;
+  unsigned int lookupBrickListVersion_;
+
+  // Move the bricks staged by the brick manager into a PBO, or into the
+  // atlas of the buffer if the atlas is updated on the transfer queue
+  bool ScatterBricks(unsigned int _bufIdx);
+  bool CopyBricksToAtlas(unsigned int _bufIdx);
+  // Have the next write to the staging buffer of _bufIdx wait for the 
+  // transfer just enqueued from it, with persistent staging
+  bool FenceStaging(unsigned int _bufIdx);
+  // CL handles for the brick manager's staging buffers and PBOs
+  std::vector<cl_mem> stagingCLmem_;
+  std::vector<cl_mem> pboCLmem_;
+  // One atlas for each buffer index when it's updated on the transfer 
+  // queue. The raycaster reads the current one while bricks for the next
+  // are copied into the other, so no brick in use is overwritten.
+  bool atlasTransferQueue_;
+  std::vector<cl_mem> atlasCLmem_;
+  // Copies into the atlas the raycaster has not waited for yet
+  std::vector<bool> atlasPending_;
+  // Bricks moved by the last ScatterBricks
+  unsigned int numScattered_;
+  // Log device times of the last raycast and brick transfer and how much
+  // they overlapped (cl_profiling in config)
+  bool LogTransferOverlap();
 
-  // Brick request list
+  // Indices of the bricks requested by the last traversal, ascending
   std::vector<int> brickRequest_;
+  // Device request lists, one for each buffer index. Allocated once and
+  // cleared on the device before each traversal.
+  std::vector<cl_mem> reqCLmem_;
+  // Compacted (brick, count) pairs of each request list and their number
+  std::vector<cl_mem> requestedCLmem_;
+  std::vector<cl_mem> numRequestedCLmem_;
+  // Room for one cut, which never has more bricks than the finest level
+  unsigned int maxRequested_;
+  // Pinned host memory the requests are read into, the count followed by
+  // room for maxRequested_ pairs
+  int *requestReadback_;
+  // Read the compacted requests of the last traversal into brickRequest_
+  bool ReadBrickRequests();
+
+  // Least alpha any sample in each brick can have with the current
+  // transfer function, lets the traversal stop behind opaque bricks.
+  // Bricks where every sample is fully transparent are marked empty in
+  // the occupancy table, and are neither requested nor sampled.
+  bool UpdateBrickOpacity();
+  std::vector<float> brickMinAlpha_;
+  std::vector<int> brickOccupancy_;
 
   // TSP tree structure (not actual data)
   TSP *tsp_;
@@ -178,6 +282,9 @@ private:
 
   // Helper function for updating and binding kernel constants
   bool UpdateKernelConstants();
+  // Build options that compile the dataset invariant constants into the
+  // kernels, so that branches on them are resolved at build time
+  std::string KernelDefines() const;
 
   // For the corresponding CL kernel
   static const unsigned int cubeFrontArg_ = 0;
@@ -186,16 +293,58 @@ private:
   static const unsigned int textureAtlasArg_ = 3;
   static const unsigned int constantsArg_ = 4;
   static const unsigned int transferFunctionArg_ = 5; 
-  static const unsigned int tspArg_ = 6;
+  static const unsigned int cutArg_ = 6;
   static const unsigned int brickListArg_ = 7;
-  static const unsigned int timestepArg_ = 8;
+  static const unsigned int lookupArg_ = 8;
+  static const unsigned int occupancyArg_ = 9;
+  static const unsigned int preintegratedArg_ = 10;
 
   static const unsigned int tspCubeFrontArg_ = 0;
   static const unsigned int tspCubeBackArg_ = 1;
   static const unsigned int tspConstantsArg_ = 2;
-  static const unsigned int tspTSPArg_ = 3;
+  static const unsigned int tspCutArg_ = 3;
   static const unsigned int tspBrickListArg_ = 4;
-  static const unsigned int tspTimestepArg_ = 5;
+  static const unsigned int tspBrickMinAlphaArg_ = 5;
+  static const unsigned int tspOccupancyArg_ = 6;
+
+  static const unsigned int cutConstantsArg_ = 0;
+  static const unsigned int cutTSPArg_ = 1;
+  static const unsigned int cutCutArg_ = 2;
+  static const unsigned int cutTimestepArg_ = 3;
+  // Work group size for the cut kernel, one work item per octree node
+  static const unsigned int cutLocalSize_ = 64;
+
+  static const unsigned int lookupCutArg_ = 0;
+  static const unsigned int lookupBrickListArg_ = 1;
+  static const unsigned int lookupGridArg_ = 2;
+  static const unsigned int lookupNumBoxesPerAxisArg_ = 3;
+  static const unsigned int lookupRootLevelArg_ = 4;
+  static const unsigned int lookupOccupancyArg_ = 5;
+  // Work group size for the lookup kernel, one work item per cell
+  static const unsigned int lookupLocalSize_ = 64;
+
+  static const unsigned int clearReqListArg_ = 0;
+  static const unsigned int clearNumEntriesArg_ = 1;
+  static const unsigned int clearNumRequestedArg_ = 2;
+  // Work group size for the clear kernel, one work item per entry
+  static const unsigned int clearLocalSize_ = 64;
+
+  static const unsigned int compactReqListArg_ = 0;
+  static const unsigned int compactNumEntriesArg_ = 1;
+  static const unsigned int compactRequestedArg_ = 2;
+  static const unsigned int compactMaxRequestedArg_ = 3;
+  static const unsigned int compactNumRequestedArg_ = 4;
+  // Work group size for the compaction, one work item per entry
+  static const unsigned int compactLocalSize_ = 64;
+
+  static const unsigned int scatterBricksArg_ = 0;
+  static const unsigned int scatterSlotsArg_ = 1;
+  static const unsigned int scatterAtlasArg_ = 2;
+  static const unsigned int scatterPaddedBrickDimArg_ = 3;
+  static const unsigned int scatterNumBricksPerAxisArg_ = 4;
+  static const unsigned int scatterNumBricksArg_ = 5;
+  // Work group size along the voxels of a brick
+  static const unsigned int scatterLocalSize_ = 64;
 
   
   // Timer and timer constants 
@@ -20,6 +20,7 @@
 #include <list>
 #include <string>
 #include <iostream>
+#include <cstdio>
 
 namespace osp {
 
@@ -64,6 +65,26 @@ public:
   bool WriteCache();
 
   bool ReadHeader();
+
+  // Hash the contents of every brick and build a table that maps each brick
+  // to a canonical brick with the same contents. Bricks with values that all
+  // differ by at most the configured epsilon are considered equal.
+  bool CalculateBrickAliases();
+  // Tries to read cached alias table (fails if epsilon or the TSP file
+  // has changed)
+  bool ReadAliasCache();
+  // Write alias table to cache
+  bool WriteAliasCache();
+  // Point the brick index of every aliased node to its canonical brick,
+  // so that traversal requests and brick lookups only see canonical bricks
+  bool ApplyBrickAliases();
+
+  // Find the min and max value of every brick (padding included)
+  bool CalculateBrickRanges();
+  // Tries to read cached brick ranges
+  bool ReadRangeCache();
+  // Write brick ranges to cache
+  bool WriteRangeCache();
   
   // Functions to build TSP tree and calculate errors
   bool Construct();
@@ -84,6 +105,9 @@ public:
   unsigned int NumBSTNodes() const { return numBSTNodes_; }
   unsigned int NumOTNodes() const { return numOTNodes_; }
   unsigned int NumOTLevels() const { return numOTLevels_; }
+  unsigned int NumUniqueBricks() const { return numUniqueBricks_; }
+  // Min and max value of each brick, empty if not calculated
+  const std::vector<float> & BrickRanges() const { return brickRanges_; }
 
 private:
   TSP();
@@ -117,6 +141,13 @@ private:
 
   const unsigned int paddingWidth_ = 1;
 
+  // Canonical brick index for every brick (identity if unique)
+  std::vector<int> brickAliases_;
+  unsigned int numUniqueBricks_;
+
+  // Min and max value for every brick, interleaved
+  std::vector<float> brickRanges_;
+
   // Error stats
   float minSpatialError_;
   float maxSpatialError_;
@@ -141,6 +172,10 @@ private:
   // Position of first data entry (after header)
   off dataPos_;
 
+  // Read one brick from the open TSP file
+  bool ReadBrick(std::FILE *_in, unsigned int _brickIndex, 
+                 std::vector<float> &_buffer);
+
   // Calculate weighted square distance between two RGBA colors
   // c2 should be an averaged or zero color
   float SquaredDist(Color _c1, Color _c2);
@@ -11,6 +11,7 @@ TODO Use Texture1D for implementation when OpenCL 1.2 is supported
 
 #include <MappingKey.h>
 #include <set>
+#include <vector>
 #include <string>
 #include <iostream>
 
@@ -37,6 +38,12 @@ public:
   // Host side sample
   bool Sample(float &_r, float &_g, float &_b, float &_a, float _i);
 
+  // Lower bound of the alpha that the (linearly filtered) texture returns
+  // for any intensity in [_lower, _upper]
+  float MinAlpha(float _lower, float _upper) const;
+  // Upper bound, 0 means that all those intensities are invisible
+  float MaxAlpha(float _lower, float _upper) const;
+
   // Take the saved values and construct a texture
   bool ConstructTexture();
   // Read TF from the in file
@@ -45,10 +52,19 @@ public:
   
   // Mutators
   void SetInFilename(const std::string &_inFilename);
+  // Build the pre-integration table in ConstructTexture (preintegrated_tf
+  // in config)
+  void SetPreintegrated(bool _preintegrated);
 
   // Accessors
   unsigned int Width() const { return width_; }
   Texture2D * Texture() { return texture_; }
+  // Color and opacity of a base step long ray segment, indexed by the 
+  // intensity at its front (x) and back (y). Without pre-integration the
+  // plain texture stands in, so that the kernel argument can be set.
+  Texture2D * PreintegratedTexture() { 
+    return preintegratedTexture_ ? preintegratedTexture_ : texture_; 
+  }
   
   // TODO temp
   float * FloatData() { return floatData_; }
@@ -62,13 +78,31 @@ private:
   float *floatData_;
   
   Texture2D *texture_;
+  Texture2D *preintegratedTexture_;
+  // Side of the pre-integration table
+  static const unsigned int MAX_PREINTEGRATION_SIZE = 512;
+  bool ConstructPreintegratedTexture();
+  // Value from 0 to intensity _i of a running integral stored at texel
+  // edges, channel _c of _stride
+  double Integral(const std::vector<double> &_edges, unsigned int _stride,
+                  unsigned int _c, double _i) const;
   unsigned int width_;
   float lower_;
   float upper_;
   bool generatedTexture_;
+  bool preintegrated_;
   std::string inFilename_;
   std::set<MappingKey> mappingKeys_;
   Interpolation interpolation_;
+  // Sparse tables for range queries on alpha, level k holds the minimum
+  // and maximum of texels [i, i+2^k)
+  std::vector<std::vector<float> > minAlpha_;
+  std::vector<std::vector<float> > maxAlpha_;
+  void BuildAlphaTables();
+  // Texels a filtered lookup of [_lower, _upper] can touch, as the start
+  // of two table spans at _level that together cover them
+  void TexelRange(float _lower, float _upper, int &_first, int &_last,
+                  unsigned int &_level) const;
 
   // Linearly interpolate between two values. Distance
   // is assumed to be normalized.
@@ -7,6 +7,10 @@ Global helper functions and utilities
 #define UTILS_H_
 
 #include <iostream>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+#include <cstdio>
 
  namespace osp {
 
@@ -19,6 +23,27 @@ Global helper functions and utilities
 // the error so that it can be compared to GL_NO_ERROR, for example
 unsigned int CheckGLError(std::string _location);
 
+// 64 bit FNV-1a hash of a block of memory. Pass the result of a previous
+// call as the seed to hash several blocks as one.
+uint64_t Hash64(const void *_data, size_t _sizeInBytes,
+                uint64_t _seed = 14695981039346656037ULL);
+
+// _filename with a suffix unique to this host and process. Files are 
+// written under this name and renamed into place when complete, so that
+// processes sharing a directory never see each other's partial files.
+std::string TempFilename(const std::string &_filename);
+
+// Close a file written under _tmpFilename and rename it to _filename. 
+// The temporary file is removed instead unless _success and every write
+// went through.
+bool FinishTempFile(std::FILE *_out, const std::string &_tmpFilename,
+                    const std::string &_filename, bool _success);
+
+// Size and modification time of a file. Files derived from it store them,
+// so that they are rebuilt when it changes.
+bool FileStamp(const std::string &_filename, uint64_t &_size, 
+               uint64_t &_time);
+
 }
 
 #endif
@@ -0,0 +1,107 @@
+// Distances along a ray to where it leaves a brick, for cartesian and 
+// spherical grids. Shared by the traversal and the raycaster, which have
+// to agree on where each brick ends. Included into their source when the
+// programs are created.
+
+// Distance along a ray from _P to where it leaves the box [_min, _max]
+float BoxExitDistance(float3 _P, float3 _rayD, float3 _min, float3 _max) {
+  float3 bound = select(_min, _max, isgreater(_rayD, (float3)(0.0)));
+  float3 t = (bound - _P) / _rayD;
+  // Axes the ray is parallel to never limit the distance
+  t = select(t, (float3)(INFINITY), isequal(_rayD, (float3)(0.0)));
+  return fmin(t.x, fmin(t.y, t.z));
+}
+
+// Roots of _a*t^2 + _b*t + _c = 0, smallest first. Missing roots are 
+// INFINITY.
+float2 QuadraticRoots(float _a, float _b, float _c) {
+  if (fabs(_a) < 1e-12) {
+    if (_b == 0.0) return (float2)(INFINITY);
+    return (float2)(-_c/_b, INFINITY);
+  }
+  // A ray touching the surface can get a slightly negative discriminant
+  // from rounding
+  float discriminant = _b*_b - 4.0*_a*_c;
+  if (discriminant < -1e-5*(_b*_b + fabs(4.0*_a*_c))) {
+    return (float2)(INFINITY);
+  }
+  discriminant = fmax(discriminant, 0.0);
+  float q = sqrt(discriminant);
+  float t0 = (-_b - q) / (2.0*_a);
+  float t1 = (-_b + q) / (2.0*_a);
+  return (float2)(fmin(t0, t1), fmax(t0, t1));
+}
+
+// Smallest root that is ahead on the ray, INFINITY if there is none
+float FirstHit(float2 _roots) {
+  if (_roots.x > 0.0) return _roots.x;
+  if (_roots.y > 0.0) return _roots.y;
+  return INFINITY;
+}
+
+// Distance to where a ray from _c in direction _D ([-1..1] space) crosses
+// the sphere with normalized radius _r
+float SphereHit(float3 _c, float3 _D, float _r) {
+  float R = _r*native_sqrt(3.0);
+  return FirstHit(QuadraticRoots(dot(_D, _D), 2.0*dot(_c, _D), 
+                                 dot(_c, _c) - R*R));
+}
+
+// Same for the cone with normalized polar angle _theta
+float ConeHit(float3 _c, float3 _D, float _theta) {
+  float k = cospi(_theta);
+  // At the equator the cone is the plane z=0, where the quadratic 
+  // degenerates
+  if (fabs(k) < 1e-6) {
+    if (_D.z == 0.0) return INFINITY;
+    float t = -_c.z/_D.z;
+    return t > 0.0 ? t : INFINITY;
+  }
+  float k2 = k*k;
+  float2 roots = QuadraticRoots(_D.z*_D.z - k2*dot(_D, _D),
+                                2.0*(_c.z*_D.z - k2*dot(_c, _D)),
+                                _c.z*_c.z - k2*dot(_c, _c));
+  // The quadratic also holds on the mirrored cone
+  if ((_c.z + roots.x*_D.z)*k < 0.0) roots.x = -1.0;
+  if ((_c.z + roots.y*_D.z)*k < 0.0) roots.y = -1.0;
+  return FirstHit(roots);
+}
+
+// Same for the half plane with normalized azimuth _phi
+float HalfPlaneHit(float3 _c, float3 _D, float _phi) {
+  float angle = _phi*2.0*M_PI - M_PI;
+  float2 dir = (float2)(cos(angle), sin(angle));
+  float2 normal = (float2)(-dir.y, dir.x);
+  float denom = dot(normal, _D.xy);
+  if (denom == 0.0) return INFINITY;
+  float t = -dot(normal, _c.xy) / denom;
+  // The plane equation also holds on the other half
+  if (dot(dir, _c.xy + t*_D.xy) < 0.0) return INFINITY;
+  return t > 0.0 ? t : INFINITY;
+}
+
+// Distance along a ray from the cartesian point _P to where it first
+// crosses one of the surfaces bounding the spherical box [_min, _max]
+// (normalized r, theta, phi). The ray can't leave the box without
+// crossing one, so this never overshoots the exit.
+float SphericalBoxExitDistance(float3 _P, float3 _rayD, 
+                               float3 _min, float3 _max) {
+  // Same [-1..1] space as CartesianToSpherical, where distances double
+  float3 c = (float3)(-1.0) + 2.0*_P;
+  float3 D = 2.0*_rayD;
+  float t = fmin(SphereHit(c, D, _min.x), SphereHit(c, D, _max.x));
+  t = fmin(t, fmin(ConeHit(c, D, _min.y), ConeHit(c, D, _max.y)));
+  t = fmin(t, fmin(HalfPlaneHit(c, D, _min.z), HalfPlaneHit(c, D, _max.z)));
+  return t;
+}
+
+// Distance along a ray from the cartesian point _P to where it leaves 
+// the brick [_min, _max], or a lower bound of it for spherical grids
+float BrickExitDistance(int _gridType, float3 _P, float3 _rayD,
+                        float3 _min, float3 _max) {
+  if (_gridType == 0) {
+    return BoxExitDistance(_P, _rayD, _min, _max);
+  } else {
+    return SphericalBoxExitDistance(_P, _rayD, _min, _max);
+  }
+}
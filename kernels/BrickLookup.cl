@@ -0,0 +1,53 @@
+// Flatten the octree cut of the current frame into a dense grid at the
+// finest brick resolution. Each cell holds the atlas box coordinates (xyz)
+// and the octree level (w, 0 for leaves) of the brick that covers it, so
+// the raycaster can find a brick with a single lookup. Bricks that are
+// empty with the current transfer function get -1 atlas coordinates.
+// One work item per cell, cells are stored x first.
+__kernel void BrickLookup(__global const int *_cut,
+                          __global const int *_brickList,
+                          __global int4 *_lookup,
+                          int _numBoxesPerAxis,
+                          int _rootLevel,
+                          __global const int *_occupancy) {
+  int cell = get_global_id(0);
+  // Compiled in when available
+#ifdef NUM_BOXES_PER_AXIS
+  const int numBoxes = NUM_BOXES_PER_AXIS;
+  const int rootLevel = ROOT_LEVEL;
+#else
+  const int numBoxes = _numBoxesPerAxis;
+  const int rootLevel = _rootLevel;
+#endif
+  int numCells = numBoxes*numBoxes*numBoxes;
+
+  // Global size is rounded up to the work group size
+  if (cell >= numCells) return;
+
+  int x = cell % numBoxes;
+  int y = (cell / numBoxes) % numBoxes;
+  int z = cell / (numBoxes*numBoxes);
+
+  // Walk down the cut. The bits of the cell coordinates pick the child at
+  // each level, most significant bit first.
+  int otNodeIndex = 0;
+  int level = rootLevel;
+  int brickIndex = _cut[otNodeIndex];
+  while (brickIndex == -1 && level > 0) {
+    level--;
+    int child = ((x >> level) & 1) |
+                (((y >> level) & 1) << 1) |
+                (((z >> level) & 1) << 2);
+    otNodeIndex = 8*otNodeIndex + 1 + child;
+    brickIndex = _cut[otNodeIndex];
+  }
+
+  if (_occupancy[brickIndex] == 0) {
+    _lookup[cell] = (int4)(-1, -1, -1, level);
+  } else {
+    _lookup[cell] = (int4)(_brickList[3*brickIndex+0],
+                           _brickList[3*brickIndex+1],
+                           _brickList[3*brickIndex+2],
+                           level);
+  }
+}
@@ -0,0 +1,40 @@
+// Copy bricks from a compact stream (brick after brick, as read from disk)
+// into their slots in an atlas shaped buffer.
+// One work item per voxel (x) and brick (y).
+__kernel void BrickScatter(__global const float *_bricks,
+                           __global const int *_slots,
+                           __global float *_atlas,
+                           int _paddedBrickDim,
+                           int _numBricksPerAxis,
+                           int _numBricks) {
+  int voxel = get_global_id(0);
+  int brick = get_global_id(1);
+  // Compiled in when available, so the divisions below are by a constant
+#ifdef PADDED_BRICK_DIM
+  const int paddedBrickDim = PADDED_BRICK_DIM;
+#else
+  const int paddedBrickDim = _paddedBrickDim;
+#endif
+  int numBrickVals = paddedBrickDim*paddedBrickDim*paddedBrickDim;
+
+  // Global size is rounded up to the work group size
+  if (voxel >= numBrickVals || brick >= _numBricks) return;
+
+  // Slot to brick coordinates in atlas
+  int slot = _slots[brick];
+  int bx = slot % _numBricksPerAxis;
+  int by = (slot / _numBricksPerAxis) % _numBricksPerAxis;
+  int bz = slot / (_numBricksPerAxis*_numBricksPerAxis);
+
+  // Voxel coordinates within brick
+  int x = voxel % paddedBrickDim;
+  int y = (voxel / paddedBrickDim) % paddedBrickDim;
+  int z = voxel / (paddedBrickDim*paddedBrickDim);
+
+  int atlasDim = paddedBrickDim*_numBricksPerAxis;
+  int idx = (bx*paddedBrickDim + x) +
+            (by*paddedBrickDim + y)*atlasDim +
+            (bz*paddedBrickDim + z)*atlasDim*atlasDim;
+
+  _atlas[idx] = _bricks[brick*numBrickVals + voxel];
+}
@@ -0,0 +1,15 @@
+// Reset a brick request list to zeros before a traversal, so that the 
+// list never has to be uploaded from the host. Also resets the count of 
+// the compacted list. One work item per entry.
+__kernel void ClearRequests(__global int *_reqList,
+                            int _numEntries,
+                            __global int *_numRequested) {
+  int i = get_global_id(0);
+
+  if (i == 0) *_numRequested = 0;
+
+  // Global size is rounded up to the work group size
+  if (i >= _numEntries) return;
+
+  _reqList[i] = 0;
+}
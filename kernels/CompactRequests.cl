@@ -0,0 +1,22 @@
+// Gather the nonzero entries of a brick request list into a dense list of
+// (brick index, request count) pairs, appended in no particular order.
+// The number of pairs is counted in _numRequested, which ClearRequests
+// resets before the traversal. One work item per request list entry.
+__kernel void CompactRequests(__global const int *_reqList,
+                              int _numEntries,
+                              __global int2 *_requested,
+                              int _maxRequested,
+                              __global volatile int *_numRequested) {
+  int i = get_global_id(0);
+
+  // Global size is rounded up to the work group size
+  if (i >= _numEntries) return;
+
+  int count = _reqList[i];
+  if (count == 0) return;
+
+  int pos = atomic_inc(_numRequested);
+  if (pos < _maxRequested) {
+    _requested[pos] = (int2)(i, count);
+  }
+}
@@ -10,8 +10,26 @@ struct KernelConstants {
   float spatialTolerance_;
   int rootLevel_;
   int paddedBrickDim_;
+  int useLookupGrid_;
+  float opacityThreshold_;
+  int preintegrated_;
 };
 
+// Dataset constants are normally compiled in as build options. Without
+// them they are read from the constants in scope.
+#ifndef GRID_TYPE
+#define GRID_TYPE (_constants->gridType_)
+#endif
+#ifndef NUM_BOXES_PER_AXIS
+#define NUM_BOXES_PER_AXIS (_constants->numBoxesPerAxis_)
+#endif
+#ifndef ROOT_LEVEL
+#define ROOT_LEVEL (_constants->rootLevel_)
+#endif
+#ifndef PADDED_BRICK_DIM
+#define PADDED_BRICK_DIM (_constants->paddedBrickDim_)
+#endif
+
         
 // Turn normalized [0..1] cartesian coordinates 
 // to normalized spherical [0..1] coordinates
@@ -74,91 +92,10 @@ int OctreeRootNodeIndex() {
 }
 */
 
-// Return index to left BST child (low timespan)
-int LeftBST(int _bstNodeIndex, int _numValuesPerNode, int _numOTNodes,
-            bool _bstRoot, __global __read_only int *_tsp) {
-  // If the BST node is a root, the child pointer is used for the OT. 
-  // The child index is next to the root.
-  // If not root, look up in TSP structure.
-  if (_bstRoot) {
-    return _bstNodeIndex + _numOTNodes;
-  } else {
-    return _tsp[_bstNodeIndex*_numValuesPerNode + 1];
-  }
-}
-
-// Return index to right BST child (high timespan)
-int RightBST(int _bstNodeIndex, int _numValuesPerNode, int _numOTNodes,
-             bool _bstRoot, __global __read_only int *_tsp) {
-  if (_bstRoot) {
-    return _bstNodeIndex + _numOTNodes*2;
-  } else {
-    return _tsp[_bstNodeIndex*_numValuesPerNode + 1] + _numOTNodes;
-  }
-}
-
-// Return child node index given a BST node, a time span and a timestep
-// Updates timespan
-int ChildNodeIndex(int _bstNodeIndex, 
-                   int *_timespanStart,
-                   int *_timespanEnd,
-                   int _timestep,
-                   int _numValuesPerNode,
-                   int _numOTNodes,
-                   bool _bstRoot,
-                   __global __read_only int *_tsp) {
-  // Choose left or right child
-  int middle = *_timespanStart + (*_timespanEnd - *_timespanStart)/2; 
-  if (_timestep <= middle) {
-    // Left subtree
-    *_timespanEnd = middle;
-    return LeftBST(_bstNodeIndex, _numValuesPerNode, _numOTNodes, 
-                   _bstRoot, _tsp);
-  } else {
-    // Right subtree
-    *_timespanStart = middle+1;
-    return RightBST(_bstNodeIndex, _numValuesPerNode, _numOTNodes,
-                    _bstRoot, _tsp);
-  }
-}
-
-// Return the brick index that a BST node represents
-int BrickIndex(int _bstNodeIndex, int _numValuesPerNode, 
-               __global __read_only int *_tsp) {
-  return _tsp[_bstNodeIndex*_numValuesPerNode + 0];
-}
-
-// Checks if a BST node is a leaf ot not
-bool IsBSTLeaf(int _bstNodeIndex, int _numValuesPerNode, 
-               bool _bstRoot, __global __read_only int *_tsp) {
-  if (_bstRoot) return false;
-  return (_tsp[_bstNodeIndex*_numValuesPerNode + 1] == -1);
-}
-
-// Checks if an OT node is a leaf or not
-bool IsOctreeLeaf(int _otNodeIndex, int _numValuesPerNode, 
-                  __global __read_only int *_tsp) {
-  // CHILD_INDEX is at offset 1, and -1 represents leaf
-  return (_tsp[_otNodeIndex*_numValuesPerNode + 1] == -1);
-}
-
-// Return OT child index given current node and child number (0-7)
-int OTChildIndex(int _otNodeIndex, int _numValuesPerNode,
-                 int _child, 
-                 __global __read_only int *_tsp) {
-  int firstChild = _tsp[_otNodeIndex*_numValuesPerNode + 1];
-  return firstChild + _child;
-}
-
-float TemporalError(int _bstNodeIndex, int _numValuesPerNode, 
-
-                    __global __read_only int *_tsp) {
-  return as_float(_tsp[_bstNodeIndex*_numValuesPerNode + 3]);
-}
-
-float SpatialError(int _bstNodeIndex, int _numValuesPerNode, 
-                  __global __read_only int *_tsp) {
-  return as_float(_tsp[_bstNodeIndex*_numValuesPerNode + 2]);
+// Return OT child index given current node and child number (0-7).
+// The children of node k are stored at 8k+1 to 8k+8.
+int OTChildIndex(int _otNodeIndex, int _child) {
+  return 8*_otNodeIndex + 1 + _child;
 }
 
 // Converts a global coordinate [0..1] to a box coordinate [0..boxesPerAxis]
@@ -189,119 +126,54 @@ float3 InBoxCoords(float3 _globalCoords, int3 _boxCoords,
   return (float3)(low) + inbox * ((float3)(high)-(float3)(low));
 }
 
-float3 AtlasCoords(float3 _globalCoords, int _brickIndex, int _boxesPerAxis,
-                   int _paddedBrickDim, int _level, 
-                   __global __read_only int *_brickList) {
-
-  // Use current octree level to calculate dividing factor for coordinates
-  int divisor = (int)pow(2.0, _level);
- 
-  // Calculate box coordinates, taking current subdivision level into account
-  int3 boxCoords = BoxCoords(_globalCoords, _boxesPerAxis/divisor);
+// Atlas coordinates for a point inside a brick, given the brick's box
+// coordinates at its level and its box coordinates in the atlas
+float3 AtlasCoords(float3 _globalCoords, int3 _boxCoords, int3 _atlasBoxCoords,
+                   int _boxesPerAxis, int _paddedBrickDim, int _divisor) {
 
   // Calculate local in-box coordinates for the point
-  float3 inBoxCoords = InBoxCoords(_globalCoords, boxCoords, 
-                                   _boxesPerAxis/divisor,
-                                   _paddedBrickDim*divisor);
-
-  // Fetch atlas box coordinates
-  int3 atlasBoxCoords = AtlasBoxCoords(_brickIndex, _brickList);
+  float3 inBoxCoords = InBoxCoords(_globalCoords, _boxCoords, 
+                                   _boxesPerAxis/_divisor,
+                                   _paddedBrickDim*_divisor);
 
   // Transform coordinates to atlas coordinates
   return inBoxCoords/(float)_boxesPerAxis +
-         convert_float3(atlasBoxCoords)/(float)_boxesPerAxis;
+         convert_float3(_atlasBoxCoords)/(float)_boxesPerAxis;
 }
 
 
 
 // Sample atlas
-void SampleAtlas(float4 *_color, float3 _coords, int _brickIndex,
-                 int _boxesPerAxis, int _paddedBrickDim, int _level,
-                 const sampler_t _atlasSampler,
-                 __global __read_only image3d_t _textureAtlas,
-                 __global __read_only image2d_t _transferFunction,
-                 const sampler_t _tfSampler,
-                 __global __read_only int *_brickList) {
+// _stepRatio is the length of the step the sample represents, relative
+// to the base step size that the transfer function is made for
+float SampleAtlas(float3 _coords, int3 _boxCoords, int3 _atlasBoxCoords,
+                  int _boxesPerAxis, int _paddedBrickDim, int _divisor,
+                  const sampler_t _atlasSampler,
+                  __global __read_only image3d_t _textureAtlas) {
 
   // Find the texture atlas coordinates for the point
-  float3 atlasCoords = AtlasCoords(_coords, _brickIndex, 
-                                   _boxesPerAxis, _paddedBrickDim,
-                                   _level, _brickList);
+  float3 atlasCoords = AtlasCoords(_coords, _boxCoords, _atlasBoxCoords,
+                                   _boxesPerAxis, _paddedBrickDim, _divisor);
 
-  int3 boxCoords = BoxCoords(_coords, _boxesPerAxis);
-  
   float4 a4 = (float4)(atlasCoords.x, atlasCoords.y, atlasCoords.z, 1.0);
   // Sample the atlas
-  float sample = read_imagef(_textureAtlas, _atlasSampler, a4).x;
-  // Composition
-  float4 tf = read_imagef(_transferFunction, _tfSampler, (float2)(sample, 0.0));
-  *_color += (1.0 - _color->w)*tf;
-
+  return read_imagef(_textureAtlas, _atlasSampler, a4).x;
 }
 
-
-bool TraverseBST(int _otNodeIndex, int *_brickIndex,
-                 __constant __read_only struct KernelConstants *_constants,
-                 __global __read_only int *_tsp, const int _timestep) {
-  // Start att the root of the current BST
-  int bstNodeIndex = _otNodeIndex;
-  bool bstRoot = true;
-  int timespanStart = 0;
-  int timespanEnd = _constants->numTimesteps_;
-
-  while (true) {
-    *_brickIndex = BrickIndex(bstNodeIndex, 
-                              _constants->numValuesPerNode_,
-                              _tsp);
-
-    // Check temporal error
-    if (TemporalError(bstNodeIndex, _constants->numValuesPerNode_, _tsp) <=
-        _constants->temporalTolerance_) {
-
-      // If the OT node is a leaf, we cannot do any better spatially
-      if (IsOctreeLeaf(_otNodeIndex, _constants->numValuesPerNode_, _tsp)) {
-        return true;
-
-      } else if (SpatialError(bstNodeIndex, _constants->numValuesPerNode_,
-                              _tsp) <= _constants->spatialTolerance_) {
-        return true;
-
-      } else if (IsBSTLeaf(bstNodeIndex, _constants->numValuesPerNode_,
-                           bstRoot, _tsp)) {
-        return false;
-
-      } else {
-
-        // Keep traversing
-        bstNodeIndex = ChildNodeIndex(bstNodeIndex, &timespanStart,
-                                      &timespanEnd, 
-                                      _timestep,
-                                      _constants->numValuesPerNode_,
-                                      _constants->numOTNodes_,
-                                      bstRoot, _tsp);
-      }
-
-    } else if (IsBSTLeaf(bstNodeIndex, _constants->numValuesPerNode_,
-                         bstRoot, _tsp)) {
-      return false;
-
-    } else {
-
-      // Keep traversing
-      bstNodeIndex = ChildNodeIndex(bstNodeIndex, &timespanStart,
-                                    &timespanEnd,
-                                    _timestep,
-                                    _constants->numValuesPerNode_,
-                                    _constants->numOTNodes_,
-                                    bstRoot, _tsp);
-    }
-
-    bstRoot = false;
+// Add a transfer function value to the ray color. _tf is for one base 
+// step and _stepRatio is the length of the step in base steps.
+void Composite(float4 *_color, float4 _tf, float _stepRatio) {
+  // Opacity correction, a longer step absorbs as much as that many base
+  // steps would. Color is scaled along with alpha.
+  if (_stepRatio != 1.0) {
+    float alpha = 1.0 - pow(1.0 - _tf.w, _stepRatio);
+    _tf *= (_tf.w > 0.0001) ? alpha/_tf.w : _stepRatio;
   }
+  *_color += (1.0 - _color->w)*_tf;
 }
 
+#include "BrickExit.cl"
 
-// Given a point, a box mid value and an offset, return enclosing child
 int EnclosingChild(float3 _P, float _boxMid, float3 _offset) {
   if (_P.x < _boxMid+_offset.x) {
     if (_P.y < _boxMid+_offset.y) {
@@ -361,9 +233,11 @@ float4 TraverseOctree(float3 _rayO, float3 _rayD, float _maxDist,
                       __global __read_only image3d_t _textureAtlas,
                       __constant struct KernelConstants *_constants,
                       __global __read_only image2d_t _transferFunction,
-                      __global __read_only int *_tsp,
+                      __global __read_only int *_cut,
                       __global __read_only int *_brickList,
-                      const int _timestep) {
+                      __global __read_only int4 *_lookup,
+                      __global __read_only int *_occupancy,
+                      __global __read_only image2d_t _preintegratedTF) {
 
   float stepsize = _constants->stepsize_;
   // Sample point
@@ -384,56 +258,75 @@ float4 TraverseOctree(float3 _rayO, float3 _rayD, float _maxDist,
                               CLK_NORMALIZED_COORDS_TRUE |
                               CLK_ADDRESS_CLAMP_TO_EDGE;
 
+  // The brick found for the last sample. Consecutive samples almost
+  // always land in the same brick, so the octree is only traversed again
+  // when the sample point leaves it.
+  bool haveBrick = false;
+  // Nothing in the brick is visible with the current transfer function
+  bool brickEmpty = false;
+  float3 brickMin, brickMax;
+  // Distance along the ray where the brick is left. Spherical bricks
+  // may be left a bit later.
+  float brickExit = 0.0;
+  int3 boxCoords, atlasBoxCoords;
+  int divisor;
+
+  // With the pre-integrated table, the segment from the previous sample
+  // to the current one is classified from both sample values
+  bool preintegrated = _constants->preintegrated_ == 1;
+  bool havePrev = false;
+  float prevSample, prevTraversed;
+
   // Traverse until sample point is outside of volume
   while (traversed < _maxDist) {
 
-    // Reset octree traversal variables
-    float3 offset = (float3)(0.0);
-    float boxDim = 1.0;
-    bool foundBrick = false;
-    int child;
-    int level = _constants->rootLevel_;
-
-    int otNodeIndex = 0;
-
-    // Rely on finding a leaf for loop termination
-    while (true) {
+    // Convert to spherical if needed
+    float3 sampleP;
+    if (GRID_TYPE == 0) { // cartesian
+      sampleP = cartesianP;
+    } else { // spherical ( == 1)
+      sampleP = CartesianToSpherical(cartesianP);
+    }
 
-      // Traverse BST to get a brick index, and see if the found brick
-      // is good enough
+    bool inBrick = haveBrick && traversed < brickExit;
+
+    if (!inBrick && _constants->useLookupGrid_ == 1) {
+
+      // The lookup grid has the brick of every finest level cell
+      int numBoxes = NUM_BOXES_PER_AXIS;
+      int3 cell = BoxCoords(sampleP, numBoxes);
+      int4 entry = _lookup[cell.x + numBoxes*(cell.y + numBoxes*cell.z)];
+
+      haveBrick = true;
+      divisor = 1 << entry.w;
+      boxCoords = BoxCoords(sampleP, numBoxes/divisor);
+      atlasBoxCoords = entry.xyz;
+      brickEmpty = entry.x == -1;
+      float boxDim = (float)divisor/(float)numBoxes;
+      brickMin = convert_float3(boxCoords)*boxDim;
+      brickMax = brickMin + (float3)(boxDim);
+      brickExit = traversed + 
+        BrickExitDistance(GRID_TYPE, cartesianP, _rayD, 
+                          brickMin, brickMax);
+
+    } else if (!inBrick) {
+
+      // Reset octree traversal variables
+      float3 offset = (float3)(0.0);
+      float boxDim = 1.0;
+      int child;
+      int level = ROOT_LEVEL;
       int brickIndex;
-      bool bstSuccess = TraverseBST(otNodeIndex,
-                                    &brickIndex,
-                                    _constants,
-                                    _tsp,
-                                    _timestep);
-
-        // Convert to spherical if needed
-        float3 sampleP;
-        if (_constants->gridType_ == 0) { // cartesian
-          sampleP = cartesianP;
-        } else { // spherical ( == 1)
-          sampleP = CartesianToSpherical(cartesianP);
-        }
-
-      if (bstSuccess || 
-          IsOctreeLeaf(otNodeIndex, _constants->numValuesPerNode_, _tsp)) {
-        
-        //float s = 0.008*SpatialError(brickIndex, 4, _tsp);
-        //color += (float4)(s);
 
+      int otNodeIndex = 0;
 
-        // Sample the brick
-        SampleAtlas(&color, sampleP, brickIndex, 
-                    _constants->numBoxesPerAxis_, 
-                    _constants->paddedBrickDim_,
-                    level, 
-                    atlasSampler, _textureAtlas,
-                    _transferFunction,
-                    tfSampler, _brickList); 
-        break;
+      // Rely on finding a leaf for loop termination
+      while (true) {
 
-      } else {
+        // The cut holds the brick for this node if it is good enough
+        // (or a leaf) at the current timestep, else -1
+        brickIndex = _cut[otNodeIndex];
+        if (brickIndex != -1) break;
            
         // Keep traversing the octree
         
@@ -450,18 +343,71 @@ float4 TraverseOctree(float3 _rayO, float3 _rayD, float _maxDist,
         UpdateOffset(&offset, boxDim, child);
 
         // Update index to new node
-        otNodeIndex = OTChildIndex(otNodeIndex, _constants->numValuesPerNode_,
-                                   child, _tsp);
+        otNodeIndex = OTChildIndex(otNodeIndex, child);
         
         level--;
 
+      } // while traversing
+
+      // Remember the brick
+      haveBrick = true;
+      brickMin = offset;
+      brickMax = offset + (float3)(boxDim);
+      divisor = 1 << level;
+      boxCoords = BoxCoords(sampleP, NUM_BOXES_PER_AXIS/divisor);
+      atlasBoxCoords = AtlasBoxCoords(brickIndex, _brickList);
+      brickEmpty = _occupancy[brickIndex] == 0;
+      brickExit = traversed + 
+        BrickExitDistance(GRID_TYPE, cartesianP, _rayD, 
+                          brickMin, brickMax);
+    }
+
+    // Coarse bricks are sampled with longer steps, matching their 
+    // resolution
+    float brickStep = stepsize*(float)divisor;
+
+    // Next sample point. Empty bricks are skipped entirely. When the 
+    // brick is left, continue at the first point on the base step grid 
+    // after it, so that no brick in between is skipped. TSPTraversal 
+    // visits the same points.
+    float next = brickEmpty ? brickExit : traversed + brickStep;
+    if (next >= brickExit) {
+      next = ceil(brickExit/stepsize)*stepsize;
+      if (next <= traversed) next = traversed + stepsize;
+    }
+
+    if (!brickEmpty) {
+      // Sample the brick
+      float sample = SampleAtlas(sampleP, boxCoords, atlasBoxCoords,
+                                 NUM_BOXES_PER_AXIS, PADDED_BRICK_DIM,
+                                 divisor, atlasSampler, _textureAtlas);
+
+      if (!preintegrated) {
+        float4 tf = read_imagef(_transferFunction, tfSampler, 
+                                (float2)(sample, 0.0));
+        // The step before the next sample is shorter than brickStep where
+        // it is snapped to the base grid at the brick exit
+        Composite(&color, tf, (next - traversed)/stepsize);
+      } else if (havePrev) {
+        // Table is indexed by front (x) and back (y) sample values
+        float4 tf = read_imagef(_preintegratedTF, tfSampler,
+                                (float2)(prevSample, sample));
+        Composite(&color, tf, (traversed - prevTraversed)/stepsize);
       }
+      // The first sample only opens a segment
+      prevSample = sample;
+      prevTraversed = traversed;
+      havePrev = true;
 
-    } // while traversing
+      // Further samples would hardly be visible
+      if (color.w >= _constants->opacityThreshold_) break;
+    } else {
+      // No segment spans a skipped brick
+      havePrev = false;
+    }
 
-    // Update sample point
-    traversed += stepsize;
-    cartesianP += stepsize * _rayD;
+    traversed = next;
+    cartesianP = _rayO + traversed*_rayD;
 
   } // while (traversed < maxDist)
 
@@ -476,9 +422,11 @@ __kernel void RaycasterTSP(__global __read_only image2d_t _cubeFront,
                            __constant struct KernelConstants *_constants,
                            __global __read_only image2d_t _transferFunction,
                            //__global __read_only float *_transferFunction,
-                           __global __read_only int *_tsp,
+                           __global __read_only int *_cut,
                            __global __read_only int *_brickList,
-                           const int _timestep) {
+                           __global __read_only int4 *_lookup,
+                           __global __read_only int *_occupancy,
+                           __global __read_only image2d_t _preintegratedTF) {
 
   // Kernel should be launched in 2D with one work item per pixel
   int2 intCoords = (int2)(get_global_id(0), get_global_id(1));
@@ -502,9 +450,11 @@ __kernel void RaycasterTSP(__global __read_only image2d_t _cubeFront,
                                 _textureAtlas,      // voxel data atlas
                                 _constants,         // kernel constants
                                 _transferFunction,  // transfer function
-                                _tsp,               // TSP tree struct
+                                _cut,               // octree cut
                                 _brickList,
-                                _timestep); 
+                                _lookup,
+                                _occupancy,
+                                _preintegratedTF); 
                                 
   //color = 0.0001*color + cubeFrontColor;
 
@@ -0,0 +1,208 @@
+// Mirrors struct on host side
+struct TraversalConstants {
+  int gridType_;
+  float stepsize_;
+  int numTimesteps_;
+  int numValuesPerNode_;
+  int numOTNodes_;
+  float temporalTolerance_;
+  float spatialTolerance_;
+  float opacityThreshold_;
+};
+
+// Dataset constants are normally compiled in as build options. Without
+// them they are read from the constants in scope.
+#ifndef NUM_TIMESTEPS
+#define NUM_TIMESTEPS (_constants->numTimesteps_)
+#endif
+#ifndef NUM_VALUES_PER_NODE
+#define NUM_VALUES_PER_NODE (_constants->numValuesPerNode_)
+#endif
+#ifndef NUM_OT_NODES
+#define NUM_OT_NODES (_constants->numOTNodes_)
+#endif
+
+// Return index to left BST child (low timespan)
+int LeftBST(int _bstNodeIndex, int _numValuesPerNode, int _numOTNodes,
+            bool _bstRoot, __global __read_only int *_tsp) {
+  // If the BST node is a root, the child pointer is used for the OT. 
+  // The child index is next to the root.
+  // If not root, look up in TSP structure.
+  if (_bstRoot) {
+    return _bstNodeIndex + _numOTNodes;
+    //return _bstNodeIndex + 1;
+  } else {
+    return _tsp[_bstNodeIndex*_numValuesPerNode + 1];
+  }
+}
+
+// Return index to right BST child (high timespan)
+int RightBST(int _bstNodeIndex, int _numValuesPerNode, int _numOTNodes,
+             bool _bstRoot, __global __read_only int *_tsp) {
+  if (_bstRoot) {
+    return _bstNodeIndex + _numOTNodes*2;
+  } else {
+    return _tsp[_bstNodeIndex*_numValuesPerNode + 1] + _numOTNodes;
+  }
+}
+
+// Return child node index given a BST node, a time span and a timestep
+// Updates timespan
+int ChildNodeIndex(int _bstNodeIndex, 
+                   int *_timespanStart,
+                   int *_timespanEnd,
+                   int _timestep,
+                   int _numValuesPerNode,
+                   int _numOTNodes,
+                   bool _bstRoot,
+                   __global __read_only int *_tsp) {
+  // Choose left or right child
+  int middle = *_timespanStart + (*_timespanEnd - *_timespanStart)/2; 
+  if (_timestep <= middle) {
+    // Left subtree
+    *_timespanEnd = middle;
+    return LeftBST(_bstNodeIndex, _numValuesPerNode, _numOTNodes,
+                   _bstRoot, _tsp);
+  } else {
+    // Right subtree
+    *_timespanStart = middle+1;
+    return RightBST(_bstNodeIndex, _numValuesPerNode, _numOTNodes, 
+                    _bstRoot, _tsp);
+  }
+}
+
+// Return the brick index that a BST node represents
+int BrickIndex(int _bstNodeIndex, int _numValuesPerNode, 
+               __global __read_only int *_tsp) {
+  return _tsp[_bstNodeIndex*_numValuesPerNode + 0];
+}
+
+// Checks if a BST node is a leaf ot not
+bool IsBSTLeaf(int _bstNodeIndex, int _numValuesPerNode, 
+               bool _bstRoot, __global __read_only int *_tsp) {
+  if (_bstRoot) return false;
+  return (_tsp[_bstNodeIndex*_numValuesPerNode + 1] == -1);
+}
+
+// Checks if an OT node is a leaf or not
+bool IsOctreeLeaf(int _otNodeIndex, int _numValuesPerNode, 
+                  __global __read_only int *_tsp) {
+  // CHILD_INDEX is at offset 1, and -1 represents leaf
+  return (_tsp[_otNodeIndex*_numValuesPerNode + 1] == -1);
+}
+
+float TemporalError(int _bstNodeIndex, int _numValuesPerNode, 
+                    __global __read_only int *_tsp) {
+  return as_float(_tsp[_bstNodeIndex*_numValuesPerNode + 3]);
+}
+
+float SpatialError(int _bstNodeIndex, int _numValuesPerNode, 
+                   __global __read_only int *_tsp) {
+  return as_float(_tsp[_bstNodeIndex*_numValuesPerNode + 2]);
+}
+
+
+// Given an octree node index, traverse the corresponding BST tree and look
+// for a useful brick. 
+bool TraverseBST(int _otNodeIndex,
+                 int *_brickIndex, 
+                 int _timestep,
+                 __constant struct TraversalConstants *_constants,
+                 __global __read_only int *_tsp) {
+
+  // Start at the root of the current BST
+  int bstNodeIndex = _otNodeIndex;
+  bool bstRoot = true;
+  int timespanStart = 0;
+  int timespanEnd = NUM_TIMESTEPS;
+
+   // Rely on structure for termination
+   while (true) {
+  
+    // Update brick index (regardless if we use it or not)
+    *_brickIndex = BrickIndex(bstNodeIndex, 
+                              NUM_VALUES_PER_NODE,
+                              _tsp);
+
+    // If temporal error is ok
+    // TODO float and <= errors
+    if (TemporalError(bstNodeIndex, NUM_VALUES_PER_NODE,
+                      _tsp) <= _constants->temporalTolerance_) {
+      
+      // If the ot node is a leaf, we can't do any better spatially so we 
+      // return the current brick
+      if (IsOctreeLeaf(_otNodeIndex, NUM_VALUES_PER_NODE, _tsp)) {
+        return true;
+
+      // All is well!
+      } else if (SpatialError(bstNodeIndex, NUM_VALUES_PER_NODE,
+               _tsp) <= _constants->spatialTolerance_) {
+        return true;
+         
+      // If spatial failed and the BST node is a leaf
+      // The traversal will continue in the octree (we know that
+      // the octree node is not a leaf)
+      } else if (IsBSTLeaf(bstNodeIndex, NUM_VALUES_PER_NODE, 
+                           bstRoot, _tsp)) {
+        return false;
+      
+      // Keep traversing BST
+      } else {
+        bstNodeIndex = ChildNodeIndex(bstNodeIndex,
+                                      &timespanStart,
+                                      &timespanEnd,
+                                      _timestep,
+                                      NUM_VALUES_PER_NODE,
+                                      NUM_OT_NODES,
+                                      bstRoot,
+                                      _tsp);
+      }
+
+    // If temporal error is too big and the node is a leaf
+    // Return false to traverse OT
+    } else if (IsBSTLeaf(bstNodeIndex, NUM_VALUES_PER_NODE, 
+                         bstRoot, _tsp)) {
+      return false;
+    
+    // If temporal error is too big and we can continue
+    } else {
+      bstNodeIndex = ChildNodeIndex(bstNodeIndex,
+                                    &timespanStart,
+                                    &timespanEnd,
+                                    _timestep,
+                                    NUM_VALUES_PER_NODE,
+                                    NUM_OT_NODES,
+                                    bstRoot,
+                                    _tsp);
+    }
+
+    bstRoot = false;
+  } 
+}
+
+// Collapse the BST of every octree node for one timestep. The result holds
+// one entry per octree node: the brick to use if it is good enough (or if
+// the node is an octree leaf), else -1 to signal that traversal should
+// continue to the children.
+// Launched in 1D with one work item per octree node.
+__kernel void TSPCut(__constant struct TraversalConstants *_constants,
+                     __global __read_only int *_tsp,
+                     __global int *_cut,
+                     const int _timestep) {
+
+  int otNodeIndex = get_global_id(0);
+
+  // Global size is rounded up to the work group size
+  if (otNodeIndex >= NUM_OT_NODES) return;
+
+  int brickIndex;
+  bool bstSuccess = TraverseBST(otNodeIndex, &brickIndex, _timestep,
+                                _constants, _tsp);
+
+  if (bstSuccess || 
+      IsOctreeLeaf(otNodeIndex, NUM_VALUES_PER_NODE, _tsp)) {
+    _cut[otNodeIndex] = brickIndex;
+  } else {
+    _cut[otNodeIndex] = -1;
+  }
+}
@@ -7,8 +7,22 @@ struct TraversalConstants {
   int numOTNodes_;
   float temporalTolerance_;
   float spatialTolerance_;
+  float opacityThreshold_;
 };
 
+// Normally compiled in as a build option, else read from the constants
+// in scope
+#ifndef GRID_TYPE
+#define GRID_TYPE (_constants->gridType_)
+#endif
+
+// Slots in the request set of a work group, a power of two. Requests
+// that find no slot within REQUEST_SET_PROBES go to the global list.
+#ifndef REQUEST_SET_SIZE
+#define REQUEST_SET_SIZE 512
+#endif
+#define REQUEST_SET_PROBES 8
+
 // Turn normalized [0..1] cartesian coordinates 
 // to normalized spherical [0..1] coordinates
 float3 CartesianToSpherical(float3 _cartesian) {
@@ -32,177 +46,29 @@ int OctreeRootNodeIndex() {
   return 0;
 }
 
-// Return index to left BST child (low timespan)
-int LeftBST(int _bstNodeIndex, int _numValuesPerNode, int _numOTNodes,
-            bool _bstRoot, __global __read_only int *_tsp) {
-  // If the BST node is a root, the child pointer is used for the OT. 
-  // The child index is next to the root.
-  // If not root, look up in TSP structure.
-  if (_bstRoot) {
-    return _bstNodeIndex + _numOTNodes;
-    //return _bstNodeIndex + 1;
-  } else {
-    return _tsp[_bstNodeIndex*_numValuesPerNode + 1];
-  }
+// Return OT child index given current node and child number (0-7).
+// The children of node k are stored at 8k+1 to 8k+8.
+int OTChildIndex(int _otNodeIndex, int _child) {
+  return 8*_otNodeIndex + 1 + _child;
 }
 
-// Return index to right BST child (high timespan)
-int RightBST(int _bstNodeIndex, int _numValuesPerNode, int _numOTNodes,
-             bool _bstRoot, __global __read_only int *_tsp) {
-  if (_bstRoot) {
-    return _bstNodeIndex + _numOTNodes*2;
-  } else {
-    return _tsp[_bstNodeIndex*_numValuesPerNode + 1] + _numOTNodes;
-  }
-}
-
-// Return child node index given a BST node, a time span and a timestep
-// Updates timespan
-int ChildNodeIndex(int _bstNodeIndex, 
-                   int *_timespanStart,
-                   int *_timespanEnd,
-                   int _timestep,
-                   int _numValuesPerNode,
-                   int _numOTNodes,
-                   bool _bstRoot,
-                   __global __read_only int *_tsp) {
-  // Choose left or right child
-  int middle = *_timespanStart + (*_timespanEnd - *_timespanStart)/2; 
-  if (_timestep <= middle) {
-    // Left subtree
-    *_timespanEnd = middle;
-    return LeftBST(_bstNodeIndex, _numValuesPerNode, _numOTNodes,
-                   _bstRoot, _tsp);
-  } else {
-    // Right subtree
-    *_timespanStart = middle+1;
-    return RightBST(_bstNodeIndex, _numValuesPerNode, _numOTNodes, 
-                    _bstRoot, _tsp);
-  }
-}
-
-// Return the brick index that a BST node represents
-int BrickIndex(int _bstNodeIndex, int _numValuesPerNode, 
-               __global __read_only int *_tsp) {
-  return _tsp[_bstNodeIndex*_numValuesPerNode + 0];
-}
-
-// Checks if a BST node is a leaf ot not
-bool IsBSTLeaf(int _bstNodeIndex, int _numValuesPerNode, 
-               bool _bstRoot, __global __read_only int *_tsp) {
-  if (_bstRoot) return false;
-  return (_tsp[_bstNodeIndex*_numValuesPerNode + 1] == -1);
-}
-
-// Checks if an OT node is a leaf or not
-bool IsOctreeLeaf(int _otNodeIndex, int _numValuesPerNode, 
-                  __global __read_only int *_tsp) {
-  // CHILD_INDEX is at offset 1, and -1 represents leaf
-  return (_tsp[_otNodeIndex*_numValuesPerNode + 1] == -1);
-}
-
-// Return OT child index given current node and child number (0-7)
-int OTChildIndex(int _otNodeIndex, int _numValuesPerNode,
-                 int _child, 
-                 __global __read_only int *_tsp) {
-  int firstChild = _tsp[_otNodeIndex*_numValuesPerNode + 1];
-  return firstChild + _child;
-}
-
-// Increment the count for a brick in the request list
+// Increment the count for a brick in the work group's request set. The
+// set is an open addressing hash table with -1 for free slots. If the
+// brick finds no slot, it is counted in the global request list instead.
 void AddToList(int _brickIndex, 
+               __local volatile int *_setKeys,
+               __local volatile int *_setCounts,
                __global volatile int *_reqList) {
-  atomic_inc(&_reqList[_brickIndex]);
-}
-
-float TemporalError(int _bstNodeIndex, int _numValuesPerNode, 
-                    __global __read_only int *_tsp) {
-  return as_float(_tsp[_bstNodeIndex*_numValuesPerNode + 3]);
-}
-
-float SpatialError(int _bstNodeIndex, int _numValuesPerNode, 
-                   __global __read_only int *_tsp) {
-  return as_float(_tsp[_bstNodeIndex*_numValuesPerNode + 2]);
-}
-
-
-// Given an octree node index, traverse the corresponding BST tree and look
-// for a useful brick. 
-bool TraverseBST(int _otNodeIndex,
-                 int *_brickIndex, 
-                 int _timestep,
-                 __constant struct TraversalConstants *_constants,
-                 __global volatile int *_reqList,
-                 __global __read_only int *_tsp) {
-
-  // Start at the root of the current BST
-  int bstNodeIndex = _otNodeIndex;
-  bool bstRoot = true;
-  int timespanStart = 0;
-  int timespanEnd = _constants->numTimesteps_;
-
-   // Rely on structure for termination
-   while (true) {
-  
-    // Update brick index (regardless if we use it or not)
-    *_brickIndex = BrickIndex(bstNodeIndex, 
-                              _constants->numValuesPerNode_,
-                              _tsp);
-
-    // If temporal error is ok
-    // TODO float and <= errors
-    if (TemporalError(bstNodeIndex, _constants->numValuesPerNode_,
-                      _tsp) <= _constants->temporalTolerance_) {
-      
-      // If the ot node is a leaf, we can't do any better spatially so we 
-      // return the current brick
-      if (IsOctreeLeaf(_otNodeIndex, _constants->numValuesPerNode_, _tsp)) {
-        return true;
-
-      // All is well!
-      } else if (SpatialError(bstNodeIndex, _constants->numValuesPerNode_,
-               _tsp) <= _constants->spatialTolerance_) {
-        return true;
-         
-      // If spatial failed and the BST node is a leaf
-      // The traversal will continue in the octree (we know that
-      // the octree node is not a leaf)
-      } else if (IsBSTLeaf(bstNodeIndex, _constants->numValuesPerNode_, 
-                           bstRoot, _tsp)) {
-        return false;
-      
-      // Keep traversing BST
-      } else {
-        bstNodeIndex = ChildNodeIndex(bstNodeIndex,
-                                      &timespanStart,
-                                      &timespanEnd,
-                                      _timestep,
-                                      _constants->numValuesPerNode_,
-                                      _constants->numOTNodes_,
-                                      bstRoot,
-                                      _tsp);
-      }
-
-    // If temporal error is too big and the node is a leaf
-    // Return false to traverse OT
-    } else if (IsBSTLeaf(bstNodeIndex, _constants->numValuesPerNode_, 
-                         bstRoot, _tsp)) {
-      return false;
-    
-    // If temporal error is too big and we can continue
-    } else {
-      bstNodeIndex = ChildNodeIndex(bstNodeIndex,
-                                    &timespanStart,
-                                    &timespanEnd,
-                                    _timestep,
-                                    _constants->numValuesPerNode_,
-                                    _constants->numOTNodes_,
-                                    bstRoot,
-                                    _tsp);
+  uint slot = ((uint)_brickIndex * 2654435761u) & (REQUEST_SET_SIZE-1);
+  for (int probe=0; probe<REQUEST_SET_PROBES; ++probe) {
+    int key = atomic_cmpxchg(&_setKeys[slot], -1, _brickIndex);
+    if (key == -1 || key == _brickIndex) {
+      atomic_inc(&_setCounts[slot]);
+      return;
     }
-
-    bstRoot = false;
-  } 
+    slot = (slot + 1) & (REQUEST_SET_SIZE-1);
+  }
+  atomic_inc(&_reqList[_brickIndex]);
 }
 
 // Given a point, a box mid value and an offset, return enclosing child
@@ -261,94 +127,100 @@ void UpdateOffset(float3 *_offset, float _boxDim, int _child) {
   }
 }
 
-// Traverse one ray through the volume, build brick list
+#include "BrickExit.cl"
+
+// Traverse one ray through the volume, build brick list. The ray visits
+// one brick at a time, and moves from a brick to the first point on the
+// raycaster's base step grid after it, like the raycaster does. This 
+// requests exactly the bricks the raycaster will sample, however small
+// the bricks.
 void TraverseOctree(float3 _rayO, 
                     float3 _rayD,
                     float _maxDist,
                     __constant struct TraversalConstants *_constants,
+                    __local volatile int *_setKeys,
+                    __local volatile int *_setCounts,
                     __global volatile int *_reqList,
-                    __global __read_only int *_tsp,
-                    const int _timestep) {
+                    __global __read_only int *_cut,
+                    __global __read_only float *_brickMinAlpha,
+                    __global __read_only int *_occupancy) {
 
-  // Choose a stepsize that guarantees that we don't miss any bricks
-  // TODO dynamic depending on brick dimensions
+  // The raycaster's step size
   float stepsize = _constants->stepsize_;
   float3 P = _rayO;
+  // Upper bound of the transparency the raycaster has left at P
+  float transparency = 1.0;
   // Keep traversing until the sample point goes outside the unit cube
+  // or the raycaster is sure to have stopped
   float traversed = 0.0;
-  while (traversed < _maxDist) {
+  while (traversed < _maxDist && 
+         1.0 - transparency < _constants->opacityThreshold_) {
     
     // Reset traversal variables
     float3 offset = (float3)(0.0);
     float boxDim = 1.0;
     int child;
 
+    // Boxes are in spherical space for spherical grids
+    float3 sampleP;
+    if (GRID_TYPE == 0) { // Cartesian
+      sampleP = P;
+    } else { // Spherical (==1)
+      sampleP = CartesianToSpherical(P);
+    }
+
     // Init the octree node index to the root
     int otNodeIndex = OctreeRootNodeIndex();
 
-    // Start traversing octree
-    // Rely on finding a leaf for loop termination 
-    while (true) {
-
-      // See if the BST tree is good enough
-      int brickIndex = 0;
-      bool bstSuccess = TraverseBST(otNodeIndex, 
-                                    &brickIndex,
-                                    _timestep,
-                                    _constants,
-                                    _reqList,
-                                    _tsp);
-
-
-
-      if (bstSuccess) {
-
-        // Add the found brick to brick list
-        AddToList(brickIndex, _reqList);
-        // We are now done with this node, so go to next
-        break;
-        
-      // If the BST lookup failed but the octree node is a leaf, 
-      // add the brick anyway (it is the BST leaf)
-      } else if (IsOctreeLeaf(otNodeIndex, 
-                              _constants->numValuesPerNode_, _tsp)) {
-        AddToList(brickIndex, _reqList);
-        // We are now done with this node, so go to next
-        break;
-
-      // If the BST lookup failed and we can traverse the octree,
-      // visit the child that encloses the point
-      } else {
+    // The cut holds the brick for this node if it is good enough
+    // (or a leaf) at the current timestep, else -1
+    int brickIndex = _cut[otNodeIndex];
 
-        // Next box dimension
-        boxDim = boxDim/2.0;
+    // Descend to the node in the cut that encloses P
+    while (brickIndex == -1) {
 
-        // Current mid point
-        float boxMid = boxDim;
+      // Next box dimension
+      boxDim = boxDim/2.0;
 
-        // Check which child encloses P
-        
-        if (_constants->gridType_ == 0) { // Cartesian
-          child = EnclosingChild(P, boxMid, offset);
-        } else { // Spherical (==1)
-          child = EnclosingChild(CartesianToSpherical(P), boxMid, offset);
-        }
+      // Current mid point
+      float boxMid = boxDim;
 
-        // Update offset
-        UpdateOffset(&offset, boxDim, child);
+      // Check which child encloses P
+      child = EnclosingChild(sampleP, boxMid, offset);
 
-        // Update node index to new node
-        int oldIndex = otNodeIndex;
-        otNodeIndex = OTChildIndex(otNodeIndex, _constants->numValuesPerNode_,
-                                  child, _tsp);
+      // Update offset
+      UpdateOffset(&offset, boxDim, child);
 
-      } 
+      // Update node index to new node
+      otNodeIndex = OTChildIndex(otNodeIndex, child);
+      brickIndex = _cut[otNodeIndex];
+    } 
 
-    } // while traversing
+    // Add the found brick to brick list, unless the transfer function
+    // makes all of it transparent
+    if (_occupancy[brickIndex] == 1) {
+      AddToList(brickIndex, _setKeys, _setCounts, _reqList);
+    }
+
+    // Distance to where the ray leaves the brick
+    float exit = BrickExitDistance(GRID_TYPE, P, _rayD, offset,
+                                   offset + (float3)(boxDim));
+
+    // Every raycaster sample from here to the brick exit lands in this
+    // brick and blends in at least its minimum alpha. The count leaves
+    // at least a step of margin for rounding.
+    float inBrick = fmin(exit, _maxDist - traversed);
+    float numSamples = floor(inBrick / stepsize);
+    if (numSamples > 0.0) {
+      transparency *= pown(1.0 - _brickMinAlpha[brickIndex], 
+                           (int)numSamples);
+    }
 
-    // Update 
-    traversed += stepsize;
-    P += stepsize * _rayD;
+    // Go to the first raycaster sample after the brick
+    float next = ceil((traversed + exit) / stepsize) * stepsize;
+    if (next <= traversed) next = traversed + stepsize;
+    traversed = next;
+    P = _rayO + traversed * _rayD;
 
   } // while (traversed < maxDist)
 }
@@ -356,28 +228,54 @@ void TraverseOctree(float3 _rayO,
 __kernel void TSPTraversal(__global __read_only image2d_t _cubeFront,
                            __global __read_only image2d_t _cubeBack,
                            __constant struct TraversalConstants *_constants,
-                           __global __read_only int *_tsp,
+                           __global __read_only int *_cut,
                            __global int *_reqList,
-                           const int _timestep) {
+                           __global __read_only float *_brickMinAlpha,
+                           __global __read_only int *_occupancy) {
     
     // Kernel should be launched in 2D with one work item per pixel
     int2 intCoords = (int2)(get_global_id(0), get_global_id(1));
 
+    // Neighbouring rays mostly request the same bricks. They are counted
+    // in a set shared by the work group first, so that each brick costs 
+    // one global atomic per group instead of one per ray and brick.
+    __local int setKeys[REQUEST_SET_SIZE];
+    __local int setCounts[REQUEST_SET_SIZE];
+    int localId = get_local_id(0) + get_local_id(1)*get_local_size(0);
+    int localSize = get_local_size(0)*get_local_size(1);
+    for (int i=localId; i<REQUEST_SET_SIZE; i+=localSize) {
+      setKeys[i] = -1;
+      setCounts[i] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
     // Sampler for color cube reading
     const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE;
 
-    // Read from color cube textures
+    // Read from color cube textures. Work items that miss the volume 
+    // can't return early, since the whole group meets at the barrier.
     float4 cubeFrontColor = read_imagef(_cubeFront, sampler, intCoords);
-    if (length(cubeFrontColor.xyz) == 0.0) return;
-    float4 cubeBackColor = read_imagef(_cubeBack, sampler, intCoords);
+    if (length(cubeFrontColor.xyz) != 0.0) {
+      float4 cubeBackColor = read_imagef(_cubeBack, sampler, intCoords);
 
-    // Figure out ray direction 
-    float maxDist = length(cubeBackColor.xyz-cubeFrontColor.xyz);
-    float3 direction = normalize(cubeBackColor.xyz-cubeFrontColor.xyz);
+      // Figure out ray direction 
+      float maxDist = length(cubeBackColor.xyz-cubeFrontColor.xyz);
+      float3 direction = normalize(cubeBackColor.xyz-cubeFrontColor.xyz);
     
-    // Traverse octree and fill the brick request list
-    TraverseOctree(cubeFrontColor.xyz, direction, maxDist,
-                   _constants,  _reqList, _tsp, _timestep);
+      // Traverse octree and fill the brick request set
+      TraverseOctree(cubeFrontColor.xyz, direction, maxDist,
+                     _constants, setKeys, setCounts, _reqList, _cut, 
+                     _brickMinAlpha, _occupancy);
+    }
+
+    // Add the group's counts to the request list. The counts are kept as
+    // the number of ray visits, a weight for prioritizing bricks.
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int i=localId; i<REQUEST_SET_SIZE; i+=localSize) {
+      if (setKeys[i] != -1) {
+        atomic_add(&_reqList[setKeys[i]], setCounts[i]);
+      }
+    }
 
     return;
 
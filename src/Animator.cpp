@@ -15,6 +15,7 @@ Animator::Animator(Config *_config)
     currentTimestep_(0),
     fpsMode_(true),
     paused_(false),
+    direction_(1),
     elapsedTime_(0.f),
     refreshInterval_(0.f),
     config_(_config) {
@@ -34,7 +35,7 @@ void Animator::Update(float _elapsedTime) {
   if (paused_) return;
  
   if (fpsMode_) {
-    IncTimestep();
+    Step();
     return;
   }
 
@@ -44,7 +45,7 @@ void Animator::Update(float _elapsedTime) {
   // Update as many times as needed
   while (elapsedTime_ > refreshInterval_) {
     elapsedTime_ -= refreshInterval_;
-    IncTimestep();
+    Step();
   }
 
 }
@@ -79,12 +80,31 @@ void Animator::ManualTimestep(int _manualTimestep) {
     return;
   } else if (_manualTimestep < 0) {
     DecTimestep();
+    INFO(currentTimestep_);
   } else {
     IncTimestep();
   }
 }
 
+unsigned int Animator::TimestepAhead(unsigned int _steps) const {
+  if (numTimesteps_ == 0) return currentTimestep_;
+  unsigned int steps = _steps % numTimesteps_;
+  if (direction_ > 0) {
+    return (currentTimestep_ + steps) % numTimesteps_;
+  }
+  return (currentTimestep_ + numTimesteps_ - steps) % numTimesteps_;
+}
+
+void Animator::Step() {
+  if (direction_ > 0) {
+    IncTimestep();
+  } else {
+    DecTimestep();
+  }
+}
+
 void Animator::IncTimestep() {
+  direction_ = 1;
   currentTimestep_++;
   if (currentTimestep_ == numTimesteps_) {
     currentTimestep_ = 0;
@@ -92,10 +112,10 @@ void Animator::IncTimestep() {
 }
 
 void Animator::DecTimestep() {
+  direction_ = -1;
   if (currentTimestep_ == 0) {
     currentTimestep_ = numTimesteps_-1;
   } else {
     currentTimestep_--;
   }
-  INFO(currentTimestep_);
 }
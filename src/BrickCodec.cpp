@@ -0,0 +1,202 @@
+#include <BrickCodec.h>
+#include <Utils.h>
+#include <cstring>
+#include <algorithm>
+
+using namespace osp;
+
+unsigned int BrickCodec::OrderedBits(float _val) {
+  unsigned int bits;
+  memcpy(&bits, &_val, sizeof(float));
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+float BrickCodec::FromOrderedBits(unsigned int _bits) {
+  unsigned int bits = (_bits & 0x80000000u) ? (_bits & 0x7fffffffu) : ~_bits;
+  float val;
+  memcpy(&val, &bits, sizeof(float));
+  return val;
+}
+
+// Variable length integer, seven bits per byte, high bit means "more"
+static void PutVarint(unsigned int _val, std::vector<unsigned char> &_out) {
+  while (_val >= 0x80u) {
+    _out.push_back(static_cast<unsigned char>(_val | 0x80u));
+    _val >>= 7;
+  }
+  _out.push_back(static_cast<unsigned char>(_val));
+}
+
+static bool GetVarint(const unsigned char *_in, unsigned int _numBytes,
+                      unsigned int &_pos, unsigned int &_val) {
+  _val = 0;
+  unsigned int shift = 0;
+  while (_pos < _numBytes && shift < 35) {
+    unsigned char byte = _in[_pos++];
+    _val |= static_cast<unsigned int>(byte & 0x7fu) << shift;
+    if (!(byte & 0x80u)) return true;
+    shift += 7;
+  }
+  return false;
+}
+
+void BrickCodec::EncodeDelta(const float *_brick, const float *_reference,
+                             unsigned int _numVals,
+                             std::vector<unsigned char> &_out) {
+  unsigned int i = 0;
+  while (i < _numVals) {
+    unsigned int diff = OrderedBits(_brick[i]) - OrderedBits(_reference[i]);
+    if (diff == 0) {
+      // A zero byte starts a run, it can't start a non-zero varint
+      unsigned int run = 1;
+      while (i+run < _numVals && 
+             OrderedBits(_brick[i+run]) == OrderedBits(_reference[i+run])) {
+        run++;
+      }
+      _out.push_back(0);
+      PutVarint(run, _out);
+      i += run;
+    } else {
+      int sdiff = static_cast<int>(diff);
+      unsigned int zigzag = (static_cast<unsigned int>(sdiff) << 1) ^
+                            static_cast<unsigned int>(sdiff >> 31);
+      PutVarint(zigzag, _out);
+      i++;
+    }
+  }
+}
+
+bool BrickCodec::DecodeDelta(const unsigned char *_in, unsigned int _numBytes,
+                             const float *_reference, unsigned int _numVals,
+                             float *_out) {
+  unsigned int pos = 0;
+  unsigned int i = 0;
+  while (i < _numVals) {
+    if (pos >= _numBytes) {
+      ERROR("DecodeDelta() - unexpected end of data");
+      return false;
+    }
+    if (_in[pos] == 0) {
+      pos++;
+      unsigned int run;
+      if (!GetVarint(_in, _numBytes, pos, run) || i+run > _numVals) {
+        ERROR("DecodeDelta() - corrupt run");
+        return false;
+      }
+      memcpy(&_out[i], &_reference[i], run*sizeof(float));
+      i += run;
+    } else {
+      unsigned int zigzag;
+      if (!GetVarint(_in, _numBytes, pos, zigzag)) {
+        ERROR("DecodeDelta() - corrupt value");
+        return false;
+      }
+      unsigned int diff = (zigzag >> 1) ^ (0u - (zigzag & 1u));
+      _out[i] = FromOrderedBits(OrderedBits(_reference[i]) + diff);
+      i++;
+    }
+  }
+  return true;
+}
+
+void BrickCodec::HaarForward(float *_line, unsigned int _length,
+                             unsigned int _stride, float *_tmp) {
+  unsigned int half = (_length+1)/2;
+  for (unsigned int k=0; k<_length/2; ++k) {
+    float a = _line[(2*k)*_stride];
+    float b = _line[(2*k+1)*_stride];
+    _tmp[k] = 0.5f*(a+b);
+    _tmp[half+k] = 0.5f*(a-b);
+  }
+  if (_length % 2 == 1) {
+    _tmp[half-1] = _line[(_length-1)*_stride];
+  }
+  for (unsigned int k=0; k<_length; ++k) {
+    _line[k*_stride] = _tmp[k];
+  }
+}
+
+void BrickCodec::HaarInverse(float *_line, unsigned int _length,
+                             unsigned int _stride, float *_tmp) {
+  unsigned int half = (_length+1)/2;
+  for (unsigned int k=0; k<_length/2; ++k) {
+    float a = _line[k*_stride];
+    float d = _line[(half+k)*_stride];
+    _tmp[2*k] = a+d;
+    _tmp[2*k+1] = a-d;
+  }
+  if (_length % 2 == 1) {
+    _tmp[_length-1] = _line[(half-1)*_stride];
+  }
+  for (unsigned int k=0; k<_length; ++k) {
+    _line[k*_stride] = _tmp[k];
+  }
+}
+
+void BrickCodec::HaarAxis(float *_brick, unsigned int _dim, 
+                          unsigned int _length, unsigned int _axis, 
+                          bool _inverse) {
+  unsigned int strides[] = { 1, _dim, _dim*_dim };
+  unsigned int stride = strides[_axis];
+  unsigned int s1 = strides[(_axis+1)%3];
+  unsigned int s2 = strides[(_axis+2)%3];
+  std::vector<float> tmp(_length);
+  for (unsigned int j=0; j<_length; ++j) {
+    for (unsigned int i=0; i<_length; ++i) {
+      float *line = _brick + i*s1 + j*s2;
+      if (_inverse) {
+        HaarInverse(line, _length, stride, &tmp[0]);
+      } else {
+        HaarForward(line, _length, stride, &tmp[0]);
+      }
+    }
+  }
+}
+
+void BrickCodec::WaveletForward(float *_brick, unsigned int _dim) {
+  for (unsigned int length=_dim; length>1; length=(length+1)/2) {
+    for (unsigned int axis=0; axis<3; ++axis) {
+      HaarAxis(_brick, _dim, length, axis, false);
+    }
+  }
+}
+
+void BrickCodec::WaveletInverse(float *_brick, unsigned int _dim) {
+  std::vector<unsigned int> lengths;
+  for (unsigned int length=_dim; length>1; length=(length+1)/2) {
+    lengths.push_back(length);
+  }
+  for (auto it=lengths.rbegin(); it!=lengths.rend(); ++it) {
+    for (int axis=2; axis>=0; --axis) {
+      HaarAxis(_brick, _dim, *it, static_cast<unsigned int>(axis), true);
+    }
+  }
+}
+
+void BrickCodec::WaveletBands(unsigned int _dim,
+                              std::vector<unsigned int> &_order,
+                              std::vector<unsigned int> &_bandEnds) {
+  // Side lengths of the average cubes, smallest first
+  std::vector<unsigned int> lengths(1, 1);
+  for (unsigned int length=_dim; length>1; length=(length+1)/2) {
+    lengths.insert(lengths.begin()+1, length);
+  }
+
+  _order.clear();
+  _bandEnds.clear();
+  unsigned int inner = 0;
+  for (auto it=lengths.begin(); it!=lengths.end(); ++it) {
+    // Band holds the cube of this length minus the previous, smaller cube
+    for (unsigned int z=0; z<*it; ++z) {
+      for (unsigned int y=0; y<*it; ++y) {
+        for (unsigned int x=0; x<*it; ++x) {
+          if (x >= inner || y >= inner || z >= inner) {
+            _order.push_back(x + y*_dim + z*_dim*_dim);
+          }
+        }
+      }
+    }
+    _bandEnds.push_back(static_cast<unsigned int>(_order.size()));
+    inner = *it;
+  }
+}
@@ -7,8 +7,10 @@
 #include <Texture3D.h>
 #include <Config.h>
 #include <Utils.h>
+#include <BrickCodec.h>
 #include <cmath>
 #include <limits>
+#include <algorithm>
 //#include <boost/timer/timer.hpp>
 
 using namespace osp;
@@ -20,11 +22,26 @@ BrickManager * BrickManager::New(Config *_config) {
 
 BrickManager::BrickManager(Config *_config)
   : textureAtlas_(NULL), config_(_config), atlasInitialized_(false), 
-   hasReadHeader_(false), xCoord_(0), yCoord_(0), zCoord_(0), file_(NULL) {
+   hasReadHeader_(false), xCoord_(0), yCoord_(0), zCoord_(0), file_(NULL),
+   encoding_(RAW), deltaFile_(NULL), maxCachedParents_(0),
+   waveletFile_(NULL), numWaveletBands_(0), initialBands_(0), 
+   refineBudget_(0), refining_(false), unpaddedFile_(NULL),
+   bytesStreamed_(0.0), bytesStreamedRaw_(0.0), persistentStaging_(false) {
+
+  numBuffers_ = static_cast<unsigned int>(config_->PipelineDepth());
+  if (numBuffers_ < 2) {
+    WARNING("Pipeline depth " << numBuffers_ << " too small, using 2");
+    numBuffers_ = 2;
+  }
+  partialBricks_.resize(numBuffers_, 0);
 
   // TODO move
-  glGenBuffers(1, &pboHandle_[EVEN]);
-  glGenBuffers(2, &pboHandle_[ODD]);
+  pboHandle_.resize(numBuffers_);
+  stagingHandle_.resize(numBuffers_);
+  glGenBuffers(numBuffers_, &pboHandle_[0]);
+  glGenBuffers(numBuffers_, &stagingHandle_[0]);
+  stagingPtr_.assign(numBuffers_, NULL);
+  stagingFence_.assign(numBuffers_, NULL);
 
 }
 
@@ -32,6 +49,25 @@ BrickManager::~BrickManager() {
   //if (in_.is_open()) {
   //  in_.close();
   //}
+  if (bytesStreamedRaw_ > 0.0) {
+    INFO("Streamed " << bytesStreamed_/BYTES_PER_GB << " GB from disk for " <<
+         bytesStreamedRaw_/BYTES_PER_GB << " GB of bricks");
+  }
+  if (deltaFile_) fclose(deltaFile_);
+  if (waveletFile_) fclose(waveletFile_);
+  if (unpaddedFile_) fclose(unpaddedFile_);
+  if (file_) fclose(file_);
+
+  for (unsigned int i=0; i<stagingFence_.size(); ++i) {
+    if (stagingFence_[i]) glDeleteSync(stagingFence_[i]);
+  }
+  for (unsigned int i=0; i<stagingPtr_.size(); ++i) {
+    if (stagingPtr_[i]) {
+      glBindBuffer(GL_COPY_WRITE_BUFFER, stagingHandle_[i]);
+      glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    }
+  }
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 }
 
 
@@ -93,6 +129,12 @@ bool BrickManager::ReadHeader() {
   unsigned int numOTNodes = (unsigned int)((pow(8, numOTLevels) - 1) / 7);
   unsigned int numBSTNodes = (unsigned int)numTimesteps_*2 - 1;
   numBricksTree_ = numOTNodes * numBSTNodes;
+  numOTNodes_ = numOTNodes;
+  for (unsigned int level=0; level<numOTLevels; ++level) {
+    levelStarts_.push_back((unsigned int)((pow(8, level) - 1) / 7));
+  }
+  // Leaves make up the last numTimesteps_ BST levels of the node list
+  firstLeafBrick_ = (numTimesteps_-1) * numOTNodes;
   INFO("Num OT levels: " << numOTLevels);
   INFO("Num OT nodes: " << numOTNodes);
   INFO("Num BST nodes: " << numBSTNodes);
@@ -117,26 +159,700 @@ bool BrickManager::ReadHeader() {
 
   hasReadHeader_ = true;
 
-  // Hold two brick lists
-  brickLists_.resize(2);
+  // Hold one brick list per buffer
   // Make sure the brick list can hold the maximum number of bricks
   // Each entry holds tree coordinates
-  brickLists_[EVEN].resize(numBricksTree_*3, -1);
-  brickLists_[ODD].resize(numBricksTree_*3, -1);
+  brickListStorage_.assign(numBuffers_, 
+                           std::vector<int>(numBricksTree_*3, -1));
+  brickLists_.resize(numBuffers_);
+  for (unsigned int i=0; i<numBuffers_; ++i) {
+    brickLists_[i] = &brickListStorage_[i][0];
+  }
+  requestedBricks_.resize(numBuffers_);
+  previousBricks_.resize(numBuffers_);
+  brickListVersion_.assign(numBuffers_, 0);
 
   // Allocate space for keeping tracks of bricks in PBO
-  bricksInPBO_.resize(2);
-  bricksInPBO_[EVEN].resize(numBricksTree_, -1);
-  bricksInPBO_[ODD].resize(numBricksTree_, -1);
+  bricksInPBO_.assign(numBuffers_, std::vector<int>(numBricksTree_, -1));
 
   // Allocate space for keeping track of the used coordinates in atlas
-  usedCoords_.resize(2);
-  usedCoords_[EVEN].resize(numBricksFrame_, false);
-  usedCoords_[ODD].resize(numBricksFrame_, false);
+  usedCoords_.assign(numBuffers_, std::vector<bool>(numBricksFrame_, false));
+
+  // At most one staged brick per atlas slot
+  stagedSlots_.resize(numBuffers_);
+  stagingPos_.resize(numBricksFrame_, -1);
+
+  switch (config_->BrickEncoding()) {
+    case RAW:
+      encoding_ = RAW;
+      break;
+    case DELTA:
+      encoding_ = DELTA;
+      if (!InitDeltaEncoding()) return false;
+      break;
+    case WAVELET:
+      encoding_ = WAVELET;
+      if (!InitWaveletEncoding()) return false;
+      break;
+    case UNPADDED:
+      encoding_ = UNPADDED;
+      if (!InitUnpaddedEncoding()) return false;
+      break;
+    default:
+      ERROR("Unknown brick encoding " << config_->BrickEncoding());
+      return false;
+  }
+
+  return true;
+}
+
+std::FILE * BrickManager::OpenEncodedFile(const std::string &_filename) {
+
+  std::FILE *in = fopen(_filename.c_str(), "r");
+  if (!in) {
+    INFO("No encoded brick file " << _filename);
+    return NULL;
+  }
+
+  size_t s = sizeof(unsigned int);
+  unsigned int numBricks = 0;
+  unsigned int brickSize = 0;
+  uint64_t tspSize = 0;
+  uint64_t tspTime = 0;
+  bool read = fread(reinterpret_cast<void*>(&numBricks), s, 1, in) == 1 &&
+              fread(reinterpret_cast<void*>(&brickSize), s, 1, in) == 1 &&
+              fread(&tspSize, sizeof(uint64_t), 1, in) == 1 &&
+              fread(&tspTime, sizeof(uint64_t), 1, in) == 1;
+  uint64_t size, time;
+  if (!read || !TSPStamp(size, time) || 
+      numBricks != numBricksTree_ || brickSize != brickSize_ ||
+      tspSize != size || tspTime != time) {
+    INFO("Encoded brick file " << _filename << " is out of date");
+    fclose(in);
+    return NULL;
+  }
+
+  return in;
+}
+
+bool BrickManager::TSPStamp(uint64_t &_size, uint64_t &_time) const {
+  return FileStamp(config_->TSPFilename(), _size, _time);
+}
+
+std::FILE * BrickManager::CreateEncodedFile(const std::string &_tmpFilename) {
+
+  uint64_t tspSize, tspTime;
+  if (!TSPStamp(tspSize, tspTime)) return NULL;
+
+  std::FILE *out = fopen(_tmpFilename.c_str(), "wb");
+  if (!out) {
+    ERROR("Failed to init " << _tmpFilename);
+    return NULL;
+  }
+
+  size_t s = sizeof(unsigned int);
+  fwrite(reinterpret_cast<void*>(&numBricksTree_), s, 1, out);
+  fwrite(reinterpret_cast<void*>(&brickSize_), s, 1, out);
+  fwrite(&tspSize, sizeof(uint64_t), 1, out);
+  fwrite(&tspTime, sizeof(uint64_t), 1, out);
+  return out;
+}
+
+bool BrickManager::InitDeltaEncoding() {
+
+  if (numTimesteps_ < 2) {
+    WARNING("Delta encoding needs more than one timestep, using raw bricks");
+    encoding_ = RAW;
+    return true;
+  }
+
+  std::string deltaFilename = config_->TSPFilename() + ".delta";
+
+  deltaFile_ = OpenEncodedFile(deltaFilename);
+  if (!deltaFile_) {
+    if (!WriteDeltaFile(deltaFilename)) return false;
+    deltaFile_ = OpenEncodedFile(deltaFilename);
+    if (!deltaFile_) return false;
+  }
+
+  unsigned int numLeaves = numBricksTree_ - firstLeafBrick_;
+  deltaOffsets_.resize(numLeaves+1);
+  if (fread(reinterpret_cast<void*>(&deltaOffsets_[0]), 
+            sizeof(uint64_t), numLeaves+1, deltaFile_) != numLeaves+1) {
+    ERROR("Failed to read offsets from " << deltaFilename);
+    return false;
+  }
+  deltaDataPos_ = ftello(deltaFile_);
+
+  double rawSize = static_cast<double>(numLeaves) * brickSize_;
+  double encodedSize = static_cast<double>(deltaOffsets_[numLeaves]);
+  INFO("Delta encoded leaf bricks: " << rawSize/BYTES_PER_GB << " GB raw, " <<
+       encodedSize/BYTES_PER_GB << " GB encoded (" << 
+       100.0*encodedSize/rawSize << "%)");
+
+  // Enough to hold the parents of one full frame
+  maxCachedParents_ = numBricksFrame_;
+
+  return true;
+}
+
+bool BrickManager::WriteDeltaFile(const std::string &_filename) {
+
+  INFO("Building delta file " << _filename);
+  timer_.start();
+
+  std::string tmpFilename = TempFilename(_filename);
+  std::FILE *out = CreateEncodedFile(tmpFilename);
+  if (!out) return false;
+
+  unsigned int numLeaves = numBricksTree_ - firstLeafBrick_;
+  std::vector<uint64_t> offsets(numLeaves+1, 0);
+
+  // Placeholder offset table after the header, filled in when done
+  fwrite(reinterpret_cast<void*>(&offsets[0]), sizeof(uint64_t), 
+         numLeaves+1, out);
+
+  // Encode one chunk of a leaf BST level at a time
+  const unsigned int chunkSize = 1024;
+  std::vector<float> leaves(chunkSize*numBrickVals_);
+  std::vector<float> parents(chunkSize*numBrickVals_);
+  std::vector<std::vector<unsigned char> > encoded(chunkSize);
+  uint64_t pos = 0;
+
+  for (unsigned int bst=numTimesteps_-1; bst<2*numTimesteps_-1; ++bst) {
+    unsigned int parentBst = (bst-1)/2;
+    for (unsigned int ot=0; ot<numOTNodes_; ot+=chunkSize) {
+      unsigned int count = std::min(chunkSize, numOTNodes_-ot);
+      if (!ReadRawBricks(bst*numOTNodes_+ot, count, &leaves[0]) ||
+          !ReadRawBricks(parentBst*numOTNodes_+ot, count, &parents[0])) {
+        return FinishTempFile(out, tmpFilename, _filename, false);
+      }
+
+      #pragma omp parallel for
+      for (int i=0; i<static_cast<int>(count); ++i) {
+        encoded[i].clear();
+        BrickCodec::EncodeDelta(&leaves[i*numBrickVals_],
+                                &parents[i*numBrickVals_],
+                                numBrickVals_, encoded[i]);
+      }
+
+      for (unsigned int i=0; i<count; ++i) {
+        offsets[bst*numOTNodes_+ot+i-firstLeafBrick_] = pos;
+        fwrite(reinterpret_cast<void*>(&encoded[i][0]), 1, 
+               encoded[i].size(), out);
+        pos += encoded[i].size();
+      }
+    }
+  }
+  offsets[numLeaves] = pos;
+
+  fseeko(out, static_cast<off>(ENCODED_HEADER_SIZE), SEEK_SET);
+  fwrite(reinterpret_cast<void*>(&offsets[0]), sizeof(uint64_t), 
+         numLeaves+1, out);
+  if (!FinishTempFile(out, tmpFilename, _filename, true)) return false;
+
+  // Don't count the build in the streaming statistics
+  bytesStreamed_ = 0.0;
+
+  timer_.stop();
+  INFO("Built delta file in " << timer_.elapsed().wall/1.0e9 << " s");
+
+  return true;
+}
+
+bool BrickManager::InitWaveletEncoding() {
+
+  BrickCodec::WaveletBands(paddedBrickDim_, waveletOrder_, waveletBandEnds_);
+  numWaveletBands_ = static_cast<unsigned int>(waveletBandEnds_.size());
+
+  int initialBands = config_->WaveletInitialBands();
+  if (initialBands < 1 || initialBands > static_cast<int>(numWaveletBands_)) {
+    WARNING("Wavelet initial bands must be in [1, " << numWaveletBands_ << 
+            "], clamping " << initialBands);
+    initialBands = std::max(1, 
+      std::min(initialBands, static_cast<int>(numWaveletBands_)));
+  }
+  initialBands_ = static_cast<unsigned int>(initialBands);
+  refineBudget_ = static_cast<unsigned int>(
+    std::max(0, config_->WaveletRefineBudget()));
+
+  std::string waveletFilename = config_->TSPFilename() + ".wavelet";
+
+  waveletFile_ = OpenEncodedFile(waveletFilename);
+  if (!waveletFile_) {
+    if (!WriteWaveletFile(waveletFilename)) return false;
+    waveletFile_ = OpenEncodedFile(waveletFilename);
+    if (!waveletFile_) return false;
+  }
+  waveletDataPos_ = ftello(waveletFile_);
+
+  bandsInPBO_.assign(numBuffers_, 
+                     std::vector<unsigned int>(numBricksTree_, 0));
+
+  INFO("Wavelet bands: " << numWaveletBands_ << ", first read loads " <<
+       waveletBandEnds_[initialBands_-1] << " of " << numBrickVals_ << 
+       " values per brick");
+
+  return true;
+}
+
+bool BrickManager::WriteWaveletFile(const std::string &_filename) {
+
+  INFO("Building wavelet file " << _filename);
+  timer_.start();
+
+  std::string tmpFilename = TempFilename(_filename);
+  std::FILE *out = CreateEncodedFile(tmpFilename);
+  if (!out) return false;
+
+  // Same layout as the TSP file, but with coefficients in band order
+  const unsigned int chunkSize = 1024;
+  std::vector<float> bricks(chunkSize*numBrickVals_);
+  std::vector<float> coeffs(chunkSize*numBrickVals_);
+
+  for (unsigned int first=0; first<numBricksTree_; first+=chunkSize) {
+    unsigned int count = std::min(chunkSize, numBricksTree_-first);
+    if (!ReadRawBricks(first, count, &bricks[0])) {
+      return FinishTempFile(out, tmpFilename, _filename, false);
+    }
+
+    #pragma omp parallel for
+    for (int i=0; i<static_cast<int>(count); ++i) {
+      float *brick = &bricks[i*numBrickVals_];
+      BrickCodec::WaveletForward(brick, paddedBrickDim_);
+      for (unsigned int j=0; j<numBrickVals_; ++j) {
+        coeffs[i*numBrickVals_+j] = brick[waveletOrder_[j]];
+      }
+    }
+
+    fwrite(reinterpret_cast<void*>(&coeffs[0]), brickSize_, count, out);
+  }
+
+  if (!FinishTempFile(out, tmpFilename, _filename, true)) return false;
+
+  // Don't count the build in the streaming statistics
+  bytesStreamed_ = 0.0;
+
+  timer_.stop();
+  INFO("Built wavelet file in " << timer_.elapsed().wall/1.0e9 << " s");
+
+  return true;
+}
+
+bool BrickManager::ReadWaveletBricks(unsigned int _first, unsigned int _count,
+                                     unsigned int _numBands, float *_out) {
+
+  unsigned int numCoeffs = waveletBandEnds_[_numBands-1];
+  std::vector<float> coeffs(_count*numCoeffs);
+
+  // A short read (a truncated file) is an error too, or the missing
+  // coefficients would be streamed as garbage
+  bool read = true;
+  if (numCoeffs == numBrickVals_) {
+    // Full bricks are consecutive on disk
+    fseeko(waveletFile_, waveletDataPos_ + static_cast<off>(_first) *
+           static_cast<off>(brickSize_), SEEK_SET);
+    read = fread(reinterpret_cast<void*>(&coeffs[0]), brickSize_, _count, 
+                 waveletFile_) == _count;
+  } else {
+    // Prefix read per brick
+    for (unsigned int i=0; i<_count && read; ++i) {
+      fseeko(waveletFile_, waveletDataPos_ + static_cast<off>(_first+i) *
+             static_cast<off>(brickSize_), SEEK_SET);
+      read = fread(reinterpret_cast<void*>(&coeffs[i*numCoeffs]), 
+                   sizeof(float), numCoeffs, waveletFile_) == numCoeffs;
+    }
+  }
+  if (!read) {
+    ERROR("Wavelet file reading error");
+    if (ferror(waveletFile_) != 0) perror(" ");
+    return false;
+  }
+  bytesStreamed_ += static_cast<double>(_count)*numCoeffs*sizeof(float);
+
+  // Missing bands are zero, which leaves the coarser averages
+  #pragma omp parallel for
+  for (int i=0; i<static_cast<int>(_count); ++i) {
+    float *brick = &_out[i*numBrickVals_];
+    std::fill(brick, brick+numBrickVals_, 0.f);
+    for (unsigned int j=0; j<numCoeffs; ++j) {
+      brick[waveletOrder_[j]] = coeffs[i*numCoeffs+j];
+    }
+    BrickCodec::WaveletInverse(brick, paddedBrickDim_);
+  }
+
+  return true;
+}
+
+bool BrickManager::RefineBricks(BUFFER_INDEX _pboIndex, 
+                                float *_staging) {
+
+  // Find requested bricks that are already in the PBO at low precision
+  std::vector<unsigned int> partial;
+  const std::vector<int> &requested = requestedBricks_[_pboIndex];
+  for (auto it=requested.begin(); it!=requested.end(); ++it) {
+    if (bricksInPBO_[_pboIndex][*it] != -1 &&
+        bandsInPBO_[_pboIndex][*it] < numWaveletBands_) {
+      partial.push_back(*it);
+    }
+  }
+
+  unsigned int numRefined = 
+    std::min(static_cast<unsigned int>(partial.size()), refineBudget_);
+  std::vector<float> buffer(numBrickVals_);
+  for (unsigned int i=0; i<numRefined; ++i) {
+    unsigned int brick = partial[i];
+    if (!ReadWaveletBricks(brick, 1, numWaveletBands_, &buffer[0])) {
+      return false;
+    }
+    // Overwrite the brick at its current atlas position
+    StageBrick(_pboIndex, _staging, &buffer[0], 
+               bricksInPBO_[_pboIndex][brick]);
+    bandsInPBO_[_pboIndex][brick] = numWaveletBands_;
+  }
+
+  partialBricks_[_pboIndex] = 
+    static_cast<unsigned int>(partial.size()) - numRefined;
+
+  return true;
+}
+
+bool BrickManager::InitUnpaddedEncoding() {
+
+  unpaddedBrickSize_ = sizeof(float)*brickDim_*brickDim_*brickDim_;
+
+  std::string unpaddedFilename = config_->TSPFilename() + ".unpadded";
+
+  unpaddedFile_ = OpenEncodedFile(unpaddedFilename);
+  if (!unpaddedFile_) {
+    if (!WriteUnpaddedFile(unpaddedFilename)) return false;
+    unpaddedFile_ = OpenEncodedFile(unpaddedFilename);
+    if (!unpaddedFile_) return false;
+  }
+  unpaddedDataPos_ = ftello(unpaddedFile_);
+
+  INFO("Unpadded bricks: " << unpaddedBrickSize_ << " bytes instead of " <<
+       brickSize_ << " per brick");
+
+  return true;
+}
+
+bool BrickManager::WriteUnpaddedFile(const std::string &_filename) {
+
+  INFO("Building unpadded file " << _filename);
+  timer_.start();
+
+  std::string tmpFilename = TempFilename(_filename);
+  std::FILE *out = CreateEncodedFile(tmpFilename);
+  if (!out) return false;
+
+  const unsigned int chunkSize = 1024;
+  unsigned int numUnpaddedVals = brickDim_*brickDim_*brickDim_;
+  std::vector<float> bricks(chunkSize*numBrickVals_);
+  std::vector<float> unpadded(chunkSize*numUnpaddedVals);
+
+  for (unsigned int first=0; first<numBricksTree_; first+=chunkSize) {
+    unsigned int count = std::min(chunkSize, numBricksTree_-first);
+    if (!ReadRawBricks(first, count, &bricks[0])) {
+      return FinishTempFile(out, tmpFilename, _filename, false);
+    }
+
+    unsigned int to = 0;
+    for (unsigned int i=0; i<count; ++i) {
+      for (unsigned int z=0; z<brickDim_; ++z) {
+        for (unsigned int y=0; y<brickDim_; ++y) {
+          for (unsigned int x=0; x<brickDim_; ++x) {
+            unpadded[to++] = bricks[i*numBrickVals_ + 
+              (x+paddingWidth_) + 
+              (y+paddingWidth_)*paddedBrickDim_ +
+              (z+paddingWidth_)*paddedBrickDim_*paddedBrickDim_];
+          }
+        }
+      }
+    }
+
+    fwrite(reinterpret_cast<void*>(&unpadded[0]), unpaddedBrickSize_, 
+           count, out);
+  }
+
+  if (!FinishTempFile(out, tmpFilename, _filename, true)) return false;
+
+  // Don't count the build in the streaming statistics
+  bytesStreamed_ = 0.0;
+
+  timer_.stop();
+  INFO("Built unpadded file in " << timer_.elapsed().wall/1.0e9 << " s");
+
+  return true;
+}
+
+bool BrickManager::ReadUnpaddedBricks(unsigned int _first, 
+                                      unsigned int _count,
+                                      float *_out) {
+
+  unsigned int numUnpaddedVals = brickDim_*brickDim_*brickDim_;
+  std::vector<float> buffer(_count*numUnpaddedVals);
+
+  fseeko(unpaddedFile_, unpaddedDataPos_ + static_cast<off>(_first) *
+         static_cast<off>(unpaddedBrickSize_), SEEK_SET);
+  // A short read (a truncated file) is an error too, or PadBrick would
+  // get uninitialized bricks
+  if (fread(reinterpret_cast<void*>(&buffer[0]), unpaddedBrickSize_, _count,
+            unpaddedFile_) != _count) {
+    ERROR("Unpadded file reading error");
+    if (ferror(unpaddedFile_) != 0) perror(" ");
+    return false;
+  }
+  bytesStreamed_ += static_cast<double>(_count)*unpaddedBrickSize_;
+
+  // Store all bricks first so that bricks in the sequence can use each
+  // other as neighbours
+  for (unsigned int i=0; i<_count; ++i) {
+    unpaddedBricks_[_first+i].assign(buffer.begin()+i*numUnpaddedVals,
+                                     buffer.begin()+(i+1)*numUnpaddedVals);
+  }
+
+  #pragma omp parallel for
+  for (int i=0; i<static_cast<int>(_count); ++i) {
+    PadBrick(_first+i, &_out[i*numBrickVals_]);
+  }
+
+  return true;
+}
+
+void BrickManager::BrickPosition(unsigned int _brickIndex, 
+                                 unsigned int &_level,
+                                 int &_x, int &_y, int &_z) {
+  unsigned int otNode = _brickIndex % numOTNodes_;
+  _level = 0;
+  while (_level+1 < levelStarts_.size() && 
+         otNode >= levelStarts_[_level+1]) {
+    _level++;
+  }
+  // Children are numbered x, y, z from the lowest bit, so the index within
+  // the level is the Morton code of the grid position
+  unsigned int code = otNode - levelStarts_[_level];
+  _x = _y = _z = 0;
+  for (unsigned int bit=0; bit<_level; ++bit) {
+    _x |= ((code >> (3*bit+0)) & 1) << bit;
+    _y |= ((code >> (3*bit+1)) & 1) << bit;
+    _z |= ((code >> (3*bit+2)) & 1) << bit;
+  }
+}
+
+int BrickManager::BrickAt(unsigned int _brickIndex, unsigned int _level,
+                          int _x, int _y, int _z) {
+  int res = 1 << _level;
+  if (_x < 0 || _y < 0 || _z < 0 || _x >= res || _y >= res || _z >= res) {
+    return -1;
+  }
+  unsigned int code = 0;
+  for (unsigned int bit=0; bit<_level; ++bit) {
+    code |= ((_x >> bit) & 1) << (3*bit+0);
+    code |= ((_y >> bit) & 1) << (3*bit+1);
+    code |= ((_z >> bit) & 1) << (3*bit+2);
+  }
+  unsigned int bstNode = _brickIndex / numOTNodes_;
+  return static_cast<int>(bstNode*numOTNodes_ + levelStarts_[_level] + code);
+}
+
+void BrickManager::PadBrick(unsigned int _brickIndex, float *_out) {
+
+  unsigned int level;
+  int x, y, z;
+  BrickPosition(_brickIndex, level, x, y, z);
+
+  // Data for the brick and its 26 neighbours, NULL if not resident
+  const float *own = &unpaddedBricks_.find(_brickIndex)->second[0];
+  const float *neighbours[27];
+  for (int dz=-1; dz<=1; ++dz) {
+    for (int dy=-1; dy<=1; ++dy) {
+      for (int dx=-1; dx<=1; ++dx) {
+        int n = BrickAt(_brickIndex, level, x+dx, y+dy, z+dz);
+        auto it = unpaddedBricks_.end();
+        if (n != -1) it = unpaddedBricks_.find(static_cast<unsigned int>(n));
+        neighbours[(dx+1)+(dy+1)*3+(dz+1)*9] = 
+          (it == unpaddedBricks_.end()) ? NULL : &(it->second[0]);
+      }
+    }
+  }
+
+  int dim = static_cast<int>(brickDim_);
+  int paddedDim = static_cast<int>(paddedBrickDim_);
+  for (int pz=0; pz<paddedDim; ++pz) {
+    int dz = (pz == 0) ? -1 : ((pz == paddedDim-1) ? 1 : 0);
+    for (int py=0; py<paddedDim; ++py) {
+      int dy = (py == 0) ? -1 : ((py == paddedDim-1) ? 1 : 0);
+      for (int px=0; px<paddedDim; ++px) {
+        int dx = (px == 0) ? -1 : ((px == paddedDim-1) ? 1 : 0);
+        const float *src = neighbours[(dx+1)+(dy+1)*3+(dz+1)*9];
+        int sx, sy, sz;
+        if (src) {
+          // Step into the neighbour
+          sx = px-1-dx*dim;
+          sy = py-1-dy*dim;
+          sz = pz-1-dz*dim;
+        } else {
+          // Repeat the edge of the brick itself
+          src = own;
+          sx = std::min(std::max(px-1, 0), dim-1);
+          sy = std::min(std::max(py-1, 0), dim-1);
+          sz = std::min(std::max(pz-1, 0), dim-1);
+        }
+        *_out++ = src[sx + sy*dim + sz*dim*dim];
+      }
+    }
+  }
+}
+
+bool BrickManager::ReadRawBricks(unsigned int _first, unsigned int _count,
+                                 float *_out) {
+  off offset = dataPos_ + 
+               static_cast<off>(_first) * 
+               static_cast<off>(brickSize_);
+  size_t bufSize = static_cast<size_t>(_count)*brickSize_;
+  fseeko(file_, offset, SEEK_SET);
+  fread(reinterpret_cast<void*>(_out), bufSize, 1, file_);
+  if (ferror(file_) != 0) {
+    ERROR("File reading error");
+    perror(" ");
+    return false;
+  }
+  bytesStreamed_ += static_cast<double>(bufSize);
+  return true;
+}
+
+bool BrickManager::CacheParents(unsigned int _first, unsigned int _count) {
+
+  // Touch cached parents, collect the missing ones
+  std::vector<unsigned int> missing;
+  for (unsigned int brick=_first; brick<_first+_count; ++brick) {
+    unsigned int bst = brick / numOTNodes_;
+    unsigned int parent = ((bst-1)/2)*numOTNodes_ + brick%numOTNodes_;
+    auto it = parentCache_.find(parent);
+    if (it != parentCache_.end()) {
+      parentLRU_.splice(parentLRU_.end(), parentLRU_, it->second.second);
+    } else {
+      parentLRU_.push_back(parent);
+      auto &entry = parentCache_[parent];
+      entry.first.resize(numBrickVals_);
+      entry.second = --parentLRU_.end();
+      missing.push_back(parent);
+    }
+  }
+
+  // Read missing parents, one consecutive run at a time
+  std::sort(missing.begin(), missing.end());
+  std::vector<float> buffer;
+  unsigned int i = 0;
+  while (i < missing.size()) {
+    unsigned int run = 1;
+    while (i+run < missing.size() && missing[i+run] == missing[i]+run) {
+      run++;
+    }
+    buffer.resize(run*numBrickVals_);
+    if (!ReadRawBricks(missing[i], run, &buffer[0])) return false;
+    for (unsigned int j=0; j<run; ++j) {
+      std::copy(buffer.begin()+j*numBrickVals_, 
+                buffer.begin()+(j+1)*numBrickVals_,
+                parentCache_[missing[i+j]].first.begin());
+    }
+    i += run;
+  }
 
   return true;
 }
 
+void BrickManager::TrimParentCache() {
+  while (parentCache_.size() > maxCachedParents_) {
+    parentCache_.erase(parentLRU_.front());
+    parentLRU_.pop_front();
+  }
+}
+
+bool BrickManager::ReadBrickSequence(unsigned int _first, 
+                                     unsigned int _count,
+                                     float *_out) {
+
+  bytesStreamedRaw_ += static_cast<double>(_count) * brickSize_;
+
+  if (encoding_ == WAVELET) {
+    return ReadWaveletBricks(_first, _count, initialBands_, _out);
+  }
+
+  if (encoding_ == UNPADDED) {
+    return ReadUnpaddedBricks(_first, _count, _out);
+  }
+
+  if (encoding_ == RAW || _first+_count <= firstLeafBrick_) {
+    return ReadRawBricks(_first, _count, _out);
+  }
+
+  // Inner BST nodes are always stored raw
+  if (_first < firstLeafBrick_) {
+    unsigned int numInner = firstLeafBrick_ - _first;
+    if (!ReadRawBricks(_first, numInner, _out)) return false;
+    _first += numInner;
+    _count -= numInner;
+    _out += numInner*numBrickVals_;
+  }
+
+  if (!CacheParents(_first, _count)) return false;
+
+  // The leaf records are consecutive, read them all at once
+  unsigned int leaf = _first - firstLeafBrick_;
+  uint64_t begin = deltaOffsets_[leaf];
+  uint64_t end = deltaOffsets_[leaf+_count];
+  deltaBuffer_.resize(end-begin);
+  fseeko(deltaFile_, deltaDataPos_ + static_cast<off>(begin), SEEK_SET);
+  if (fread(reinterpret_cast<void*>(&deltaBuffer_[0]), end-begin, 1, 
+            deltaFile_) != 1) {
+    ERROR("Failed to read delta encoded bricks");
+    return false;
+  }
+  bytesStreamed_ += static_cast<double>(end-begin);
+
+  bool success = true;
+  #pragma omp parallel for reduction(&&:success)
+  for (int i=0; i<static_cast<int>(_count); ++i) {
+    unsigned int brick = _first + i;
+    unsigned int bst = brick / numOTNodes_;
+    unsigned int parent = ((bst-1)/2)*numOTNodes_ + brick%numOTNodes_;
+    const std::vector<float> &reference = 
+      parentCache_.find(parent)->second.first;
+    uint64_t from = deltaOffsets_[leaf+i];
+    uint64_t to = deltaOffsets_[leaf+i+1];
+    success = BrickCodec::DecodeDelta(&deltaBuffer_[from-begin], 
+                                      static_cast<unsigned int>(to-from),
+                                      &reference[0], numBrickVals_,
+                                      &_out[i*numBrickVals_]) && success;
+  }
+
+  TrimParentCache();
+
+  return success;
+}
+
+bool BrickManager::SetBrickListMemory(BUFFER_INDEX _bufIdx, int *_memory) {
+
+  if (!hasReadHeader_) {
+    ERROR("SetBrickListMemory(): Header not read");
+    return false;
+  }
+
+  if (_bufIdx >= numBuffers_ || !_memory) {
+    ERROR("SetBrickListMemory(): Invalid buffer or memory");
+    return false;
+  }
+
+  std::copy(brickLists_[_bufIdx], brickLists_[_bufIdx]+numBricksTree_*3,
+            _memory);
+  brickLists_[_bufIdx] = _memory;
+  std::vector<int>().swap(brickListStorage_[_bufIdx]);
+  brickListVersion_[_bufIdx]++;
+  return true;
+}
+
 bool BrickManager::InitAtlas() {
 
   if (atlasInitialized_) {
@@ -148,14 +864,58 @@ bool BrickManager::InitAtlas() {
     return false;
   }
 
+  // With the atlas on the transfer queue, the raycaster keeps one atlas 
+  // for each buffer on the CL side and neither the texture nor the PBOs
+  // are used
+  bool glAtlas = config_->AtlasTransferQueue() != 1;
+
   // Prepare the 3D texture
-  std::vector<unsigned int> dims;
-  dims.push_back(atlasDim_);
-  dims.push_back(atlasDim_);
-  dims.push_back(atlasDim_);
-  textureAtlas_ = Texture3D::New(dims);
+  if (glAtlas) {
+    std::vector<unsigned int> dims;
+    dims.push_back(atlasDim_);
+    dims.push_back(atlasDim_);
+    dims.push_back(atlasDim_);
+    textureAtlas_ = Texture3D::New(dims);
+
+    if (!textureAtlas_->Init()) return false;
+  }
 
-  if (!textureAtlas_->Init()) return false;
+  persistentStaging_ = config_->PersistentStaging() == 1;
+  if (persistentStaging_ && !GLEW_ARB_buffer_storage) {
+    WARNING("GL_ARB_buffer_storage not supported, staging buffers are " <<
+            "mapped every frame");
+    persistentStaging_ = false;
+  }
+  if (persistentStaging_) {
+    WARNING("Persistent staging lets OpenCL acquire mapped buffers, " <<
+            "which not every driver supports");
+  }
+
+  // The PBOs keep their contents between frames, only staged bricks are
+  // written to them. The staging buffers are refilled every frame.
+  for (unsigned int i=0; i<numBuffers_; ++i) {
+    if (glAtlas) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboHandle_[i]);
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, volumeSize_, 0, GL_DYNAMIC_COPY);
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, stagingHandle_[i]);
+    if (persistentStaging_) {
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                         GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_COPY_WRITE_BUFFER, volumeSize_, 0, flags);
+      stagingPtr_[i] = reinterpret_cast<float*>(
+        glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, volumeSize_, flags));
+      if (!stagingPtr_[i]) {
+        ERROR("InitAtlas() - failed to map staging buffer " << i);
+        return false;
+      }
+    } else {
+      glBufferData(GL_COPY_WRITE_BUFFER, volumeSize_, 0, GL_STREAM_DRAW);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  if (CheckGLError("InitAtlas() buffers") != GL_NO_ERROR) return false;
   
   atlasInitialized_ = true;
 
@@ -194,202 +954,232 @@ void BrickManager::CoordsFromLin(int _idx, int &_x, int &_y, int &_z) {
 
 
 bool BrickManager::BuildBrickList(BUFFER_INDEX _bufIdx,
-                                  std::vector<int> &_brickRequest) {
+                                  const std::vector<int> &_requestedBricks) {
 
   // Keep track of number bricks used and number of bricks cached
   // (for benchmarking)
   int numBricks = 0;
   int numCached = 0;
 
-  // For every non-zero entry in the request list, assign a texture atlas
-  // coordinate. For zero entries, signal "no brick" using -1.
-  for (unsigned int i=0; i<_brickRequest.size(); ++i) {
+  // Signal "no brick" using -1 for the bricks of the previous list. They
+  // stay in the PBO until DiskToPBO finds that they aren't requested.
+  previousBricks_[_bufIdx].swap(requestedBricks_[_bufIdx]);
+  for (auto it=previousBricks_[_bufIdx].begin(); 
+       it!=previousBricks_[_bufIdx].end(); ++it) {
+    brickLists_[_bufIdx][3*(*it) + 0] = -1;
+    brickLists_[_bufIdx][3*(*it) + 1] = -1;
+    brickLists_[_bufIdx][3*(*it) + 2] = -1;
+  }
+  requestedBricks_[_bufIdx] = _requestedBricks;
 
-    if (_brickRequest[i] > 0) {
+  // The list only changes if other bricks are requested or a brick gets
+  // a new atlas coordinate. Cached bricks keep the one they had.
+  bool changed = _requestedBricks != previousBricks_[_bufIdx];
 
-      numBricks++;
+  // For every requested brick, assign a texture atlas coordinate
+  for (auto it=_requestedBricks.begin(); it!=_requestedBricks.end(); ++it) {
 
-      //INFO("Checking brick " << i);
+    unsigned int i = static_cast<unsigned int>(*it);
+    numBricks++;
 
-      // If the brick is already in the atlas, keep the coordinate
-      if (bricksInPBO_[_bufIdx][i] != -1) {
+    //INFO("Checking brick " << i);
 
-        numCached++;
-        
-        // Get the corresponding coordinates from index
-        int x, y, z;
-        CoordsFromLin(bricksInPBO_[_bufIdx][i], x, y, z);
-        brickLists_[_bufIdx][3*i + 0] = x;
-        brickLists_[_bufIdx][3*i + 1] = y;
-        brickLists_[_bufIdx][3*i + 2] = z;
+    // If the brick is already in the atlas, keep the coordinate
+    if (bricksInPBO_[_bufIdx][i] != -1) {
 
-        // Mark coordinate as used
-        usedCoords_[_bufIdx][bricksInPBO_[_bufIdx][i]] = true;
+      numCached++;
+      
+      // Get the corresponding coordinates from index
+      int x, y, z;
+      CoordsFromLin(bricksInPBO_[_bufIdx][i], x, y, z);
+      brickLists_[_bufIdx][3*i + 0] = x;
+      brickLists_[_bufIdx][3*i + 1] = y;
+      brickLists_[_bufIdx][3*i + 2] = z;
 
-      } else {
+      // Mark coordinate as used
+      usedCoords_[_bufIdx][bricksInPBO_[_bufIdx][i]] = true;
 
-        // If coord is already usedi by another brick, 
-        // skip it and try the next one
-        while (usedCoords_[_bufIdx][LinearCoord(xCoord_, yCoord_, zCoord_)]) {
-          IncCoord();
-        }
+    } else {
 
-        brickLists_[_bufIdx][3*i + 0] = xCoord_;
-        brickLists_[_bufIdx][3*i + 1] = yCoord_;
-        brickLists_[_bufIdx][3*i + 2] = zCoord_;
-        usedCoords_[_bufIdx][LinearCoord(xCoord_, yCoord_, zCoord_)] = true;
-        
+      // If coord is already usedi by another brick, 
+      // skip it and try the next one
+      while (usedCoords_[_bufIdx][LinearCoord(xCoord_, yCoord_, zCoord_)]) {
         IncCoord();
       }
 
+      brickLists_[_bufIdx][3*i + 0] = xCoord_;
+      brickLists_[_bufIdx][3*i + 1] = yCoord_;
+      brickLists_[_bufIdx][3*i + 2] = zCoord_;
+      usedCoords_[_bufIdx][LinearCoord(xCoord_, yCoord_, zCoord_)] = true;
       
-    } else {
-
-      // -1 is for "not used"
-      brickLists_[_bufIdx][3*i + 0] = -1;
-      brickLists_[_bufIdx][3*i + 1] = -1;
-      brickLists_[_bufIdx][3*i + 2] = -1;
-
+      IncCoord();
+      changed = true;
     }
 
-    // Reset brick list during iteration
-    _brickRequest[i] = 0;
-
   }
 
-  // Brick list is build, reset coordinate list
-  for (auto it=usedCoords_[_bufIdx].begin(); 
-      it!=usedCoords_[_bufIdx].end(); ++it) {
-    *it = false;
+  // Brick list is build, reset the used coordinates
+  for (auto it=_requestedBricks.begin(); it!=_requestedBricks.end(); ++it) {
+    usedCoords_[_bufIdx][LinearCoord(brickLists_[_bufIdx][3*(*it) + 0],
+                                     brickLists_[_bufIdx][3*(*it) + 1],
+                                     brickLists_[_bufIdx][3*(*it) + 2])] =
+      false;
   }
 
+  if (changed) brickListVersion_[_bufIdx]++;
+
   //INFO("bricks NOT used: " << (float)(numBricksFrame_-numBricks) / (float)(numBricksFrame_));
   //INFO("bricks cached: " << (float)numCached / (float)(numBricksFrame_));
 
   return true;
 }
 
-bool BrickManager::FillVolume(float *_in, float *_out, 
-                              unsigned int _x, 
-                              unsigned int _y, 
-                              unsigned int _z) {
-
-  //timer_.start();
-
-  unsigned int xMin = _x*paddedBrickDim_;
-  unsigned int yMin = _y*paddedBrickDim_;
-  unsigned int zMin = _z*paddedBrickDim_;
-  unsigned int xMax = xMin+paddedBrickDim_;
-  unsigned int yMax = yMin+paddedBrickDim_;
-  unsigned int zMax = zMin+paddedBrickDim_;
-
-  // Loop over the brick using three loops
-  unsigned int from = 0;
-  for (unsigned int zValCoord=zMin; zValCoord<zMax; ++zValCoord) {
-    for (unsigned int yValCoord=yMin; yValCoord<yMax; ++yValCoord) {
-      for (unsigned int xValCoord=xMin; xValCoord<xMax; ++xValCoord) {
-
-        unsigned int idx = 
-          xValCoord + 
-          yValCoord*atlasDim_ +
-          zValCoord*atlasDim_*atlasDim_;
-          
-          _out[idx] = _in[from];
-          from++;
-      }
-    }
+void BrickManager::StageBrick(BUFFER_INDEX _pboIndex, float *_staging,
+                              const float *_brick, unsigned int _slot) {
+  if (stagingPos_[_slot] == -1) {
+    stagingPos_[_slot] = static_cast<int>(stagedSlots_[_pboIndex].size());
+    stagedSlots_[_pboIndex].push_back(static_cast<int>(_slot));
   }
+  std::copy(_brick, _brick+numBrickVals_, 
+            _staging + static_cast<size_t>(stagingPos_[_slot])*numBrickVals_);
+}
 
-  //timer_.stop();
-  //double time = timer_.elapsed().wall / 1.0e9;
-  //INFO("FillVolume: " << time << " s");
+void BrickManager::EndStaging(BUFFER_INDEX _pboIndex) {
 
+  // Coherent writes to a persistent mapping need no flush
+  if (!persistentStaging_) {
+    glFlushMappedBufferRange(GL_COPY_WRITE_BUFFER, 0,
+                             stagedSlots_[_pboIndex].size()*brickSize_);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+  }
+
+  // The next buffer to stage a slot must not find this buffer's position
+  for (auto it=stagedSlots_[_pboIndex].begin(); 
+       it!=stagedSlots_[_pboIndex].end(); ++it) {
+    stagingPos_[*it] = -1;
+  }
+}
+
+void BrickManager::SetStagingFence(BUFFER_INDEX _bufIdx, GLsync _fence) {
+  if (stagingFence_[_bufIdx]) glDeleteSync(stagingFence_[_bufIdx]);
+  stagingFence_[_bufIdx] = _fence;
+}
+
+bool BrickManager::WaitStagingFence(BUFFER_INDEX _bufIdx) {
+  GLsync fence = stagingFence_[_bufIdx];
+  if (!fence) return true;
+  stagingFence_[_bufIdx] = NULL;
+
+  // Flush on the first try, so that the fence is sure to be signaled
+  const GLuint64 timeout = 1000000; // 1 ms
+  GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+  GLenum result;
+  do {
+    result = glClientWaitSync(fence, flags, timeout);
+    flags = 0;
+  } while (result == GL_TIMEOUT_EXPIRED);
+  glDeleteSync(fence);
+
+  if (result == GL_WAIT_FAILED) {
+    ERROR("Failed to wait for staging buffer " << _bufIdx);
+    return false;
+  }
   return true;
 }
 
-// TODO find buffer size
 bool BrickManager::DiskToPBO(BUFFER_INDEX _pboIndex) {
   
-  // Map PBO
-  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboHandle_[_pboIndex]);
-  glBufferData(GL_PIXEL_UNPACK_BUFFER, volumeSize_, 0, GL_STREAM_DRAW);
-  float *mappedBuffer = reinterpret_cast<float*>(
-    glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY));
+  float *staging;
+  if (persistentStaging_) {
+    // Already mapped, wait until the last transfer from it is done
+    if (!WaitStagingFence(_pboIndex)) return false;
+    staging = stagingPtr_[_pboIndex];
+  } else {
+    // Map staging buffer. Only the part that gets written is flushed, so
+    // the upload is proportional to the number of new bricks.
+    glBindBuffer(GL_COPY_WRITE_BUFFER, stagingHandle_[_pboIndex]);
+    staging = reinterpret_cast<float*>(
+      glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, volumeSize_, 
+                       GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT |
+                       GL_MAP_FLUSH_EXPLICIT_BIT));
+  }
 
-  if (!mappedBuffer) {
-    ERROR("Failed to map PBO");
+  if (!staging) {
+    ERROR("Failed to map staging buffer");
     return false;
   }
 
-  // Loop over brick request list
-  unsigned int brickIndex = 0;
-  while (brickIndex < brickLists_[_pboIndex].size()/3) {
-
-    // Find first active brick index in list
-    while (brickIndex<brickLists_[_pboIndex].size()/3 && 
-           brickLists_[_pboIndex][3*brickIndex]== -1) {
-      // If not used, remove from PBO cache list
-      bricksInPBO_[_pboIndex][brickIndex] = -1;
-      brickIndex++;
+  // Start a new staging list. stagingPos_ is shared by all buffers and
+  // was cleared when the last staging finished.
+  stagedSlots_[_pboIndex].clear();
+
+  // Bring bricks from earlier frames up to full precision first, so that
+  // the budget isn't spent on the bricks read below
+  unsigned int numNewBricks = 0;
+  // Bricks whose borders should be rebuilt since a neighbour arrived
+  std::vector<unsigned int> dirtyBricks;
+  if (encoding_ == WAVELET) {
+    if (!refining_) refineTimer_.start();
+    if (!RefineBricks(_pboIndex, staging)) {
+      EndStaging(_pboIndex);
+      return false;
     }
+  }
 
-    // If we are at the end of the list, exit
-    if (brickIndex == brickLists_[_pboIndex].size()/3) {
-      break;
+  // Bricks of the previous list that are no longer requested are 
+  // removed from the PBO cache list
+  const std::vector<int> &previous = previousBricks_[_pboIndex];
+  for (auto it=previous.begin(); it!=previous.end(); ++it) {
+    if (brickLists_[_pboIndex][3*(*it)] != -1) continue;
+    bricksInPBO_[_pboIndex][*it] = -1;
+    // Drop the host copy when no PBO holds the brick
+    if (encoding_ == UNPADDED) {
+      bool resident = false;
+      for (unsigned int i=0; i<numBuffers_ && !resident; ++i) {
+        resident = bricksInPBO_[i][*it] != -1;
+      }
+      if (!resident) unpaddedBricks_.erase(*it);
     }
+  }
+
+  // Loop over the requested bricks
+  const std::vector<int> &requested = requestedBricks_[_pboIndex];
+  unsigned int listPos = 0;
+  while (listPos < requested.size()) {
+
+    unsigned int brickIndex = static_cast<unsigned int>(requested[listPos]);
 
     // Find a sequence of consecutive bricks in list
     unsigned int sequence = 0;
     // Count number of bricks already in PBO
     unsigned int inPBO = 0;
-    unsigned int brickIndexProbe = brickIndex;
-    while (brickIndexProbe < brickLists_[_pboIndex].size()/3 &&
-           brickLists_[_pboIndex][3*brickIndexProbe] != -1) {
-      sequence++;
-      if (bricksInPBO_[_pboIndex][brickIndexProbe++] != -1) {
+    while (listPos+sequence < requested.size() &&
+           requested[listPos+sequence] == 
+             static_cast<int>(brickIndex+sequence)) {
+      if (bricksInPBO_[_pboIndex][brickIndex+sequence] != -1) {
         inPBO++;
       }
-      brickIndexProbe++;
+      sequence++;
     }
     //INFO("Reading " << sequence << " bricks");
 
-    // Read the sequence into a buffer
-    float *seqBuffer = new float[sequence*numBrickVals_];
-    size_t bufSize = sequence*numBrickVals_*sizeof(float);
-    /*
-    std::ios::pos_type offset = dataPos_ +
-                                static_cast<std::ios::pos_type>(brickIndex) *
-                                static_cast<std::ios::pos_type>(brickSize_);
-    */
-
-    off offset = dataPos_ + 
-                  static_cast<off>(brickIndex) * 
-                  static_cast<off>(brickSize_);
-
     // Skip reading if all bricks in sequence is already in PBO
     if (inPBO != sequence) {
   
       //timer_.start();
 
-      /* 
-      std::streamoff off = static_cast<std::streamoff>(offset);
-      in_.seekg(off);
-      if (in_.tellg() == -1) {
-        ERROR("Failed to get input stream position");
-        INFO("offset: " << offset);
-        INFO("streamoff max: " << std::numeric_limits<std::streamoff>::max());
-        INFO("size_t max: " << std::numeric_limits<size_t>::max());
-        return false;
+      // New bricks get fresh slots, so a sequence with only new bricks
+      // can be read straight into the end of the staging buffer
+      float *seqBuffer;
+      if (inPBO == 0) {
+        seqBuffer = staging + stagedSlots_[_pboIndex].size()*numBrickVals_;
+      } else {
+        seqBuffer = new float[sequence*numBrickVals_];
       }
-      INFO("in.tellg(): " << in_.tellg());
-      in_.read(reinterpret_cast<char*>(seqBuffer), brickSize_*sequence);
-      */
-
-      fseeko(file_, offset, SEEK_SET);
-      fread(reinterpret_cast<void*>(seqBuffer), bufSize, 1, file_);
-      if (ferror(file_) != 0) {
-        ERROR("File reading error");
-        perror(" ");
+      if (!ReadBrickSequence(brickIndex, sequence, seqBuffer)) {
+        if (inPBO != 0) delete[] seqBuffer;
+        EndStaging(_pboIndex);
         return false;
       }
 
@@ -398,14 +1188,9 @@ bool BrickManager::DiskToPBO(BUFFER_INDEX _pboIndex) {
       //double mb = (brickSize_*sequence) / 1048576.0;
       //INFO("Disk read "<<mb<<" MB in "<<time<<" s, "<< mb/time<<" MB/s");
 
-      // For each brick in the buffer, put it the correct buffer spot
+      // Add each new brick in the buffer to the staging list
       for (unsigned int i=0; i<sequence; ++i) {
 
-
-        // Only upload if needed
-        // Pointless if implementation only skips reading when ALL bricks in
-        // sequence are in PBO, but could be useful if other solutions that
-        // considers part of the buffer are implemented
         if (bricksInPBO_[_pboIndex][brickIndex+i] == -1) {
 
           unsigned int x=static_cast<unsigned int>(
@@ -414,30 +1199,87 @@ bool BrickManager::DiskToPBO(BUFFER_INDEX _pboIndex) {
             brickLists_[_pboIndex][3*(brickIndex+i)+1]);
           unsigned int z=static_cast<unsigned int>(
             brickLists_[_pboIndex][3*(brickIndex+i)+2]);
-
-          // Put each brick in the correct buffer place.
-          // This needs to be done because the values are in brick order, and
-          // the volume needs to be filled with one big float array.
-          FillVolume(&seqBuffer[numBrickVals_*i], mappedBuffer, x, y, z);  
+          unsigned int slot = LinearCoord(x, y, z);
+
+          if (inPBO == 0) {
+            // Already in place, just record the slot
+            stagingPos_[slot] = static_cast<int>(
+              stagedSlots_[_pboIndex].size());
+            stagedSlots_[_pboIndex].push_back(static_cast<int>(slot));
+          } else {
+            StageBrick(_pboIndex, staging, &seqBuffer[numBrickVals_*i], 
+                       slot);
+          }
 
           // Update the atlas list since the brick will be uploaded
           //INFO(brickIndex+i);
-          bricksInPBO_[_pboIndex][brickIndex+i] = LinearCoord(x, y, z);
+          bricksInPBO_[_pboIndex][brickIndex+i] = slot;
+          numNewBricks++;
+          if (encoding_ == UNPADDED) {
+            unsigned int level;
+            int bx, by, bz;
+            BrickPosition(brickIndex+i, level, bx, by, bz);
+            for (int n=0; n<27; ++n) {
+              int neighbour = BrickAt(brickIndex+i, level, 
+                                      bx+n%3-1, by+(n/3)%3-1, bz+n/9-1);
+              if (neighbour != -1 && 
+                  neighbour != static_cast<int>(brickIndex+i) &&
+                  bricksInPBO_[_pboIndex][neighbour] != -1) {
+                dirtyBricks.push_back(static_cast<unsigned int>(neighbour));
+              }
+            }
+          }
+          if (encoding_ == WAVELET) {
+            bandsInPBO_[_pboIndex][brickIndex+i] = initialBands_;
+            if (initialBands_ < numWaveletBands_) {
+              partialBricks_[_pboIndex]++;
+            }
+          }
 
         }
       }
 
-      delete[] seqBuffer;
+      if (inPBO != 0) delete[] seqBuffer;
 
     } // if in pbo
 
-    // Update the brick index
-    brickIndex += sequence;
+    // Continue after the sequence
+    listPos += sequence;
 
   }
 
-  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  // Rebuild borders of resident bricks next to new ones. Neighbours that
+  // arrived in the same sequence are already up to date, but rebuilding
+  // them again is harmless.
+  if (encoding_ == UNPADDED && !dirtyBricks.empty()) {
+    std::sort(dirtyBricks.begin(), dirtyBricks.end());
+    dirtyBricks.erase(std::unique(dirtyBricks.begin(), dirtyBricks.end()),
+                      dirtyBricks.end());
+    std::vector<float> buffer(numBrickVals_);
+    for (auto it=dirtyBricks.begin(); it!=dirtyBricks.end(); ++it) {
+      if (bricksInPBO_[_pboIndex][*it] == -1) continue;
+      PadBrick(*it, &buffer[0]);
+      StageBrick(_pboIndex, staging, &buffer[0], 
+                 bricksInPBO_[_pboIndex][*it]);
+    }
+  }
+
+  EndStaging(_pboIndex);
+
+  if (encoding_ == WAVELET) {
+    if (!refining_ && numNewBricks > 0) {
+      refining_ = true;
+      INFO("Wavelet: " << numNewBricks << " new bricks, first frame in " <<
+           refineTimer_.elapsed().wall/1.0e9 << " s");
+    }
+    unsigned int partial = 0;
+    for (unsigned int i=0; i<numBuffers_; ++i) partial += partialBricks_[i];
+    if (refining_ && partial == 0) {
+      refining_ = false;
+      INFO("Wavelet: full quality in " << 
+           refineTimer_.elapsed().wall/1.0e9 << " s");
+    }
+  }
 
   return true;
 }
@@ -17,10 +17,18 @@
 #include <Texture.h>
 #include <Utils.h>
 #include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#ifndef _WIN32
+#include <sys/stat.h>
+#else
+#include <direct.h>
+#endif
 
 using namespace osp;
 
-CLManager::CLManager() {
+CLManager::CLManager() : glEventSupport_(false), profiling_(false) {
 }
 
 CLManager * CLManager::New() {
@@ -31,6 +39,17 @@ CLManager::~CLManager() {
   for (auto it=clPrograms_.begin(); it!=clPrograms_.end(); ++it) {
     delete it->second;
   }
+  for (auto it=pooledBuffers_.begin(); it!=pooledBuffers_.end(); ++it) {
+    clReleaseMemObject(it->first);
+  }
+  for (auto it=pinnedMemory_.begin(); it!=pinnedMemory_.end(); ++it) {
+    clEnqueueUnmapMemObject(commandQueues_[EXECUTE], it->second, it->first,
+                            0, NULL, NULL);
+  }
+  if (!pinnedMemory_.empty()) clFinish(commandQueues_[EXECUTE]);
+  for (auto it=pinnedMemory_.begin(); it!=pinnedMemory_.end(); ++it) {
+    clReleaseMemObject(it->second);
+  }
   for (unsigned int i=0; i<NUM_QUEUE_INDICES; ++i) {
     clReleaseCommandQueue(commandQueues_[i]);
   }
@@ -106,6 +125,23 @@ bool CLManager::InitDevices() {
     }
   }
 
+  // Implicit CL/GL synchronization on the device the context is created for
+  size_t extensionsSize = 0;
+  error_ = clGetDeviceInfo(devices_[0], CL_DEVICE_EXTENSIONS, 0, NULL,
+                           &extensionsSize);
+  if (!CheckSuccess(error_, "InitDevices() finding extensions")) {
+    return false;
+  }
+  std::vector<char> extensions(extensionsSize+1, '\0');
+  error_ = clGetDeviceInfo(devices_[0], CL_DEVICE_EXTENSIONS, extensionsSize,
+                           &extensions[0], NULL);
+  if (!CheckSuccess(error_, "InitDevices() reading extensions")) {
+    return false;
+  }
+  glEventSupport_ = strstr(&extensions[0], "cl_khr_gl_event") != NULL;
+  INFO("cl_khr_gl_event " << (glEventSupport_ ? "supported" : 
+                                                "not supported"));
+
   return true;
 }
 
@@ -141,9 +177,16 @@ bool CLManager::CreateContext() {
 }
 
 
+void CLManager::SetProfiling(bool _profiling) {
+  profiling_ = _profiling;
+}
+
 bool CLManager::CreateCommandQueue() {
+  cl_command_queue_properties properties = 
+    profiling_ ? CL_QUEUE_PROFILING_ENABLE : 0;
   for (unsigned int i=0; i<NUM_QUEUE_INDICES; ++i) {
-    commandQueues_[i]=clCreateCommandQueue(context_, devices_[0], 0, &error_);
+    commandQueues_[i]=clCreateCommandQueue(context_, devices_[0], properties,
+                                           &error_);
     if (!CheckSuccess(error_, "CreateCommandQueue()")) {
       return false;
     }
@@ -151,6 +194,126 @@ bool CLManager::CreateCommandQueue() {
   return true;
 }
 
+void CLManager::SetBinaryCacheDir(const std::string &_binaryCacheDir) {
+  binaryCacheDir_ = _binaryCacheDir;
+}
+
+uint64_t CLManager::BinaryKey(const std::string &_source,
+                              const std::string &_options) const {
+  // Binaries are only valid for the device and driver that built them
+  char deviceName[MAX_NAME_LENGTH] = "";
+  char driverVersion[MAX_NAME_LENGTH] = "";
+  clGetDeviceInfo(devices_[0], CL_DEVICE_NAME, sizeof(deviceName), 
+                  deviceName, NULL);
+  clGetDeviceInfo(devices_[0], CL_DRIVER_VERSION, sizeof(driverVersion),
+                  driverVersion, NULL);
+
+  uint64_t key = Hash64(_source.data(), _source.size());
+  key = Hash64(_options.data(), _options.size(), key);
+  key = Hash64(deviceName, strlen(deviceName), key);
+  key = Hash64(driverVersion, strlen(driverVersion), key);
+  key = Hash64(platformVersion_, strlen(platformVersion_), key);
+  return key;
+}
+
+std::string CLManager::BinaryFilename(const std::string &_programName,
+                                      uint64_t _key) const {
+  char hex[17];
+  sprintf(hex, "%016llx", static_cast<unsigned long long>(_key));
+  return binaryCacheDir_ + "/" + _programName + "_" + hex + ".clbin";
+}
+
+cl_program CLManager::LoadProgramBinary(const std::string &_programName,
+                                        uint64_t _key,
+                                        const std::string &_options) {
+  if (binaryCacheDir_.empty()) return NULL;
+
+  std::string filename = BinaryFilename(_programName, _key);
+  std::FILE *in = fopen(filename.c_str(), "rb");
+  if (!in) return NULL;
+
+  // Header is the key and the size of the binary, which catch files that
+  // are truncated or written by someone else
+  uint64_t key = 0, size = 0;
+  bool valid = fread(&key, sizeof(uint64_t), 1, in) == 1 &&
+               fread(&size, sizeof(uint64_t), 1, in) == 1 &&
+               key == _key && size > 0;
+  std::vector<unsigned char> binary;
+  if (valid) {
+    binary.resize(size);
+    valid = fread(&binary[0], 1, size, in) == size;
+  }
+  fclose(in);
+  if (!valid) {
+    WARNING("Removing invalid program binary " << filename);
+    remove(filename.c_str());
+    return NULL;
+  }
+
+  const unsigned char *data = &binary[0];
+  size_t binarySize = size;
+  cl_int binaryStatus;
+  cl_program program = clCreateProgramWithBinary(context_, 1, &devices_[0],
+                                                 &binarySize, &data,
+                                                 &binaryStatus, &error_);
+  if (error_ == CL_SUCCESS && binaryStatus == CL_SUCCESS) {
+    error_ = clBuildProgram(program, 0, NULL, _options.c_str(), NULL, NULL);
+    if (error_ == CL_SUCCESS) return program;
+    clReleaseProgram(program);
+  }
+
+  // Rejected by the driver, build from source instead
+  WARNING("Removing unusable program binary " << filename);
+  remove(filename.c_str());
+  return NULL;
+}
+
+bool CLManager::SaveProgramBinary(const std::string &_programName,
+                                  uint64_t _key, cl_program _program) {
+  if (binaryCacheDir_.empty()) return true;
+
+  size_t size = 0;
+  error_ = clGetProgramInfo(_program, CL_PROGRAM_BINARY_SIZES, 
+                            sizeof(size_t), &size, NULL);
+  if (!CheckSuccess(error_, "SaveProgramBinary") || size == 0) return false;
+  std::vector<unsigned char> binary(size);
+  unsigned char *data = &binary[0];
+  error_ = clGetProgramInfo(_program, CL_PROGRAM_BINARIES,
+                            sizeof(unsigned char*), &data, NULL);
+  if (!CheckSuccess(error_, "SaveProgramBinary")) return false;
+
+#ifndef _WIN32
+  mkdir(binaryCacheDir_.c_str(), 0755);
+#else
+  _mkdir(binaryCacheDir_.c_str());
+#endif
+
+  // Write to a temporary file and rename it, so that other nodes sharing 
+  // the directory never read a partial binary. The temporary name is 
+  // unique to this node and process, so nodes can't write into each
+  // other's files.
+  std::string filename = BinaryFilename(_programName, _key);
+  std::string tmpFilename = TempFilename(filename);
+  std::FILE *out = fopen(tmpFilename.c_str(), "wb");
+  if (!out) {
+    WARNING("Failed to write program binary " << filename);
+    return false;
+  }
+  uint64_t size64 = size;
+  bool written = fwrite(&_key, sizeof(uint64_t), 1, out) == 1 &&
+                 fwrite(&size64, sizeof(uint64_t), 1, out) == 1 &&
+                 fwrite(&binary[0], 1, size, out) == size;
+  written = fclose(out) == 0 && written;
+  if (!written || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    WARNING("Failed to write program binary " << filename);
+    remove(tmpFilename.c_str());
+    return false;
+  }
+
+  INFO("Saved " << _programName << " binary to " << filename);
+  return true;
+}
+
 bool CLManager::CreateProgram(std::string _programName,
                               std::string _fileName) {
   // Make sure program doesn't already exist. If it does, delete it.
@@ -173,7 +336,17 @@ bool CLManager::BuildProgram(std::string _programName) {
     ERROR("Program " << _programName << " not found");
     return false;
   }
-  return clPrograms_[_programName]->BuildProgram();
+  return clPrograms_[_programName]->BuildProgram("");
+}
+
+
+bool CLManager::BuildProgram(std::string _programName,
+                             const std::string &_options) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  return clPrograms_[_programName]->BuildProgram(_options);
 }
 
 
@@ -263,6 +436,28 @@ bool osp::CLManager::AddTexture(std::string _programName,
 }
 
 
+bool CLManager::AddGLBuffer(std::string _programName, unsigned int _argNr,
+                            unsigned int _glBuffer, Permissions _permissions,
+                            cl_mem& _clBufferMem) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  cl_mem_flags permissions = ConvertPermissions(_permissions);
+  return clPrograms_[_programName]->
+    AddGLBuffer(_argNr, _glBuffer, permissions, _clBufferMem);
+}
+
+bool CLManager::AddGLBuffer(std::string _programName, unsigned int _argNr,
+                            cl_mem _buffer) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  return clPrograms_[_programName]->AddGLBuffer(_argNr, _buffer);
+}
+
+
 bool CLManager::AddBuffer(std::string _programName, unsigned int _argNr,
                           void *_hostPtr, unsigned int _sizeInBytes,
                           AllocMode _allocMode, Permissions _permissions) {
@@ -277,6 +472,65 @@ bool CLManager::AddBuffer(std::string _programName, unsigned int _argNr,
     AddBuffer(_argNr, _hostPtr, _sizeInBytes, allocMode, permissions);
 }
 
+bool CLManager::AddBuffer(std::string _programName, unsigned int _argNr,
+                          void *_hostPtr, unsigned int _sizeInBytes,
+                          AllocMode _allocMode, Permissions _permissions,
+                          cl_mem& _clBufferMem) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  cl_mem_flags allocMode = ConvertAllocMode(_allocMode);
+  cl_mem_flags permissions = ConvertPermissions(_permissions);
+
+  return clPrograms_[_programName]->
+    AddBuffer(_argNr, _hostPtr, _sizeInBytes, allocMode, permissions,
+              _clBufferMem);
+}
+
+bool CLManager::AddBuffer(std::string _programName, unsigned int _argNr,
+                          cl_mem _buffer) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  return clPrograms_[_programName]->AddBuffer(_argNr, _buffer);
+}
+
+bool CLManager::AddImage3D(std::string _programName, unsigned int _argNr,
+                           unsigned int _width, unsigned int _height,
+                           unsigned int _depth, Permissions _permissions,
+                           cl_mem& _clImageMem) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  cl_mem_flags permissions = ConvertPermissions(_permissions);
+  return clPrograms_[_programName]->
+    AddImage3D(_argNr, _width, _height, _depth, permissions, _clImageMem);
+}
+
+bool CLManager::CopyBufferToImage(std::string _programName, cl_mem _buffer,
+                                  cl_mem _image, 
+                                  const std::vector<size_t> &_offsets,
+                                  const std::vector<size_t> &_origins,
+                                  const size_t _region[3]) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  if (_origins.size() != 3*_offsets.size()) {
+    ERROR("CopyBufferToImage(): Need three origin coordinates per offset");
+    return false;
+  }
+  if (!clPrograms_[_programName]->
+      CopyBufferToImage(_buffer, _image, _offsets, _origins, _region)) {
+    ERROR("Error when copying to image for " << _programName);
+    return false;
+  }
+  return true;
+}
+
 bool CLManager::ReadBuffer(std::string _programName, unsigned int _argNr,
                            void *_hostPtr, unsigned int _sizeInBytes,
                            bool _blocking) {
@@ -289,6 +543,74 @@ bool CLManager::ReadBuffer(std::string _programName, unsigned int _argNr,
     ReadBuffer(_argNr, _hostPtr, _sizeInBytes, blocking);
 }
 
+bool CLManager::CreatePinnedMemory(unsigned int _sizeInBytes, 
+                                   void *&_hostPtr) {
+  cl_mem buffer = clCreateBuffer(context_, 
+                                 CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                 _sizeInBytes, NULL, &error_);
+  if (!CheckSuccess(error_, "CreatePinnedMemory")) return false;
+
+  // The buffer is never used by a kernel, so it can stay mapped
+  _hostPtr = clEnqueueMapBuffer(commandQueues_[EXECUTE], buffer, CL_TRUE,
+                                CL_MAP_READ | CL_MAP_WRITE, 0, _sizeInBytes,
+                                0, NULL, NULL, &error_);
+  if (!CheckSuccess(error_, "CreatePinnedMemory() mapping")) {
+    clReleaseMemObject(buffer);
+    return false;
+  }
+
+  pinnedMemory_[_hostPtr] = buffer;
+  return true;
+}
+
+bool CLManager::WriteBuffer(std::string _programName, unsigned int _argNr,
+                            void *_hostPtr, unsigned int _sizeInBytes,
+                            bool _blocking) {
+  cl_mem buffer;
+  return WriteBuffer(_programName, _argNr, _hostPtr, _sizeInBytes, 
+                     _blocking, buffer);
+}
+
+bool CLManager::WriteBuffer(std::string _programName, unsigned int _argNr,
+                            void *_hostPtr, unsigned int _sizeInBytes,
+                            bool _blocking, cl_mem& _clBufferMem) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  cl_bool blocking = _blocking ? CL_TRUE : CL_FALSE;
+  return clPrograms_[_programName]->
+    WriteBuffer(_argNr, _hostPtr, _sizeInBytes, blocking, _clBufferMem);
+}
+
+cl_mem CLManager::AcquirePooledBuffer(size_t _sizeInBytes) {
+  size_t capacity = MIN_POOLED_SIZE;
+  while (capacity < _sizeInBytes) capacity *= 2;
+
+  // Reuse the smallest free buffer that fits, unless it's much too big
+  auto it = freeBuffers_.lower_bound(capacity);
+  if (it != freeBuffers_.end() && it->first <= 4*capacity) {
+    cl_mem buffer = it->second;
+    freeBuffers_.erase(it);
+    return buffer;
+  }
+
+  cl_mem buffer = clCreateBuffer(context_, CL_MEM_READ_WRITE, capacity,
+                                 NULL, &error_);
+  if (!CheckSuccess(error_, "AcquirePooledBuffer")) return NULL;
+  pooledBuffers_[buffer] = capacity;
+  return buffer;
+}
+
+void CLManager::ReturnPooledBuffer(cl_mem _buffer) {
+  freeBuffers_.insert(std::make_pair(pooledBuffers_[_buffer], _buffer));
+}
+
+size_t CLManager::PooledCapacity(cl_mem _buffer) const {
+  auto it = pooledBuffers_.find(_buffer);
+  return it == pooledBuffers_.end() ? 0 : it->second;
+}
+
 bool CLManager::ReleaseBuffer(std::string _programName, unsigned int _argNr) {
   if (clPrograms_.find(_programName) == clPrograms_.end()) {
     ERROR("Program " << _programName << " not found");
@@ -337,6 +659,79 @@ bool CLManager::LaunchProgram(std::string _programName,
   return true;
 }
 
+bool CLManager::LaunchProgram(std::string _programName, 
+                              unsigned int _gx, unsigned int _lx) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  if (!clPrograms_[_programName]->LaunchProgram(_gx, _lx)) {
+    ERROR("Error when launching program " << _programName);
+    return false;
+  }
+  return true;
+}
+
+
+bool CLManager::SetQueue(std::string _programName, 
+                         QueueIndex _queueIndex) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  clPrograms_[_programName]->SetQueue(commandQueues_[_queueIndex]);
+  return true;
+}
+
+bool CLManager::AddWaitEvent(std::string _programName, 
+                             std::string _dependency) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  if (clPrograms_.find(_dependency) == clPrograms_.end()) {
+    ERROR("Program " << _dependency << " not found");
+    return false;
+  }
+  return clPrograms_[_programName]->
+    AddWaitEvent(clPrograms_[_dependency]->LastEvent());
+}
+
+bool CLManager::ReleaseProgram(std::string _programName) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  if (!clPrograms_[_programName]->ReleaseProgram()) {
+    ERROR("Error when releasing program " << _programName);
+    return false;
+  }
+  return true;
+}
+
+bool CLManager::WaitForProgram(std::string _programName) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  if (!clPrograms_[_programName]->WaitForProgram()) {
+    ERROR("Error when waiting for program " << _programName);
+    return false;
+  }
+  return true;
+}
+
+bool CLManager::SyncGL(std::string _programName) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  if (!clPrograms_[_programName]->SyncGL()) {
+    ERROR("Error when syncing program " << _programName << " with GL");
+    return false;
+  }
+  return true;
+}
 
 bool CLManager::FinishProgram(std::string _programName) {
   if (clPrograms_.find(_programName) == clPrograms_.end()) {
@@ -351,6 +746,34 @@ bool CLManager::FinishProgram(std::string _programName) {
 }
 
 
+bool CLManager::FenceGL(std::string _programName, GLsync &_fence) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  CLProgram *program = clPrograms_[_programName];
+  if (program->LastEvent() && GLEW_ARB_cl_event) {
+    _fence = glCreateSyncFromCLeventARB(context_, program->LastEvent(), 0);
+    if (_fence) return true;
+  }
+  if (!program->WaitForProgram()) return false;
+  _fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  return true;
+}
+
+bool CLManager::ProgramTimes(std::string _programName, cl_ulong &_start,
+                             cl_ulong &_end) {
+  if (clPrograms_.find(_programName) == clPrograms_.end()) {
+    ERROR("Program " << _programName << " not found");
+    return false;
+  }
+  if (!profiling_) {
+    ERROR("ProgramTimes(): Profiling is not enabled");
+    return false;
+  }
+  return clPrograms_[_programName]->ProgramTimes(_start, _end);
+}
+
 bool CLManager::FinishQueue(QueueIndex _queueIndex) {
   clFinish(commandQueues_[_queueIndex]);
   return true;
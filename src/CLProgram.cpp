@@ -16,7 +16,9 @@
 using namespace osp;
 
 CLProgram::CLProgram(const std::string &_programName, CLManager *_clManager) 
-  : programName_(_programName), clManager_(_clManager) {
+  : programName_(_programName), clManager_(_clManager), program_(NULL),
+    kernel_(NULL), queue_(_clManager->commandQueues_[CLManager::EXECUTE]),
+    event_(NULL), startEvent_(NULL) {
 }
 
 CLProgram * CLProgram::New(const std::string &_programName, 
@@ -25,24 +27,78 @@ CLProgram * CLProgram::New(const std::string &_programName,
 }
 
 CLProgram::~CLProgram() {
-  clReleaseKernel(kernel_);
-  clReleaseProgram(program_);
+  ClearWaitEvents();
+  if (event_) clReleaseEvent(event_);
+  if (startEvent_) clReleaseEvent(startEvent_);
+  if (kernel_) clReleaseKernel(kernel_);
+  if (program_) clReleaseProgram(program_);
 }
 
 bool CLProgram::CreateProgram(std::string _fileName) {
   int numChars;
   char *source = ReadSource(_fileName, numChars);
-  program_ = clCreateProgramWithSource(clManager_->context_, 1, 
-                                       (const char**)&source,
-                                       NULL, &error_);
+  if (!source) return false;
+  source_ = std::string(source, numChars);
   free(source);
-  return (error_ == CL_SUCCESS);
+  return ExpandIncludes(_fileName);
+}
+
+bool CLProgram::ExpandIncludes(const std::string &_fileName) {
+  std::string dir;
+  size_t slash = _fileName.find_last_of("/\\");
+  if (slash != std::string::npos) dir = _fileName.substr(0, slash+1);
+
+  const std::string directive = "#include \"";
+  size_t pos = 0;
+  while ((pos = source_.find(directive, pos)) != std::string::npos) {
+    size_t nameStart = pos + directive.size();
+    size_t nameEnd = source_.find('"', nameStart);
+    if (nameEnd == std::string::npos) {
+      ERROR("Unterminated #include in " << _fileName);
+      return false;
+    }
+    int numChars;
+    char *included = ReadSource(dir + source_.substr(nameStart, 
+                                                     nameEnd-nameStart),
+                                numChars);
+    if (!included) return false;
+    size_t lineEnd = source_.find('\n', nameEnd);
+    if (lineEnd == std::string::npos) lineEnd = source_.size();
+    // Rescanned from the same position, so nested includes are expanded
+    source_.replace(pos, lineEnd-pos, std::string(included, numChars));
+    free(included);
+  }
+  return true;
 }
 
 
-bool CLProgram::BuildProgram() {
+bool CLProgram::BuildProgram(const std::string &_options) {
+
+  if (program_) {
+    clReleaseProgram(program_);
+    program_ = NULL;
+  }
+
+  // Try a binary from an earlier run first
+  uint64_t binaryKey = clManager_->BinaryKey(source_, _options);
+  program_ = clManager_->LoadProgramBinary(programName_, binaryKey, 
+                                           _options);
+  if (program_) {
+    INFO("Loaded " << programName_ << " from binary cache");
+    return true;
+  }
+
+  const char *source = source_.c_str();
+  program_ = clCreateProgramWithSource(clManager_->context_, 1, &source,
+                                       NULL, &error_);
+  if (!clManager_->CheckSuccess(error_, "BuildProgram")) {
+    program_ = NULL;
+    return false;
+  }
+
+  INFO("Building " << programName_ << " " << _options);
   error_ = clBuildProgram(program_, (cl_uint)0,
-                          NULL, NULL, NULL, NULL);
+                          NULL, _options.c_str(), NULL, NULL);
   if (error_ != CL_SUCCESS) {
     // Print build log
     char * log;
@@ -60,15 +116,48 @@ bool CLProgram::BuildProgram() {
     }
     return false;
   }
+
+  // Failing to save only costs a rebuild next time
+  clManager_->SaveProgramBinary(programName_, binaryKey, program_);
   return true;
 }
 
 
 bool CLProgram::CreateKernel() {
+  if (kernel_) clReleaseKernel(kernel_);
+  boundArgs_.clear();
   kernel_ = clCreateKernel(program_, programName_.c_str(), &error_);
   return (error_ == CL_SUCCESS);
 }
 
+void CLProgram::SetQueue(cl_command_queue _queue) {
+  queue_ = _queue;
+}
+
+bool CLProgram::AddWaitEvent(cl_event _event) {
+  if (!_event) return true;
+  error_ = clRetainEvent(_event);
+  if (!clManager_->CheckSuccess(error_, "AddWaitEvent")) return false;
+  waitEvents_.push_back(_event);
+  return true;
+}
+
+void CLProgram::SetLastEvent(cl_event _event) {
+  if (!startEvent_) {
+    clRetainEvent(_event);
+    startEvent_ = _event;
+  }
+  if (event_) clReleaseEvent(event_);
+  event_ = _event;
+}
+
+void CLProgram::ClearWaitEvents() {
+  for (unsigned int i=0; i<waitEvents_.size(); ++i) {
+    clReleaseEvent(waitEvents_[i]);
+  }
+  waitEvents_.clear();
+}
+
 
 bool CLProgram::AddTexture(unsigned int _argNr, Texture *_texture,
                            GLuint _textureType,
@@ -160,6 +249,34 @@ bool osp::CLProgram::AddTexture(unsigned int _argNr,
 }
 
 
+bool CLProgram::AddGLBuffer(unsigned int _argNr, unsigned int _glBuffer,
+                            cl_mem_flags _permissions, 
+                            cl_mem& _clBufferMem) {
+
+  // Remove anything already associated with argument index
+  if (OGLTextures_.find((cl_uint)_argNr) != OGLTextures_.end()) {
+    OGLTextures_.erase((cl_uint)_argNr);
+  }
+
+  _clBufferMem = clCreateFromGLBuffer(clManager_->context_, _permissions,
+                                      _glBuffer, &error_);
+  if (!clManager_->CheckSuccess(error_, "AddGLBuffer")) return false;
+
+  OGLTextures_.insert(std::make_pair((cl_uint)_argNr, _clBufferMem));
+
+  return true;
+}
+
+bool CLProgram::AddGLBuffer(unsigned int _argNr, cl_mem _buffer) {
+  // Remove anything already associated with argument index
+  if (OGLTextures_.find((cl_uint)_argNr) != OGLTextures_.end()) {
+    OGLTextures_.erase((cl_uint)_argNr);
+  }
+  OGLTextures_.insert(std::make_pair((cl_uint)_argNr, _buffer));
+  return true;
+}
+
+
 bool CLProgram::AddBuffer(unsigned int _argNr,
                           void *_hostPtr,
                           unsigned int _sizeInBytes,
@@ -188,6 +305,49 @@ bool CLProgram::AddBuffer(unsigned int _argNr,
   return true;
 }
 
+bool CLProgram::AddBuffer(unsigned int _argNr,
+                          void *_hostPtr,
+                          unsigned int _sizeInBytes,
+                          cl_mem_flags _allocMode,
+                          cl_mem_flags _permissions,
+                          cl_mem& _clBufferMem) {
+  if (!AddBuffer(_argNr, _hostPtr, _sizeInBytes, _allocMode, _permissions)) {
+    return false;
+  }
+  _clBufferMem = memArgs_[(cl_uint)_argNr].mem_;
+  return true;
+}
+
+bool CLProgram::AddBuffer(unsigned int _argNr, cl_mem _buffer) {
+  if (memArgs_.find((cl_uint)_argNr) != memArgs_.end()) {
+    memArgs_.erase((cl_uint)_argNr);
+  }
+  MemArg ma;
+  ma.size_ = sizeof(cl_mem);
+  ma.mem_ = _buffer;
+  memArgs_.insert(std::make_pair((cl_uint)_argNr, ma));
+  return true;
+}
+
+bool CLProgram::AddImage3D(unsigned int _argNr, unsigned int _width,
+                           unsigned int _height, unsigned int _depth,
+                           cl_mem_flags _permissions, cl_mem& _clImageMem) {
+  if (memArgs_.find((cl_uint)_argNr) != memArgs_.end()) {
+    memArgs_.erase((cl_uint)_argNr);
+  }
+  cl_image_format format;
+  format.image_channel_order = CL_R;
+  format.image_channel_data_type = CL_FLOAT;
+  MemArg ma;
+  ma.size_ = sizeof(cl_mem);
+  ma.mem_ = clCreateImage3D(clManager_->context_, _permissions, &format,
+                            _width, _height, _depth, 0, 0, NULL, &error_);
+  if (!clManager_->CheckSuccess(error_, "AddImage3D")) return false;
+  memArgs_.insert(std::make_pair((cl_uint)_argNr, ma));
+  _clImageMem = ma.mem_;
+  return true;
+}
+
 bool CLProgram::ReadBuffer(unsigned int _argNr,
                            void *_hostPtr,
                            unsigned int _sizeInBytes,
@@ -196,40 +356,139 @@ bool CLProgram::ReadBuffer(unsigned int _argNr,
     ERROR("ReadBuffer(): Could not find mem arg " << _argNr);
     return false;
   }
-  error_ = clEnqueueReadBuffer(
-    clManager_->commandQueues_[CLManager::EXECUTE],
-    memArgs_[(cl_uint)_argNr].mem_, _blocking, 0, _sizeInBytes,
-    _hostPtr, 0, NULL, NULL);
-  return clManager_->CheckSuccess(error_, "ReadBuffer");
+  cl_event event;
+  error_ = clEnqueueReadBuffer(queue_, memArgs_[(cl_uint)_argNr].mem_, 
+                               _blocking, 0, _sizeInBytes, _hostPtr, 
+                               0, NULL, &event);
+  if (!clManager_->CheckSuccess(error_, "ReadBuffer")) return false;
+  SetLastEvent(event);
+  return true;
+}
+
+bool CLProgram::WriteBuffer(unsigned int _argNr,
+                            void *_hostPtr,
+                            unsigned int _sizeInBytes,
+                            cl_bool _blocking,
+                            cl_mem& _clBufferMem) {
+
+  if (!_hostPtr) {
+    ERROR("WriteBuffer(): Host pointer is NULL");
+    return false;
+  }
+
+  // Keep the current buffer if it's pooled and large enough
+  cl_mem buffer = NULL;
+  auto it = memArgs_.find((cl_uint)_argNr);
+  if (it != memArgs_.end()) {
+    size_t capacity = clManager_->PooledCapacity(it->second.mem_);
+    if (capacity >= _sizeInBytes) {
+      buffer = it->second.mem_;
+    } else if (capacity > 0) {
+      clManager_->ReturnPooledBuffer(it->second.mem_);
+    }
+  }
+  if (!buffer) {
+    buffer = clManager_->AcquirePooledBuffer(_sizeInBytes);
+    if (!buffer) return false;
+    MemArg ma;
+    ma.size_ = sizeof(cl_mem);
+    ma.mem_ = buffer;
+    memArgs_[(cl_uint)_argNr] = ma;
+  }
+
+  cl_event event;
+  error_ = clEnqueueWriteBuffer(queue_, buffer, _blocking, 0, _sizeInBytes,
+                                _hostPtr, 0, NULL, &event);
+  _clBufferMem = buffer;
+  if (!clManager_->CheckSuccess(error_, "WriteBuffer")) return false;
+  SetLastEvent(event);
+  return true;
 }
 
 bool CLProgram::ReleaseBuffer(unsigned int _argNr) {
-  if (memArgs_.find((cl_uint)_argNr) == memArgs_.end()) {
+  auto it = memArgs_.find((cl_uint)_argNr);
+  if (it == memArgs_.end()) {
     ERROR("ReleaseBuffer(): Could not find mem arg " << _argNr);
     return false;
   }
-  error_ = clReleaseMemObject(memArgs_[(cl_uint)_argNr].mem_);
+  cl_mem buffer = it->second.mem_;
+  memArgs_.erase(it);
+  boundArgs_.erase((cl_uint)_argNr);
+  if (clManager_->PooledCapacity(buffer) > 0) {
+    clManager_->ReturnPooledBuffer(buffer);
+    return true;
+  }
+  error_ = clReleaseMemObject(buffer);
   return clManager_->CheckSuccess(error_, "ReleaseBuffer");
 }
 
 
+bool CLProgram::CopyBufferToImage(cl_mem _buffer, cl_mem _image,
+                                  const std::vector<size_t> &_offsets,
+                                  const std::vector<size_t> &_origins,
+                                  const size_t _region[3]) {
+  if (_offsets.empty()) return true;
+
+  // The queue is in order, so only the first copy waits and only the 
+  // first and last need events
+  for (unsigned int i=0; i<_offsets.size(); ++i) {
+    bool first = i == 0;
+    bool last = i+1 == _offsets.size();
+    cl_event event = NULL;
+    error_ = clEnqueueCopyBufferToImage(
+      queue_, _buffer, _image, _offsets[i], &_origins[3*i], _region,
+      first ? (cl_uint)waitEvents_.size() : 0,
+      (first && !waitEvents_.empty()) ? &waitEvents_[0] : NULL,
+      (first || last) ? &event : NULL);
+    if (!clManager_->CheckSuccess(error_, "CopyBufferToImage")) {
+      return false;
+    }
+    if (first) ClearWaitEvents();
+    if (event) SetLastEvent(event);
+  }
+
+  error_ = clFlush(queue_);
+  return clManager_->CheckSuccess(error_, "CopyBufferToImage, clFlush");
+}
+
 bool CLProgram::PrepareProgram() {
 
-  // Let OpenCL take control of the shared GL textures
-  for (auto it = OGLTextures_.begin(); it != OGLTextures_.end(); ++it) {
-    error_ = clEnqueueAcquireGLObjects(
-      clManager_->commandQueues_[CLManager::EXECUTE], 1, 
-      &(it->second), 0, NULL, NULL);
+  // Profiling spans from here
+  if (startEvent_) {
+    clReleaseEvent(startEvent_);
+    startEvent_ = NULL;
+  }
 
+  // Let OpenCL take control of the shared GL textures, after anything the
+  // program has been told to wait for
+  if (!OGLTextures_.empty()) {
+    // Without cl_khr_gl_event, GL has to be done with the objects first
+    if (!clManager_->glEventSupport_) glFinish();
+
+    std::vector<cl_mem> objects;
+    for (auto it = OGLTextures_.begin(); it != OGLTextures_.end(); ++it) {
+      objects.push_back(it->second);
+    }
+    cl_event event;
+    error_ = clEnqueueAcquireGLObjects(
+      queue_, (cl_uint)objects.size(), &objects[0], 
+      (cl_uint)waitEvents_.size(), 
+      waitEvents_.empty() ? NULL : &waitEvents_[0], &event);
     if (!clManager_->CheckSuccess(error_, "PrepareProgram")) {
       ERROR("Failed to enqueue GL object aqcuisition");
-      ERROR("Failing object: " << it->first);
       return false;
     }
+    ClearWaitEvents();
+    SetLastEvent(event);
   }
 
-  // Set up kernel arguments of non-shared items
+  // Set up kernel arguments of non-shared items. Arguments keep their 
+  // values between launches, so only changed ones are set.
   for (auto it=memArgs_.begin(); it!=memArgs_.end(); ++it) {
+    auto bound = boundArgs_.find(it->first);
+    if (bound != boundArgs_.end() && bound->second == it->second.mem_) {
+      continue;
+    }
     error_ = clSetKernelArg(kernel_,
                             it->first,
                             (it->second).size_,
@@ -238,10 +497,15 @@ bool CLProgram::PrepareProgram() {
       ERROR("Failed to set kernel argument " << it->first);
       return false;
     }
+    boundArgs_[it->first] = it->second.mem_;
   }
   
   // Set up kernel arguments for textures
   for (auto it=OGLTextures_.begin(); it!=OGLTextures_.end(); ++it) {
+    auto bound = boundArgs_.find(it->first);
+    if (bound != boundArgs_.end() && bound->second == it->second) {
+      continue;
+    }
     error_ = clSetKernelArg(kernel_,
                             it->first,
                             sizeof(cl_mem),
@@ -250,6 +514,7 @@ bool CLProgram::PrepareProgram() {
       ERROR("Failed to set texture kernel arg " << it->first);
       return false;
     }
+    boundArgs_[it->first] = it->second;
   }
 
   return true;
@@ -268,35 +533,84 @@ bool CLProgram::LaunchProgram(unsigned int _gx, unsigned int _gy,
                               unsigned int _lx, unsigned int _ly) {
   size_t globalSize[] = { _gx, _gy };
   size_t localSize[] = { _lx, _ly };
+  return EnqueueKernel(2, globalSize, localSize);
+}
+
+bool CLProgram::LaunchProgram(unsigned int _gx, unsigned int _lx) {
+  size_t globalSize[] = { _gx };
+  size_t localSize[] = { _lx };
+  return EnqueueKernel(1, globalSize, localSize);
+}
 
+bool CLProgram::EnqueueKernel(cl_uint _dim, const size_t *_globalSize,
+                              const size_t *_localSize) {
+  cl_event event;
   error_ = clEnqueueNDRangeKernel(
-    clManager_->commandQueues_[CLManager::EXECUTE], kernel_, 2, NULL,
-    globalSize, localSize, 0, NULL, NULL);
-  return clManager_->CheckSuccess(error_, "LaunchProgram()");
+    queue_, kernel_, _dim, NULL, _globalSize, _localSize, 
+    (cl_uint)waitEvents_.size(), 
+    waitEvents_.empty() ? NULL : &waitEvents_[0], &event);
+  if (!clManager_->CheckSuccess(error_, "LaunchProgram()")) return false;
+  ClearWaitEvents();
+  SetLastEvent(event);
+
+  // Submit now, so the device starts while the host goes on
+  error_ = clFlush(queue_);
+  return clManager_->CheckSuccess(error_, "LaunchProgram(), clFlush");
 }
 
-bool CLProgram::FinishProgram() {
+bool CLProgram::ReleaseProgram() {
+  if (OGLTextures_.empty()) return true;
 
-  // Make sure kernel is done
-  error_ = clFinish(clManager_->commandQueues_[CLManager::EXECUTE]);
-  if (!clManager_->CheckSuccess(error_, "FinishProgram, clFinish")) {
-    ERROR("Failed to finish program");
+  // The queue is in order, so the release comes after the kernel
+  std::vector<cl_mem> objects;
+  for (auto it=OGLTextures_.begin(); it!=OGLTextures_.end(); ++it) {
+    objects.push_back(it->second);
+  }
+  cl_event event;
+  error_ = clEnqueueReleaseGLObjects(queue_, (cl_uint)objects.size(),
+                                     &objects[0], 0, NULL, &event);
+  if (!clManager_->CheckSuccess(error_, "ReleaseProgram")) {
+    ERROR("Failed to release GL objects");
     return false;
   }
+  SetLastEvent(event);
 
-  // Release shared OGL objects
-  for (auto it=OGLTextures_.begin(); it!=OGLTextures_.end(); ++it) {
-    error_ = clEnqueueReleaseGLObjects(
-      clManager_->commandQueues_[CLManager::EXECUTE], 1, 
-                                 &(it->second), 0, NULL, NULL);
-    if (!clManager_->CheckSuccess(error_, "FinishProgram, release GL objs")) {
-      ERROR("Failed to release GL object");
-      ERROR("Failed object: " << it->first);
-      return false;
-    }
+  error_ = clFlush(queue_);
+  return clManager_->CheckSuccess(error_, "ReleaseProgram, clFlush");
+}
+
+bool CLProgram::WaitForProgram() {
+  if (!event_) return true;
+  error_ = clWaitForEvents(1, &event_);
+  return clManager_->CheckSuccess(error_, "WaitForProgram");
+}
+
+bool CLProgram::SyncGL() {
+  // With cl_khr_gl_event, GL commands issued after the release in the same
+  // thread wait for it on their own
+  if (clManager_->glEventSupport_) return true;
+  return WaitForProgram();
+}
+
+bool CLProgram::ProgramTimes(cl_ulong &_start, cl_ulong &_end) {
+  if (!startEvent_ || !event_) {
+    ERROR("ProgramTimes(): Nothing enqueued for " << programName_);
+    return false;
   }
+  error_ = clGetEventProfilingInfo(startEvent_, CL_PROFILING_COMMAND_START,
+                                   sizeof(cl_ulong), &_start, NULL);
+  if (!clManager_->CheckSuccess(error_, "ProgramTimes, start")) return false;
+  error_ = clGetEventProfilingInfo(event_, CL_PROFILING_COMMAND_END,
+                                   sizeof(cl_ulong), &_end, NULL);
+  return clManager_->CheckSuccess(error_, "ProgramTimes, end");
+}
 
-  return true;
+bool CLProgram::FinishProgram() {
+  if (!ReleaseProgram()) {
+    ERROR("Failed to finish program");
+    return false;
+  }
+  return WaitForProgram();
 }
 
 
@@ -24,14 +24,20 @@ Config::Config(const std::string &_configFilename)
     TFFilename_("notSet"),
     raycasterKernelFilename_("notSet"),
     TSPTraversalKernelFilename_("notSet"),
+    brickScatterKernelFilename_("notSet"),
+    TSPCutKernelFilename_("notSet"),
+    brickLookupKernelFilename_("notSet"),
+    clearRequestsKernelFilename_("notSet"),
+    compactRequestsKernelFilename_("notSet"),
+    kernelBinaryCacheDir_(""),
     cubeShaderVertFilename_("notSet"),
     cubeShaderFragFilename_("notSet"),
     quadShaderVertFilename_("notSet"),
     quadShaderFragFilename_("notSet"),
     spatialErrorTolerance_(0.f),
     temporalErrorTolerance_(0.f),
-    TSPTraversalStepsize_(0.1f),
     raycasterStepsize_(0.1f),
+    raycasterOpacityThreshold_(1.f),
     raycasterIntensity_(1.f),
     animatorRefreshInterval_(1.f),
     mousePitchFactor_(1.f),
@@ -47,7 +53,19 @@ Config::Config(const std::string &_configFilename)
     pitchSpeed_(0.f),
     rollSpeed_(0.f),
     yawSpeed_(0.f),
-    takeScreenshot_(false) 
+    takeScreenshot_(false),
+    brickAliasEpsilon_(-1.f),
+    brickEncoding_(0),
+    waveletInitialBands_(3),
+    waveletRefineBudget_(512),
+    brickLookupGrid_(0),
+    emptySpaceSkipping_(0),
+    preintegratedTF_(0),
+    atlasTransferQueue_(0),
+    clProfiling_(0),
+    pipelineDepth_(2),
+    frameGraphReport_(0),
+    persistentStaging_(0)
 {}
     
 Config::~Config() {}
@@ -95,15 +113,15 @@ bool Config::Read() {
       } else if (variable == "temporal_error_tolerance") {
         ss >> temporalErrorTolerance_;
         INFO("Temporal error tolerance: " << temporalErrorTolerance_);
-      } else if (variable == "tsp_traversal_stepsize") {
-        ss >> TSPTraversalStepsize_;
-        INFO("TSP traversal step size: " << TSPTraversalStepsize_); 
       } else if (variable == "raycaster_stepsize") {
         ss >> raycasterStepsize_; 
         INFO("Ray caster step size: " << raycasterStepsize_);
       } else if (variable == "raycaster_intensity") {
         ss >> raycasterIntensity_;
         INFO("Ray caster intensity: " << raycasterIntensity_);
+      } else if (variable == "raycaster_opacity_threshold") {
+        ss >> raycasterOpacityThreshold_;
+        INFO("Ray caster opacity threshold: " << raycasterOpacityThreshold_);
       } else if (variable == "animator_refresh_interval") {
         ss >> animatorRefreshInterval_;
         INFO("Animator refresh interval: " << animatorRefreshInterval_);
@@ -119,6 +137,26 @@ bool Config::Read() {
       } else if (variable == "tsp_traversal_kernel_filename" ) {
         ss >> TSPTraversalKernelFilename_;
         INFO("TSP traversal kernel file name: " <<TSPTraversalKernelFilename_);
+      } else if (variable == "brick_scatter_kernel_filename" ) {
+        ss >> brickScatterKernelFilename_;
+        INFO("Brick scatter kernel file name: " <<brickScatterKernelFilename_);
+      } else if (variable == "tsp_cut_kernel_filename" ) {
+        ss >> TSPCutKernelFilename_;
+        INFO("TSP cut kernel file name: " << TSPCutKernelFilename_);
+      } else if (variable == "brick_lookup_kernel_filename" ) {
+        ss >> brickLookupKernelFilename_;
+        INFO("Brick lookup kernel file name: "<<brickLookupKernelFilename_);
+      } else if (variable == "clear_requests_kernel_filename") {
+        ss >> clearRequestsKernelFilename_;
+        INFO("Clear requests kernel file name: " << 
+             clearRequestsKernelFilename_);
+      } else if (variable == "compact_requests_kernel_filename") {
+        ss >> compactRequestsKernelFilename_;
+        INFO("Compact requests kernel file name: " << 
+             compactRequestsKernelFilename_);
+      } else if (variable == "kernel_binary_cache_dir") {
+        ss >> kernelBinaryCacheDir_;
+        INFO("Kernel binary cache directory: " << kernelBinaryCacheDir_);
       } else if (variable == "cube_shader_vert_filename") {
         ss >> cubeShaderVertFilename_;
         INFO("Cube vertex shader file name: " << cubeShaderVertFilename_);
@@ -185,6 +223,42 @@ bool Config::Read() {
       } else if (variable == "take_screenshot") {
         ss >> takeScreenshot_;
         INFO("Take screenshot: " << takeScreenshot_);
+      } else if (variable == "brick_alias_epsilon") {
+        ss >> brickAliasEpsilon_;
+        INFO("Brick alias epsilon: " << brickAliasEpsilon_);
+      } else if (variable == "brick_encoding") {
+        ss >> brickEncoding_;
+        INFO("Brick encoding: " << brickEncoding_);
+      } else if (variable == "wavelet_initial_bands") {
+        ss >> waveletInitialBands_;
+        INFO("Wavelet initial bands: " << waveletInitialBands_);
+      } else if (variable == "wavelet_refine_budget") {
+        ss >> waveletRefineBudget_;
+        INFO("Wavelet refine budget: " << waveletRefineBudget_);
+      } else if (variable == "brick_lookup_grid") {
+        ss >> brickLookupGrid_;
+        INFO("Brick lookup grid: " << brickLookupGrid_);
+      } else if (variable == "empty_space_skipping") {
+        ss >> emptySpaceSkipping_;
+        INFO("Empty space skipping: " << emptySpaceSkipping_);
+      } else if (variable == "preintegrated_tf") {
+        ss >> preintegratedTF_;
+        INFO("Pre-integrated transfer function: " << preintegratedTF_);
+      } else if (variable == "atlas_transfer_queue") {
+        ss >> atlasTransferQueue_;
+        INFO("Atlas transfer queue: " << atlasTransferQueue_);
+      } else if (variable == "cl_profiling") {
+        ss >> clProfiling_;
+        INFO("CL profiling: " << clProfiling_);
+      } else if (variable == "pipeline_depth") {
+        ss >> pipelineDepth_;
+        INFO("Pipeline depth: " << pipelineDepth_);
+      } else if (variable == "frame_graph_report") {
+        ss >> frameGraphReport_;
+        INFO("Frame graph report: " << frameGraphReport_);
+      } else if (variable == "persistent_staging") {
+        ss >> persistentStaging_;
+        INFO("Persistent staging: " << persistentStaging_);
       } else { 
         ERROR("Variable name " << variable << " unknown");
       } 
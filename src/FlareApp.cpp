@@ -67,6 +67,24 @@ int main(int argc, char **argv) {
     }
   }
 
+  // Point duplicate bricks to one canonical brick
+  if (config->BrickAliasEpsilon() >= 0.f) {
+    if (!tsp->ReadAliasCache()) {
+      if (!tsp->CalculateBrickAliases()) exit(1);
+      if (!tsp->WriteAliasCache()) exit(1);
+    }
+    if (!tsp->ApplyBrickAliases()) exit(1);
+  }
+
+  // Brick value ranges, used to bound the opacity of a brick
+  if (config->RaycasterOpacityThreshold() < 1.f || 
+      config->EmptySpaceSkipping() == 1) {
+    if (!tsp->ReadRangeCache()) {
+      if (!tsp->CalculateBrickRanges()) exit(1);
+      if (!tsp->WriteRangeCache()) exit(1);
+    }
+  }
+
   // Create brick manager and init (has to be done after init OpenGL!)
   BrickManager *brickManager= BrickManager::New(config);
   if (!brickManager->ReadHeader()) exit(1);
@@ -104,6 +122,7 @@ int main(int argc, char **argv) {
   TransferFunction *transferFunction = TransferFunction::New();
   transferFunction->SetInFilename(config->TFFilename());
   if (!transferFunction->ReadFile()) exit(1);
+  transferFunction->SetPreintegrated(config->PreintegratedTF() == 1);
   if (!transferFunction->ConstructTexture()) exit(1);
   
 
@@ -114,6 +133,7 @@ int main(int argc, char **argv) {
 
   // Create CL manager
   CLManager *clManager = CLManager::New();
+  clManager->SetBinaryCacheDir(config->KernelBinaryCacheDir());
 
   // Set up the raycaster
   Raycaster *raycaster = Raycaster::New(config);
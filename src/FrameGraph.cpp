@@ -0,0 +1,156 @@
+#include <FrameGraph.h>
+#include <Utils.h>
+
+using namespace osp;
+
+namespace {
+  const char *labelNames[FrameGraph::NUM_LABELS] = {
+    "host", "GL", "CL execute", "CL transfer", "CL traversal", "I/O"
+  };
+}
+
+FrameGraph::FrameGraph() : numRuns_(0) {
+}
+
+FrameGraph::~FrameGraph() {
+}
+
+FrameGraph * FrameGraph::New() {
+  return new FrameGraph();
+}
+
+int FrameGraph::FindStage(const std::string &_name) const {
+  for (unsigned int i=0; i<stages_.size(); ++i) {
+    if (stages_[i].name_ == _name) return static_cast<int>(i);
+  }
+  return -1;
+}
+
+bool FrameGraph::AddStage(const std::string &_name,
+                          Label _label,
+                          const std::vector<std::string> &_dependencies,
+                          bool _waits,
+                          StageFunction _function) {
+
+  if (FindStage(_name) != -1) {
+    ERROR("AddStage(): Stage " << _name << " already exists");
+    return false;
+  }
+
+  Stage stage;
+  stage.name_ = _name;
+  stage.label_ = _label;
+  stage.waits_ = _waits;
+  stage.function_ = _function;
+  stage.time_ = 0.0;
+
+  unsigned int index = stages_.size();
+  for (unsigned int i=0; i<_dependencies.size(); ++i) {
+    // Dependencies have to exist already, which keeps the graph acyclic
+    int dependency = FindStage(_dependencies[i]);
+    if (dependency == -1) {
+      ERROR("AddStage(): " << _name << " depends on unknown stage " <<
+            _dependencies[i]);
+      return false;
+    }
+    stage.dependencies_.push_back(static_cast<unsigned int>(dependency));
+    dependents_[dependency].push_back(index);
+  }
+
+  stages_.push_back(stage);
+  dependents_.push_back(std::vector<unsigned int>());
+  numWaiting_.push_back(0);
+  return true;
+}
+
+bool FrameGraph::Run() {
+
+  pending_.clear();
+  for (unsigned int i=0; i<stages_.size(); ++i) {
+    pending_.push_back(i);
+    numWaiting_[i] = stages_[i].dependencies_.size();
+  }
+
+  while (!pending_.empty()) {
+
+    // First ready stage in the order they were added, preferring stages
+    // that don't wait for a device. There always is a ready stage, since
+    // a stage only depends on stages added before it.
+    unsigned int pick = pending_.size();
+    for (unsigned int i=0; i<pending_.size(); ++i) {
+      if (numWaiting_[pending_[i]] != 0) continue;
+      if (!stages_[pending_[i]].waits_) {
+        pick = i;
+        break;
+      }
+      if (pick == pending_.size()) pick = i;
+    }
+
+    unsigned int index = pending_[pick];
+    pending_.erase(pending_.begin() + pick);
+    Stage &stage = stages_[index];
+
+    timer_.start();
+    bool success = stage.function_();
+    timer_.stop();
+    stage.time_ += static_cast<double>(timer_.elapsed().wall) / 1.0e9;
+
+    if (!success) {
+      ERROR("Frame graph stage " << stage.name_ << " failed");
+      return false;
+    }
+
+    for (unsigned int i=0; i<dependents_[index].size(); ++i) {
+      numWaiting_[dependents_[index][i]]--;
+    }
+  }
+
+  numRuns_++;
+  return true;
+}
+
+void FrameGraph::Report() {
+
+  if (numRuns_ == 0) return;
+
+  // Stages are stored after their dependencies, so the longest chain
+  // ending in each stage can be found in one pass
+  std::vector<double> average(stages_.size());
+  std::vector<double> finish(stages_.size());
+  std::vector<int> previous(stages_.size(), -1);
+  double total = 0.0;
+  int last = -1;
+  for (unsigned int i=0; i<stages_.size(); ++i) {
+    average[i] = stages_[i].time_ / static_cast<double>(numRuns_);
+    total += average[i];
+    double start = 0.0;
+    for (unsigned int d=0; d<stages_[i].dependencies_.size(); ++d) {
+      unsigned int dependency = stages_[i].dependencies_[d];
+      if (finish[dependency] > start) {
+        start = finish[dependency];
+        previous[i] = static_cast<int>(dependency);
+      }
+    }
+    finish[i] = start + average[i];
+    if (last == -1 || finish[i] > finish[last]) last = static_cast<int>(i);
+  }
+
+  std::vector<bool> critical(stages_.size(), false);
+  for (int i=last; i!=-1; i=previous[i]) {
+    critical[i] = true;
+  }
+
+  INFO("Frame graph, average over " << numRuns_ << " frames:");
+  for (unsigned int i=0; i<stages_.size(); ++i) {
+    INFO((critical[i] ? " * " : "   ") << stages_[i].name_ << " (" <<
+         labelNames[stages_[i].label_] << "): " <<
+         average[i]*1000.0 << " ms");
+    stages_[i].time_ = 0.0;
+  }
+  if (last != -1) {
+    INFO("Critical path " << finish[last]*1000.0 << " ms of " <<
+         total*1000.0 << " ms");
+  }
+
+  numRuns_ = 0;
+}
@@ -19,12 +19,15 @@
 #include <TransferFunction.h>
 #include <Animator.h>
 #include <vector>
+#include <sstream>
+#include <algorithm>
 #include <CLManager.h>
 #include <KernelConstants.h>
 #include <Config.h>
 #include <stdint.h>
 #include <unistd.h> // sync()
 #include <SGCTWinManager.h>
+#include <FrameGraph.h>
 
 using namespace osp;
 
@@ -83,11 +86,27 @@ Raycaster::Raycaster(Config *_config)
     pingPong_(0),
     lastTimestep_(1),
     brickManager_(NULL),
+    constantsVersion_(0),
+    lookupValid_(false),
+    lookupTimestep_(0),
+    lookupVersion_(0),
+    lookupBuf_(0),
+    lookupBrickListVersion_(0),
+    atlasTransferQueue_(_config->AtlasTransferQueue() == 1),
+    numScattered_(0),
+    maxRequested_(0),
+    requestReadback_(NULL),
+    frameGraph_(NULL),
+    currentBuf_(0),
+    nextTimestep_(0),
+    nextBuf_(0),
+    brickListCLmem_(0),
     clManager_(NULL) {
 }
 
 Raycaster::~Raycaster() {
   // TODO relase GL textures
+  delete frameGraph_;
 }
 
 Raycaster * Raycaster::New(Config *_config) {
@@ -145,6 +164,31 @@ bool Raycaster::Render(float _timestep) {
     return false;
   }
 
+  if (!frameGraph_) {
+    ERROR("Rendering failed, pipeline not initialized");
+    return false;
+  }
+
+  if (!frameGraph_->Run()) return false;
+
+  if (config_->FrameGraphReport() > 0 &&
+      frameGraph_->NumRuns() >= 
+      static_cast<unsigned int>(config_->FrameGraphReport())) {
+    frameGraph_->Report();
+  }
+
+  //timer_.stop();
+  //double time = timer_.elapsed().wall / 1.0e9;
+  //INFO("total time: " << time << "s"); 
+
+  
+  // Window manager takes care of swapping buffers
+
+  return true;
+}
+
+bool Raycaster::RenderCubes() {
+
   if (!UpdateMatrices()) return false;
   if (!BindTransformationMatrices(cubeShaderProgram_)) return false;
 
@@ -200,61 +244,84 @@ bool Raycaster::Render(float _timestep) {
 
   glUseProgram(0);
 
+  return true;
+}
+
+bool Raycaster::SelectBuffers() {
+
   unsigned int currentTimestep;
-  unsigned int nextTimestep;
   if (animator_ != NULL) {
     currentTimestep = animator_->CurrentTimestep();
-    nextTimestep = animator_->NextTimestep();
   } else {
     WARNING("Animator not set");
     currentTimestep = 0;
-    nextTimestep = 1;
   }
 
-  // Choose buffers
-  BrickManager::BUFFER_INDEX currentBuf, nextBuf;
-  if (currentTimestep % 2 == 0) {
-    currentBuf = BrickManager::EVEN;
-    nextBuf = BrickManager::ODD;
+  // When starting a rendering iteration, the buffer holding the current
+  // timestep has been loaded in an earlier frame. After a jump or a 
+  // change of direction it has to be loaded first.
+  int found = FindBuffer(currentTimestep);
+  if (found == -1) {
+    currentBuf_ = EvictableBuffer(brickManager_->NumBuffers());
+    if (!PrepareFrame(currentTimestep, currentBuf_)) return false;
   } else {
-    currentBuf = BrickManager::ODD;
-    nextBuf = BrickManager::EVEN;
+    currentBuf_ = static_cast<unsigned int>(found);
   }
 
+  ScheduleNextFrame(currentBuf_, nextTimestep_, nextBuf_);
+  return true;
+}
 
-  // When starting a rendering iteration, the PBO corresponding to the
-  // current timestep is loaded with the data.
+bool Raycaster::UploadAtlas() {
+
+  // On the transfer queue, the current atlas was filled in earlier frames
+  if (atlasTransferQueue_) {
+    if (!clManager_->AddBuffer("RaycasterTSP", textureAtlasArg_,
+                               atlasCLmem_[currentBuf_])) return false;
+    // The queue is in order, so the last copies cover earlier ones
+    if (atlasPending_[currentBuf_]) {
+      if (!clManager_->AddWaitEvent("RaycasterTSP", "BrickScatter")) {
+        return false;
+      }
+      atlasPending_[currentBuf_] = false;
+    }
+    return true;
+  }
 
+  return brickManager_->PBOToAtlas(currentBuf_);
+}
 
-  // Launch traversal of the next timestep
-  if (!LaunchTSPTraversal(nextTimestep)) return false;
-  
-  // While traversal of next step is working, upload current data to atlas
-  if (!brickManager_->PBOToAtlas(currentBuf)) return false;
+bool Raycaster::UploadBrickList() {
+
+  // The raycaster uses the cut built for the current timestep. That cut
+  // is complete, since its requests have been read.
+  if (!clManager_->AddBuffer("RaycasterTSP", cutArg_, 
+                             cutCLmem_[currentBuf_])) return false;
+
+  // Upload brick list, the buffer is reused between frames. The list is
+  // in pinned memory and isn't rebuilt until the raycast that follows
+  // has been waited for, so the upload doesn't have to block.
+  const int *brickList = brickManager_->BrickList(currentBuf_);
+  if (!clManager_->WriteBuffer("RaycasterTSP", brickListArg_,
+                               const_cast<int*>(brickList),
+                               brickManager_->BrickListSize()*sizeof(int),
+                               false, brickListCLmem_)) return false;
+
+  // Flatten the current cut for the raycaster if needed
+  if (config_->BrickLookupGrid() == 1) {
+    if (!UpdateLookupGrid(currentBuf_, brickListCLmem_)) return false;
+  }
 
-  // Make sure the traversal kernel is done
-  if (!clManager_->FinishProgram("TSPTraversal")) return false;
+  return true;
+}
 
-  // Read buffer and release the memory
-  if (!clManager_->ReadBuffer("TSPTraversal", tspBrickListArg_,
-                              reinterpret_cast<void*>(&brickRequest_[0]),
-                              brickRequest_.size()*sizeof(int),
-                              true)) return false;
+bool Raycaster::LaunchRaycaster() {
 
-  if (!clManager_->ReleaseBuffer("TSPTraversal",tspBrickListArg_))return false;
-  
-  // When traversal of next timestep is done, launch raycasting kernel
-  if (!clManager_->SetInt("RaycasterTSP", timestepArg_, currentTimestep)) 
-    return false;
-
-  // Add brick list
-  if (!clManager_->
-    AddBuffer("RaycasterTSP", brickListArg_,
-      reinterpret_cast<void*>(&(brickManager_->BrickList(currentBuf)[0])),
-      brickManager_->BrickList(currentBuf).size()*sizeof(int),
-      CLManager::COPY_HOST_PTR,
-      CLManager::READ_ONLY)) return false;
-              
+  // The cube textures are shared with the traversal, which has to release
+  // them before they can be acquired on this queue
+  if (!clManager_->AddWaitEvent("RaycasterTSP", "TSPTraversal")) {
+    return false;
+  }
   if (!clManager_->PrepareProgram("RaycasterTSP")) return false;
 
   if (!clManager_->LaunchProgram("RaycasterTSP",
@@ -263,17 +330,13 @@ bool Raycaster::Render(float _timestep) {
                                  config_->LocalWorkSizeX(),
                                  config_->LocalWorkSizeY())) 
                                  return false;
+  return clManager_->ReleaseProgram("RaycasterTSP");
+}
 
-  // While the raycaster kernel is working, build next brick list and start 
-  // upload to the next PBO
-  if (!brickManager_->BuildBrickList(nextBuf, brickRequest_)) return false;
-
-  if (!brickManager_->DiskToPBO(nextBuf)) return false;
-
-  // Finish raycaster and render current frame
-  if (!clManager_->ReleaseBuffer("RaycasterTSP", brickListArg_)) return false;
-  if (!clManager_->FinishProgram("RaycasterTSP")) return false;
+bool Raycaster::RenderQuad() {
 
+  // The quad texture has to be written before GL renders the frame
+  if (!clManager_->SyncGL("RaycasterTSP")) return false;
 
   // Render to framebuffer using quad
   glBindFramebuffer(GL_FRAMEBUFFER, SGCTWinManager::Instance()->FBOHandle());
@@ -306,28 +369,51 @@ bool Raycaster::Render(float _timestep) {
 
   glUseProgram(0);
 
-  //timer_.stop();
-  //double time = timer_.elapsed().wall / 1.0e9;
-  //INFO("total time: " << time << "s"); 
-
-  
-  // Window manager takes care of swapping buffers
-
   return true;
 }
 
-bool Raycaster::LaunchTSPTraversal(unsigned int _timestep) {
+bool Raycaster::LaunchTSPTraversal(unsigned int _timestep, 
+                                   unsigned int _bufIdx) {
+
+  // The cut buffer and the cube textures may still be in use by the last
+  // raycast, on the execute queue. Everything below comes after the cut 
+  // on this queue.
+  if (!clManager_->AddWaitEvent("TSPCut", "RaycasterTSP")) return false;
 
-  if (!clManager_->SetInt("TSPTraversal", tspTimestepArg_, _timestep)) {
+  // Resolve the BST of every octree node once, instead of once per sample
+  if (!clManager_->SetInt("TSPCut", cutTimestepArg_, _timestep)) {
     ERROR("RunTSPTraversal() - Failed to set timestep");
     return false;
   }
+  if (!clManager_->AddBuffer("TSPCut", cutCutArg_, cutCLmem_[_bufIdx])) {
+    return false;
+  }
+  unsigned int numOTNodes = tsp_->NumOTNodes();
+  unsigned int gx = ((numOTNodes+cutLocalSize_-1)/cutLocalSize_) *
+                    cutLocalSize_;
+  if (!clManager_->PrepareProgram("TSPCut")) return false;
+  if (!clManager_->LaunchProgram("TSPCut", gx, cutLocalSize_)) return false;
+  cutTimestep_[_bufIdx] = _timestep;
+  cutVersion_[_bufIdx] = constantsVersion_;
+
+  // The queue is in order, so the traversal sees the finished cut
+  if (!clManager_->AddBuffer("TSPTraversal", tspCutArg_, 
+                             cutCLmem_[_bufIdx])) return false;
+
+  // Start from an empty request list
+  unsigned int numEntries = tsp_->NumTotalNodes();
+  unsigned int clearGx = ((numEntries+clearLocalSize_-1)/clearLocalSize_) *
+                         clearLocalSize_;
+  if (!clManager_->AddBuffer("ClearRequests", clearReqListArg_,
+                             reqCLmem_[_bufIdx])) return false;
+  if (!clManager_->AddBuffer("ClearRequests", clearNumRequestedArg_,
+                             numRequestedCLmem_[_bufIdx])) return false;
+  if (!clManager_->PrepareProgram("ClearRequests")) return false;
+  if (!clManager_->LaunchProgram("ClearRequests", clearGx, 
+                                 clearLocalSize_)) return false;
 
   if (!clManager_->AddBuffer("TSPTraversal", tspBrickListArg_,
-                             reinterpret_cast<void*>(&brickRequest_[0]),
-                             brickRequest_.size()*sizeof(int),
-                             CLManager::COPY_HOST_PTR,
-                             CLManager::READ_WRITE)) return false;
+                             reqCLmem_[_bufIdx])) return false;
 
   if (!clManager_->PrepareProgram("TSPTraversal")) return false;
   if (!clManager_->LaunchProgram("TSPTraversal",
@@ -335,11 +421,202 @@ bool Raycaster::LaunchTSPTraversal(unsigned int _timestep) {
                                  winHeight_,
                                  config_->LocalWorkSizeX(),
                                  config_->LocalWorkSizeY())) return false;
+  if (!clManager_->ReleaseProgram("TSPTraversal")) return false;
+
+  // Gather the requested bricks, so that only those are read back
+  if (!clManager_->AddBuffer("CompactRequests", compactReqListArg_,
+                             reqCLmem_[_bufIdx])) return false;
+  if (!clManager_->AddBuffer("CompactRequests", compactRequestedArg_,
+                             requestedCLmem_[_bufIdx])) return false;
+  if (!clManager_->AddBuffer("CompactRequests", compactNumRequestedArg_,
+                             numRequestedCLmem_[_bufIdx])) return false;
+  if (!clManager_->PrepareProgram("CompactRequests")) return false;
+  if (!clManager_->LaunchProgram("CompactRequests", clearGx,
+                                 compactLocalSize_)) return false;
+
+  return true;
+}
+
+bool Raycaster::ReadBrickRequests() {
+
+  // The count first, then only as many pairs as there are. Both are read
+  // straight into pinned memory.
+  if (!clManager_->ReadBuffer("CompactRequests", compactNumRequestedArg_,
+                              reinterpret_cast<void*>(requestReadback_),
+                              sizeof(int), true)) return false;
+  int numRequested = requestReadback_[0];
+  if (numRequested > static_cast<int>(maxRequested_)) {
+    WARNING("Brick requests truncated from " << numRequested << " to " <<
+            maxRequested_);
+    numRequested = static_cast<int>(maxRequested_);
+  }
+
+  brickRequest_.resize(numRequested);
+  if (numRequested == 0) return true;
+
+  int *requestedPairs = requestReadback_ + 1;
+  if (!clManager_->ReadBuffer("CompactRequests", compactRequestedArg_,
+                              reinterpret_cast<void*>(requestedPairs),
+                              2*numRequested*sizeof(int),
+                              true)) return false;
+  for (int i=0; i<numRequested; ++i) {
+    brickRequest_[i] = requestedPairs[2*i];
+  }
+
+  // Pairs are appended in any order. Ascending order lets the brick 
+  // manager read consecutive bricks together.
+  std::sort(brickRequest_.begin(), brickRequest_.end());
+
+  return true;
+}
+
+
+bool Raycaster::UpdateLookupGrid(unsigned int _bufIdx, cl_mem _brickList) {
+
+  // The grid only changes when the cut (timestep or tolerances) or the
+  // atlas coordinates of the bricks change
+  unsigned int brickListVersion = brickManager_->BrickListVersion(_bufIdx);
+  if (lookupValid_ &&
+      lookupBuf_ == _bufIdx &&
+      lookupTimestep_ == cutTimestep_[_bufIdx] &&
+      lookupVersion_ == cutVersion_[_bufIdx] &&
+      lookupBrickListVersion_ == brickListVersion) {
+    return true;
+  }
+
+  if (!clManager_->AddBuffer("BrickLookup", lookupCutArg_, 
+                             cutCLmem_[_bufIdx])) return false;
+  if (!clManager_->AddBuffer("BrickLookup", lookupBrickListArg_, 
+                             _brickList)) return false;
+
+  unsigned int numBoxes = tsp_->NumBricksPerAxis();
+  unsigned int numCells = numBoxes*numBoxes*numBoxes;
+  unsigned int gx = ((numCells+lookupLocalSize_-1)/lookupLocalSize_) *
+                    lookupLocalSize_;
+  if (!clManager_->PrepareProgram("BrickLookup")) return false;
+  if (!clManager_->LaunchProgram("BrickLookup", gx, lookupLocalSize_)) {
+    return false;
+  }
+
+  lookupValid_ = true;
+  lookupTimestep_ = cutTimestep_[_bufIdx];
+  lookupVersion_ = cutVersion_[_bufIdx];
+  lookupBuf_ = _bufIdx;
+  lookupBrickListVersion_ = brickListVersion;
 
   return true;
 }
 
+bool Raycaster::ScatterBricks(unsigned int _bufIdx) {
+
+  const std::vector<int> &slots = brickManager_->StagedSlots(_bufIdx);
+  numScattered_ = slots.size();
+  if (slots.empty()) return true;
 
+  if (atlasTransferQueue_) return CopyBricksToAtlas(_bufIdx);
+
+  if (!clManager_->AddGLBuffer("BrickScatter", scatterBricksArg_,
+                               stagingCLmem_[_bufIdx])) return false;
+  if (!clManager_->AddGLBuffer("BrickScatter", scatterAtlasArg_,
+                               pboCLmem_[_bufIdx])) return false;
+  // The slots are rebuilt by the next DiskToPBO, which may come before the
+  // transfer queue gets to a pending upload
+  if (!clManager_->WriteBuffer("BrickScatter", scatterSlotsArg_,
+                               const_cast<int*>(&slots[0]),
+                               slots.size()*sizeof(int), true)) {
+    return false;
+  }
+  if (!clManager_->SetInt("BrickScatter", scatterNumBricksArg_,
+                          static_cast<int>(slots.size()))) return false;
+
+  unsigned int numBrickVals = tsp_->PaddedBrickDim() * 
+    tsp_->PaddedBrickDim() * tsp_->PaddedBrickDim();
+  unsigned int gx = ((numBrickVals+scatterLocalSize_-1)/scatterLocalSize_) *
+                    scatterLocalSize_;
+
+  if (!clManager_->PrepareProgram("BrickScatter")) return false;
+  if (!clManager_->LaunchProgram("BrickScatter", gx, slots.size(),
+                                 scatterLocalSize_, 1)) return false;
+  if (!clManager_->ReleaseProgram("BrickScatter")) return false;
+
+  if (!FenceStaging(_bufIdx)) return false;
+
+  // Make sure the PBO is released before GL reads from it
+  return clManager_->SyncGL("BrickScatter");
+}
+
+bool Raycaster::CopyBricksToAtlas(unsigned int _bufIdx) {
+
+  const std::vector<int> &slots = brickManager_->StagedSlots(_bufIdx);
+
+  // One copy per brick, from its place in the staging buffer to its slot.
+  // Raycasts that read this atlas have finished, since the traversal of 
+  // this frame waited for the last one and its requests have been read.
+  size_t paddedBrickDim = tsp_->PaddedBrickDim();
+  size_t numBricksPerAxis = tsp_->NumBricksPerAxis();
+  size_t brickSize = sizeof(float)*paddedBrickDim*paddedBrickDim*
+                     paddedBrickDim;
+  std::vector<size_t> offsets(slots.size());
+  std::vector<size_t> origins(3*slots.size());
+  for (unsigned int i=0; i<slots.size(); ++i) {
+    size_t slot = static_cast<size_t>(slots[i]);
+    offsets[i] = i*brickSize;
+    origins[3*i+0] = (slot % numBricksPerAxis)*paddedBrickDim;
+    origins[3*i+1] = ((slot / numBricksPerAxis) % numBricksPerAxis) *
+                     paddedBrickDim;
+    origins[3*i+2] = (slot / (numBricksPerAxis*numBricksPerAxis)) *
+                     paddedBrickDim;
+  }
+  size_t region[] = { paddedBrickDim, paddedBrickDim, paddedBrickDim };
+
+  // Only the staging buffer is shared with GL
+  if (!clManager_->AddGLBuffer("BrickScatter", scatterBricksArg_,
+                               stagingCLmem_[_bufIdx])) return false;
+  if (!clManager_->PrepareProgram("BrickScatter")) return false;
+  if (!clManager_->CopyBufferToImage("BrickScatter", stagingCLmem_[_bufIdx],
+                                     atlasCLmem_[_bufIdx], offsets, origins,
+                                     region)) return false;
+  if (!clManager_->ReleaseProgram("BrickScatter")) return false;
+  atlasPending_[_bufIdx] = true;
+
+  if (!FenceStaging(_bufIdx)) return false;
+
+  // GL maps the staging buffer again in the next DiskToPBO
+  return clManager_->SyncGL("BrickScatter");
+}
+
+bool Raycaster::FenceStaging(unsigned int _bufIdx) {
+  if (!brickManager_->PersistentStaging()) return true;
+  GLsync fence;
+  if (!clManager_->FenceGL("BrickScatter", fence)) return false;
+  brickManager_->SetStagingFence(_bufIdx, fence);
+  return true;
+}
+
+bool Raycaster::LogTransferOverlap() {
+  if (!clManager_->WaitForProgram("RaycasterTSP")) return false;
+  cl_ulong raycastStart, raycastEnd;
+  if (!clManager_->ProgramTimes("RaycasterTSP", raycastStart, 
+                                raycastEnd)) return false;
+  if (numScattered_ == 0) {
+    INFO("Raycast " << (raycastEnd-raycastStart)/1.0e6 << " ms, " <<
+         "no bricks transferred");
+    return true;
+  }
+
+  if (!clManager_->WaitForProgram("BrickScatter")) return false;
+  cl_ulong transferStart, transferEnd;
+  if (!clManager_->ProgramTimes("BrickScatter", transferStart,
+                                transferEnd)) return false;
+  cl_ulong overlapStart = std::max(raycastStart, transferStart);
+  cl_ulong overlapEnd = std::min(raycastEnd, transferEnd);
+  cl_ulong overlap = overlapEnd > overlapStart ? overlapEnd-overlapStart : 0;
+  INFO("Raycast " << (raycastEnd-raycastStart)/1.0e6 << " ms, " <<
+       "transfer of " << numScattered_ << " bricks " << 
+       (transferEnd-transferStart)/1.0e6 << " ms, overlap " << 
+       overlap/1.0e6 << " ms");
+  return true;
+}
 
 bool Raycaster::InitPipeline() {
 
@@ -355,36 +632,182 @@ bool Raycaster::InitPipeline() {
     return false;
   }
 
-  // Allocate space for the brick request list
-  // Use 0 as default value
-  brickRequest_.resize(tsp_->NumTotalNodes(), 0);
+  // Load the first timestep into the first buffer, the ones ahead of it
+  // are filled by the following frames
+  unsigned int timestep = animator_ ? animator_->CurrentTimestep() : 0;
+  if (!PrepareFrame(timestep, 0)) {
+    ERROR("InitPipeline() - failed to prepare first frame");
+    return false;
+  }
 
-  // Run TSP traversal for timestep 0
-  if (!LaunchTSPTraversal(0)) {
-    ERROR("InitPipeline() - failed to launch TSP traversal");
+  if (!BuildFrameGraph()) {
+    ERROR("InitPipeline() - failed to build frame graph");
     return false;
   }
 
-  // Finish TSP traversal and read results into brick request
-  if (!clManager_->FinishProgram("TSPTraversal")) return false;
+  return true;
+}
+
+bool Raycaster::PrepareFrame(unsigned int _timestep, unsigned int _bufIdx) {
 
-  if (!clManager_->ReadBuffer("TSPTraversal", tspBrickListArg_,
-                              reinterpret_cast<void*>(&brickRequest_[0]),
-                              brickRequest_.size()*sizeof(int),
-                              true)) return false;
+  if (!LaunchTSPTraversal(_timestep, _bufIdx)) {
+    ERROR("PrepareFrame() - failed to launch TSP traversal");
+    return false;
+  }
+
+  // Read results into brick request, waiting for the traversal
+  if (!ReadBrickRequests()) return false;
+
+  // Upload data to the buffer
+  if (!brickManager_->BuildBrickList(_bufIdx, brickRequest_)) return false;
+  if (!brickManager_->DiskToPBO(_bufIdx)) return false;
+  if (!ScatterBricks(_bufIdx)) return false;
+  TagBuffer(_bufIdx, _timestep);
 
-  // Free device memory
-  if (!clManager_->ReleaseBuffer("TSPTraversal",tspBrickListArg_))return false;
+  return true;
+}
 
-  // Upload data for timestep 0 to PBO
-  if (!brickManager_->BuildBrickList(BrickManager::EVEN, 
-                                     brickRequest_)) return false;
-  if (!brickManager_->DiskToPBO(BrickManager::EVEN)) return false;
-  //if (!brickManager_->PBOToAtlas(BrickManager::EVEN)) return false;
+bool Raycaster::BuildFrameGraph() {
+
+  delete frameGraph_;
+  frameGraph_ = FrameGraph::New();
+
+  typedef std::vector<std::string> Deps;
+  FrameGraph *g = frameGraph_;
+
+  // Draw the cube faces the rays are cast between
+  if (!g->AddStage("cubes", FrameGraph::GL, Deps(), false,
+                   [this]() { return RenderCubes(); })) return false;
+
+  // Find the current timestep in the ring, loading it on a miss, and pick
+  // the timestep to stream this frame
+  if (!g->AddStage("schedule", FrameGraph::HOST, Deps{"cubes"}, false,
+                   [this]() { return SelectBuffers(); })) return false;
+
+  // Traverse the next timestep on its own queue
+  if (!g->AddStage("traversal", FrameGraph::CL_TRAVERSAL, 
+                   Deps{"schedule"}, false, [this]() {
+                     return LaunchTSPTraversal(nextTimestep_, nextBuf_);
+                   })) return false;
+
+  if (!g->AddStage("atlas", atlasTransferQueue_ ? FrameGraph::CL_EXECUTE :
+                   FrameGraph::GL, Deps{"schedule"}, false,
+                   [this]() { return UploadAtlas(); })) return false;
+
+  if (!g->AddStage("brick list", FrameGraph::CL_EXECUTE, 
+                   Deps{"schedule"}, false,
+                   [this]() { return UploadBrickList(); })) return false;
+
+  // Shares the cube textures with the traversal
+  if (!g->AddStage("raycast", FrameGraph::CL_EXECUTE,
+                   Deps{"traversal", "atlas", "brick list"}, false,
+                   [this]() { return LaunchRaycaster(); })) return false;
+
+  // Only the traversal queue is waited for, the raycaster keeps running
+  if (!g->AddStage("requests", FrameGraph::CL_TRAVERSAL, 
+                   Deps{"traversal"}, true,
+                   [this]() { return ReadBrickRequests(); })) return false;
+
+  if (!g->AddStage("build list", FrameGraph::HOST, Deps{"requests"}, false,
+                   [this]() {
+                     return brickManager_->BuildBrickList(nextBuf_, 
+                                                          brickRequest_);
+                   })) return false;
+
+  if (!g->AddStage("disk", FrameGraph::IO, Deps{"build list"}, false,
+                   [this]() { 
+                     return brickManager_->DiskToPBO(nextBuf_); 
+                   })) return false;
+
+  // Place the new bricks in the next PBO or atlas, on the transfer queue
+  if (!g->AddStage("scatter", FrameGraph::CL_TRANSFER, Deps{"disk"}, false,
+                   [this]() {
+                     if (!ScatterBricks(nextBuf_)) return false;
+                     TagBuffer(nextBuf_, nextTimestep_);
+                     return true;
+                   })) return false;
+
+  if (!g->AddStage("quad", FrameGraph::GL, Deps{"raycast"}, true,
+                   [this]() { return RenderQuad(); })) return false;
+
+  if (config_->CLProfiling() == 1) {
+    if (!g->AddStage("profiling", FrameGraph::HOST, 
+                     Deps{"raycast", "scatter"}, true,
+                     [this]() { return LogTransferOverlap(); })) {
+      return false;
+    }
+  }
 
   return true;
 }
 
+int Raycaster::FindBuffer(unsigned int _timestep) const {
+  for (unsigned int i=0; i<bufferTimestep_.size(); ++i) {
+    if (bufferTimestep_[i] == static_cast<int>(_timestep)) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+void Raycaster::TagBuffer(unsigned int _bufIdx, unsigned int _timestep) {
+  // An older copy of the timestep, loaded with an earlier view, would be
+  // found first. Free its buffer instead.
+  for (unsigned int i=0; i<bufferTimestep_.size(); ++i) {
+    if (bufferTimestep_[i] == static_cast<int>(_timestep)) {
+      bufferTimestep_[i] = -1;
+    }
+  }
+  bufferTimestep_[_bufIdx] = static_cast<int>(_timestep);
+}
+
+unsigned int Raycaster::TimestepAhead(unsigned int _steps) const {
+  if (animator_) return animator_->TimestepAhead(_steps);
+  return _steps % tsp_->NumTimesteps();
+}
+
+unsigned int Raycaster::EvictableBuffer(unsigned int _keepBuf) const {
+  unsigned int numBuffers = bufferTimestep_.size();
+  int fallback = -1;
+  for (unsigned int i=0; i<numBuffers; ++i) {
+    if (i == _keepBuf) continue;
+    if (fallback == -1) fallback = static_cast<int>(i);
+    if (bufferTimestep_[i] == -1) return i;
+    bool ahead = false;
+    for (unsigned int k=1; k<numBuffers && !ahead; ++k) {
+      ahead = bufferTimestep_[i] == static_cast<int>(TimestepAhead(k));
+    }
+    if (!ahead) return i;
+  }
+  return static_cast<unsigned int>(fallback);
+}
+
+void Raycaster::ScheduleNextFrame(unsigned int _currentBuf,
+                                  unsigned int &_timestep,
+                                  unsigned int &_bufIdx) const {
+  // Fill the ring in the direction of playback, nearest timestep first
+  unsigned int numBuffers = bufferTimestep_.size();
+  for (unsigned int k=1; k<numBuffers; ++k) {
+    unsigned int timestep = TimestepAhead(k);
+    if (FindBuffer(timestep) == -1) {
+      _timestep = timestep;
+      _bufIdx = EvictableBuffer(_currentBuf);
+      return;
+    }
+  }
+
+  // Everything ahead is loaded, so keep the next timestep up to date with
+  // the view. With a single timestep the next one is the current one, 
+  // which is being rendered from.
+  _timestep = TimestepAhead(1);
+  int found = FindBuffer(_timestep);
+  if (found == -1 || found == static_cast<int>(_currentBuf)) {
+    _bufIdx = EvictableBuffer(_currentBuf);
+  } else {
+    _bufIdx = static_cast<unsigned int>(found);
+  }
+}
+
 
 // TODO Move out hardcoded values
 bool Raycaster::InitMatrices() {
@@ -582,12 +1005,66 @@ bool Raycaster::ReloadTransferFunctions() {
 
   INFO("Reloading transfer functions");
   if (!transferFunctions_[0]->ReadFile()) return false;
+  transferFunctions_[0]->SetPreintegrated(config_->PreintegratedTF() == 1);
   if (!transferFunctions_[0]->ConstructTexture()) return false;
 
   if (!clManager_->AddTexture("RaycasterTSP", transferFunctionArg_,
                               transferFunctions_[0]->Texture(),
                               CLManager::TEXTURE_2D,
                               CLManager::READ_ONLY)) return false;
+  if (!clManager_->AddTexture("RaycasterTSP", preintegratedArg_,
+                              transferFunctions_[0]->PreintegratedTexture(),
+                              CLManager::TEXTURE_2D,
+                              CLManager::READ_ONLY)) return false;
+
+  if (!UpdateBrickOpacity()) return false;
+
+  return true;
+}
+
+bool Raycaster::UpdateBrickOpacity() {
+
+  // Without brick ranges nothing is known, and every brick is assumed to
+  // be transparent but visible
+  const std::vector<float> &ranges = tsp_->BrickRanges();
+  bool haveRanges = ranges.size() == 2*tsp_->NumTotalNodes();
+  bool skipEmpty = haveRanges && config_->EmptySpaceSkipping() == 1;
+  brickMinAlpha_.assign(tsp_->NumTotalNodes(), 0.f);
+  brickOccupancy_.assign(tsp_->NumTotalNodes(), 1);
+  unsigned int numEmpty = 0;
+  if (haveRanges) {
+    for (unsigned int i=0; i<brickMinAlpha_.size(); ++i) {
+      brickMinAlpha_[i] = transferFunctions_[0]->MinAlpha(ranges[2*i+0],
+                                                          ranges[2*i+1]);
+      if (skipEmpty && transferFunctions_[0]->MaxAlpha(ranges[2*i+0],
+                                                       ranges[2*i+1]) == 0.f) {
+        brickOccupancy_[i] = 0;
+        numEmpty++;
+      }
+    }
+  }
+  if (skipEmpty) {
+    INFO("Empty bricks: " << numEmpty << " of " << brickOccupancy_.size());
+  }
+
+  // Same size every time, so the buffers are overwritten in place
+  if (!clManager_->WriteBuffer("TSPTraversal", tspBrickMinAlphaArg_,
+                               reinterpret_cast<void*>(&brickMinAlpha_[0]),
+                               brickMinAlpha_.size()*sizeof(float),
+                               true)) return false;
+  cl_mem occupancyCLmem;
+  if (!clManager_->WriteBuffer("TSPTraversal", tspOccupancyArg_,
+                               reinterpret_cast<void*>(&brickOccupancy_[0]),
+                               brickOccupancy_.size()*sizeof(int),
+                               true, occupancyCLmem)) return false;
+  if (!clManager_->AddBuffer("RaycasterTSP", occupancyArg_, 
+                             occupancyCLmem)) return false;
+  if (!clManager_->AddBuffer("BrickLookup", lookupOccupancyArg_, 
+                             occupancyCLmem)) return false;
+
+  // Empty bricks are marked in the lookup grid
+  lookupValid_ = false;
+
   return true;
 }
 
@@ -672,6 +1149,11 @@ bool Raycaster::HandleMouse() {
 }
 
 bool Raycaster::Reload() {
+  // Buffers and textures that queued kernels use are replaced below
+  for (unsigned int i=0; i<CLManager::NUM_QUEUE_INDICES; ++i) {
+    CLManager::QueueIndex queue = static_cast<CLManager::QueueIndex>(i);
+    if (!clManager_->FinishQueue(queue)) return false;
+  }
   if (!config_->Read()) return false; 
    INFO("Config file read");
    if (!UpdateKernelConstants()) return false;
@@ -725,6 +1207,18 @@ bool Raycaster::KeyLastState(int _key) const {
   }
 }
 
+std::string Raycaster::KernelDefines() const {
+  std::stringstream ss;
+  ss << "-D GRID_TYPE=" << brickManager_->GridType()
+     << " -D NUM_TIMESTEPS=" << tsp_->NumTimesteps()
+     << " -D NUM_VALUES_PER_NODE=" << tsp_->NumValuesPerNode()
+     << " -D NUM_OT_NODES=" << tsp_->NumOTNodes()
+     << " -D NUM_BOXES_PER_AXIS=" << tsp_->NumBricksPerAxis()
+     << " -D ROOT_LEVEL=" << tsp_->NumOTLevels()-1
+     << " -D PADDED_BRICK_DIM=" << tsp_->PaddedBrickDim();
+  return ss.str();
+}
+
 bool Raycaster::InitCL() {
 
   INFO("Initializing OpenCL");
@@ -738,15 +1232,36 @@ bool Raycaster::InitCL() {
   if (!clManager_->InitPlatform()) return false;
   if (!clManager_->InitDevices()) return false;
   if (!clManager_->CreateContext()) return false;
+  clManager_->SetProfiling(config_->CLProfiling() == 1);
   if (!clManager_->CreateCommandQueue()) return false;
 
+  // Specialize all kernels for the dataset
+  std::string defines = KernelDefines();
+
+  // Per frame resources, one for each buffer in the ring
+  unsigned int numBuffers = brickManager_->NumBuffers();
+  cutCLmem_.resize(numBuffers);
+  cutTimestep_.resize(numBuffers);
+  cutVersion_.resize(numBuffers);
+  stagingCLmem_.resize(numBuffers);
+  pboCLmem_.resize(numBuffers);
+  atlasCLmem_.resize(numBuffers);
+  atlasPending_.assign(numBuffers, false);
+  reqCLmem_.resize(numBuffers);
+  requestedCLmem_.resize(numBuffers);
+  numRequestedCLmem_.resize(numBuffers);
+  bufferTimestep_.assign(numBuffers, -1);
+
   // TSP traversal part of raycaster
   if (!clManager_->CreateProgram("TSPTraversal",
                                  config_->TSPTraversalKernelFilename())) {
     return false;
   }
-  if (!clManager_->BuildProgram("TSPTraversal")) return false;
+  if (!clManager_->BuildProgram("TSPTraversal", defines)) return false;
   if (!clManager_->CreateKernel("TSPTraversal")) return false;
+  if (!clManager_->SetQueue("TSPTraversal", CLManager::TRAVERSAL)) {
+    return false;
+  }
   cl_mem cubeFrontCLmem;
   if (!clManager_->AddTexture("TSPTraversal", tspCubeFrontArg_, 
                               cubeFrontTex_, CLManager::TEXTURE_2D,
@@ -759,11 +1274,110 @@ bool Raycaster::InitCL() {
                               CLManager::READ_ONLY, cubeBackCLmem)) {
     return false;
   }
-  if (!clManager_->AddBuffer("TSPTraversal", tspTSPArg_,
+
+  // Request lists, one for each buffer index
+  std::vector<int> emptyRequest(tsp_->NumTotalNodes(), 0);
+  for (unsigned int i=0; i<numBuffers; ++i) {
+    if (!clManager_->AddBuffer("TSPTraversal", tspBrickListArg_,
+                               reinterpret_cast<void*>(&emptyRequest[0]),
+                               emptyRequest.size()*sizeof(int),
+                               CLManager::COPY_HOST_PTR,
+                               CLManager::READ_WRITE, reqCLmem_[i])) {
+      return false;
+    }
+  }
+
+  // Clears a request list on the device before each traversal
+  if (!clManager_->CreateProgram("ClearRequests",
+                                 config_->ClearRequestsKernelFilename())) {
+    return false;
+  }
+  if (!clManager_->BuildProgram("ClearRequests", defines)) return false;
+  if (!clManager_->CreateKernel("ClearRequests")) return false;
+  if (!clManager_->SetQueue("ClearRequests", CLManager::TRAVERSAL)) {
+    return false;
+  }
+  if (!clManager_->SetInt("ClearRequests", clearNumEntriesArg_,
+                          static_cast<int>(tsp_->NumTotalNodes()))) {
+    return false;
+  }
+
+  // Compacts a request list into (brick, count) pairs after a traversal
+  if (!clManager_->CreateProgram("CompactRequests",
+                                 config_->CompactRequestsKernelFilename())) {
+    return false;
+  }
+  if (!clManager_->BuildProgram("CompactRequests", defines)) return false;
+  if (!clManager_->CreateKernel("CompactRequests")) return false;
+  if (!clManager_->SetQueue("CompactRequests", CLManager::TRAVERSAL)) {
+    return false;
+  }
+  unsigned int numBoxesPerAxis = tsp_->NumBricksPerAxis();
+  maxRequested_ = numBoxesPerAxis*numBoxesPerAxis*numBoxesPerAxis;
+  std::vector<int> emptyRequested(2*maxRequested_, 0);
+  int zero = 0;
+  for (unsigned int i=0; i<numBuffers; ++i) {
+    if (!clManager_->AddBuffer("CompactRequests", compactRequestedArg_,
+                               reinterpret_cast<void*>(&emptyRequested[0]),
+                               emptyRequested.size()*sizeof(int),
+                               CLManager::COPY_HOST_PTR,
+                               CLManager::READ_WRITE, requestedCLmem_[i])) {
+      return false;
+    }
+    if (!clManager_->AddBuffer("CompactRequests", compactNumRequestedArg_,
+                               reinterpret_cast<void*>(&zero), sizeof(int),
+                               CLManager::COPY_HOST_PTR,
+                               CLManager::READ_WRITE, 
+                               numRequestedCLmem_[i])) {
+      return false;
+    }
+  }
+  if (!clManager_->SetInt("CompactRequests", compactNumEntriesArg_,
+                          static_cast<int>(tsp_->NumTotalNodes()))) {
+    return false;
+  }
+  if (!clManager_->SetInt("CompactRequests", compactMaxRequestedArg_,
+                          static_cast<int>(maxRequested_))) return false;
+
+  // Host side of the request readback and the brick list uploads
+  void *pinned;
+  if (!clManager_->CreatePinnedMemory((1+2*maxRequested_)*sizeof(int),
+                                      pinned)) return false;
+  requestReadback_ = reinterpret_cast<int*>(pinned);
+  for (unsigned int i=0; i<numBuffers; ++i) {
+    if (!clManager_->CreatePinnedMemory(
+          brickManager_->BrickListSize()*sizeof(int), pinned)) return false;
+    if (!brickManager_->SetBrickListMemory(i, 
+                                           reinterpret_cast<int*>(pinned))) {
+      return false;
+    }
+  }
+
+  // Octree cut, the only kernel that looks at the BSTs
+  if (!clManager_->CreateProgram("TSPCut",
+                                 config_->TSPCutKernelFilename())) {
+    return false;
+  }
+  if (!clManager_->BuildProgram("TSPCut", defines)) return false;
+  if (!clManager_->CreateKernel("TSPCut")) return false;
+  if (!clManager_->SetQueue("TSPCut", CLManager::TRAVERSAL)) return false;
+  if (!clManager_->AddBuffer("TSPCut", cutTSPArg_,
                              reinterpret_cast<void*>(tsp_->Data()),
                              tsp_->Size()*sizeof(int),
                              CLManager::COPY_HOST_PTR,
                              CLManager::READ_ONLY)) return false;
+  std::vector<int> emptyCut(tsp_->NumOTNodes(), -1);
+  for (unsigned int i=0; i<numBuffers; ++i) {
+    if (!clManager_->AddBuffer("TSPCut", cutCutArg_,
+                               reinterpret_cast<void*>(&emptyCut[0]),
+                               emptyCut.size()*sizeof(int),
+                               CLManager::COPY_HOST_PTR,
+                               CLManager::READ_WRITE, cutCLmem_[i])) {
+      return false;
+    }
+    cutTimestep_[i] = 0;
+    cutVersion_[i] = 0;
+  }
 
 
   // Raycaster part
@@ -771,7 +1385,7 @@ bool Raycaster::InitCL() {
                                 config_->RaycasterKernelFilename())) {
     return false;
   }
-  if (!clManager_->BuildProgram("RaycasterTSP")) return false;
+  if (!clManager_->BuildProgram("RaycasterTSP", defines)) return false;
   if (!clManager_->CreateKernel("RaycasterTSP")) return false;
   if (!clManager_->AddTexture("RaycasterTSP", cubeFrontArg_, cubeFrontCLmem,  
                               CLManager::READ_ONLY)) return false;
@@ -780,14 +1394,30 @@ bool Raycaster::InitCL() {
   if (!clManager_->AddTexture("RaycasterTSP", quadArg_, quadTex_, 
                               CLManager::TEXTURE_2D, 
                               CLManager::WRITE_ONLY)) return false;
-  if (!clManager_->AddTexture("RaycasterTSP", textureAtlasArg_, 
-                              brickManager_->TextureAtlas(),
-                              CLManager::TEXTURE_3D, 
-                              CLManager::READ_ONLY)) return false;
+  if (atlasTransferQueue_) {
+    unsigned int atlasDim = tsp_->PaddedBrickDim()*tsp_->NumBricksPerAxis();
+    for (unsigned int i=0; i<numBuffers; ++i) {
+      if (!clManager_->AddImage3D("RaycasterTSP", textureAtlasArg_,
+                                  atlasDim, atlasDim, atlasDim,
+                                  CLManager::READ_ONLY, atlasCLmem_[i])) {
+        return false;
+      }
+      atlasPending_[i] = false;
+    }
+  } else {
+    if (!clManager_->AddTexture("RaycasterTSP", textureAtlasArg_, 
+                                brickManager_->TextureAtlas(),
+                                CLManager::TEXTURE_3D, 
+                                CLManager::READ_ONLY)) return false;
+  }
   if (!clManager_->AddTexture("RaycasterTSP", transferFunctionArg_,
                               transferFunctions_[0]->Texture(),
                               CLManager::TEXTURE_2D,
                               CLManager::READ_ONLY)) return false;
+  if (!clManager_->AddTexture("RaycasterTSP", preintegratedArg_,
+                              transferFunctions_[0]->PreintegratedTexture(),
+                              CLManager::TEXTURE_2D,
+                              CLManager::READ_ONLY)) return false;
 
   // Add transfer function
   //float* tfData = transferFunctions_[0]->FloatData();
@@ -798,11 +1428,69 @@ bool Raycaster::InitCL() {
   //                           CLManager::COPY_HOST_PTR,
   //                           CLManager::READ_ONLY)) return false;
 
-  if (!clManager_->AddBuffer("RaycasterTSP", tspArg_,
-                             reinterpret_cast<void*>(tsp_->Data()),
-                             tsp_->Size()*sizeof(int),
+  // Brick lookup grid, an alternative to walking the cut in the raycaster
+  if (!clManager_->CreateProgram("BrickLookup",
+                                 config_->BrickLookupKernelFilename())) {
+    return false;
+  }
+  if (!clManager_->BuildProgram("BrickLookup", defines)) return false;
+  if (!clManager_->CreateKernel("BrickLookup")) return false;
+  // Allocate the full grid even if it's unused, so that it can be turned 
+  // on when reloading the config
+  unsigned int numBoxes = tsp_->NumBricksPerAxis();
+  std::vector<int> emptyLookup(4*numBoxes*numBoxes*numBoxes, 0);
+  if (!clManager_->AddBuffer("BrickLookup", lookupGridArg_,
+                             reinterpret_cast<void*>(&emptyLookup[0]),
+                             emptyLookup.size()*sizeof(int),
                              CLManager::COPY_HOST_PTR,
-                             CLManager::READ_ONLY)) return false;
+                             CLManager::READ_WRITE, lookupCLmem_)) {
+    return false;
+  }
+  if (!clManager_->AddBuffer("RaycasterTSP", lookupArg_, lookupCLmem_)) {
+    return false;
+  }
+  if (!clManager_->SetInt("BrickLookup", lookupNumBoxesPerAxisArg_,
+                          static_cast<int>(numBoxes))) return false;
+  if (!clManager_->SetInt("BrickLookup", lookupRootLevelArg_,
+                          static_cast<int>(tsp_->NumOTLevels())-1)) {
+    return false;
+  }
+
+  // Brick scatter, moves streamed bricks from the staging buffers to the
+  // atlas shaped PBOs
+  if (!clManager_->CreateProgram("BrickScatter",
+                                 config_->BrickScatterKernelFilename())) {
+    return false;
+  }
+  if (!clManager_->BuildProgram("BrickScatter", defines)) return false;
+  if (!clManager_->CreateKernel("BrickScatter")) return false;
+  if (!clManager_->SetQueue("BrickScatter", CLManager::TRANSFER)) {
+    return false;
+  }
+  for (unsigned int i=0; i<numBuffers; ++i) {
+    if (!clManager_->AddGLBuffer("BrickScatter", scatterBricksArg_,
+                                 brickManager_->StagingHandle(i),
+                                 CLManager::READ_ONLY, stagingCLmem_[i])) {
+      return false;
+    }
+    if (atlasTransferQueue_) continue;
+    if (!clManager_->AddGLBuffer("BrickScatter", scatterAtlasArg_,
+                                 brickManager_->PBOHandle(i),
+                                 CLManager::WRITE_ONLY, pboCLmem_[i])) {
+      return false;
+    }
+  }
+  if (!clManager_->SetInt("BrickScatter", scatterPaddedBrickDimArg_,
+                          static_cast<int>(tsp_->PaddedBrickDim()))) {
+    return false;
+  }
+  if (!clManager_->SetInt("BrickScatter", scatterNumBricksPerAxisArg_,
+                          static_cast<int>(tsp_->NumBricksPerAxis()))) {
+    return false;
+  }
+
+  // Brick opacity bounds from the transfer function
+  if (!UpdateBrickOpacity()) return false;
 
   // Update and add kernel constants
   if (!UpdateKernelConstants()) return false;
@@ -837,26 +1525,32 @@ bool Raycaster::UpdateKernelConstants() {
   kernelConstants_.spatialTolerance_ = config_->SpatialErrorTolerance();
   kernelConstants_.rootLevel_ = static_cast<int>(tsp_->NumOTLevels()) - 1;
   kernelConstants_.paddedBrickDim_ = static_cast<int>(tsp_->PaddedBrickDim());
+  kernelConstants_.useLookupGrid_ = config_->BrickLookupGrid() == 1 ? 1 : 0;
+  kernelConstants_.opacityThreshold_ = config_->RaycasterOpacityThreshold();
+  kernelConstants_.preintegrated_ = config_->PreintegratedTF() == 1 ? 1 : 0;
 
   traversalConstants_.gridType_ = static_cast<int>(brickManager_->GridType());
-  traversalConstants_.stepsize_ = config_->TSPTraversalStepsize();
+  traversalConstants_.stepsize_ = config_->RaycasterStepsize();
   traversalConstants_.numTimesteps_ = static_cast<int>(tsp_->NumTimesteps());
   traversalConstants_.numValuesPerNode_ = 
     static_cast<int>(tsp_->NumValuesPerNode());
   traversalConstants_.numOTNodes_ = static_cast<int>(tsp_->NumOTNodes());
   traversalConstants_.temporalTolerance_ = config_->TemporalErrorTolerance();
   traversalConstants_.spatialTolerance_ = config_->SpatialErrorTolerance(); 
-
-  if (!clManager_->AddBuffer("RaycasterTSP", constantsArg_,
-                             reinterpret_cast<void*>(&kernelConstants_),
-                             sizeof(KernelConstants),
-                             CLManager::COPY_HOST_PTR,
-                             CLManager::READ_ONLY)) return false;
-  if (!clManager_->AddBuffer("TSPTraversal", tspConstantsArg_,
-                             reinterpret_cast<void*>(&traversalConstants_),
-                             sizeof(TraversalConstants),
-                             CLManager::COPY_HOST_PTR,
-                             CLManager::READ_ONLY)) return false;
+  traversalConstants_.opacityThreshold_ = config_->RaycasterOpacityThreshold();
+  // Cuts built from here on may differ from earlier ones
+  constantsVersion_++;
+
+  if (!clManager_->WriteBuffer("RaycasterTSP", constantsArg_,
+                               reinterpret_cast<void*>(&kernelConstants_),
+                               sizeof(KernelConstants), true)) return false;
+  cl_mem traversalConstantsCLmem;
+  if (!clManager_->WriteBuffer("TSPTraversal", tspConstantsArg_,
+                               reinterpret_cast<void*>(&traversalConstants_),
+                               sizeof(TraversalConstants), true,
+                               traversalConstantsCLmem)) return false;
+  if (!clManager_->AddBuffer("TSPCut", cutConstantsArg_,
+                             traversalConstantsCLmem)) return false;
 
   return true;
 }
@@ -141,9 +141,8 @@ void SGCTWinManager::Keyboard(int _key, int _action) {
       break;
     case 'Z':
     case 'z':
-      // Decrease timestep
-      // NOTE: Can't decrease timestep with double buffered approach atm
-      //manualTimestep_.setVal(-1);
+      // Decrease timestep, playback continues backwards
+      manualTimestep_.setVal(-1);
       break;
     case 'X':
     case 'x':
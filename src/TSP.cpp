@@ -12,10 +12,11 @@
 #include <queue>
 #include <TransferFunction.h>
 #include <algorithm>
+#include <unordered_map>
 
 using namespace osp;
 
-TSP::TSP(Config *_config) : config_(_config) {
+TSP::TSP(Config *_config) : config_(_config), numUniqueBricks_(0) {
 }
 
 TSP * TSP::New(Config *_config) {
@@ -571,6 +572,279 @@ bool TSP::WriteCache() {
   return true;
 }
 
+bool TSP::ReadBrick(std::FILE *_in, unsigned int _brickIndex,
+                    std::vector<float> &_buffer) {
+  off offset = dataPos_ + static_cast<off>(_brickIndex) *
+               static_cast<off>(_buffer.size()*sizeof(float));
+  fseeko(_in, offset, SEEK_SET);
+  if (fread(reinterpret_cast<void*>(&_buffer[0]), 
+            _buffer.size()*sizeof(float), 1, _in) != 1) {
+    ERROR("Failed to read brick " << _brickIndex);
+    return false;
+  }
+  return true;
+}
+
+bool TSP::CalculateBrickAliases() {
+
+  float epsilon = config_->BrickAliasEpsilon();
+  if (epsilon < 0.f) {
+    ERROR("CalculateBrickAliases() - brick aliasing is disabled");
+    return false;
+  }
+
+  std::string inFilename = config_->TSPFilename();
+  std::FILE *in = fopen(inFilename.c_str(), "r");
+  if (!in) {
+    ERROR("Failed to open " << inFilename);
+    return false;
+  }
+
+  INFO("\nCalculating brick aliases, epsilon: " << epsilon);
+
+  unsigned int numBrickVals = paddedBrickDim_*paddedBrickDim_*paddedBrickDim_;
+  std::vector<float> buffer(numBrickVals);
+  std::vector<float> candidate(numBrickVals);
+  // Quantized values, only used for near-duplicate hashing
+  std::vector<int> quantized(numBrickVals);
+
+  // Canonical bricks, bucketed by the hash of their contents
+  std::unordered_map<uint64_t, std::vector<unsigned int> > canonicals;
+
+  brickAliases_.resize(numTotalNodes_);
+  numUniqueBricks_ = 0;
+
+  for (unsigned int brick=0; brick<numTotalNodes_; ++brick) {
+
+    if (!ReadBrick(in, brick, buffer)) {
+      fclose(in);
+      return false;
+    }
+
+    // Exact duplicates hash the raw bits. Near-duplicates hash values
+    // snapped to an epsilon-sized grid, which finds most (but not all)
+    // matches. Matches are always verified, so collisions are harmless.
+    uint64_t hash;
+    if (epsilon == 0.f) {
+      hash = Hash64(&buffer[0], numBrickVals*sizeof(float));
+    } else {
+      for (unsigned int i=0; i<numBrickVals; ++i) {
+        quantized[i] = static_cast<int>(floorf(buffer[i]/epsilon));
+      }
+      hash = Hash64(&quantized[0], numBrickVals*sizeof(int));
+    }
+
+    int alias = static_cast<int>(brick);
+    std::vector<unsigned int> &bucket = canonicals[hash];
+    for (auto it=bucket.begin(); it!=bucket.end(); ++it) {
+      if (!ReadBrick(in, *it, candidate)) {
+        fclose(in);
+        return false;
+      }
+      bool match = true;
+      for (unsigned int i=0; i<numBrickVals && match; ++i) {
+        match = fabs(buffer[i]-candidate[i]) <= epsilon;
+      }
+      if (match) {
+        alias = static_cast<int>(*it);
+        break;
+      }
+    }
+
+    if (alias == static_cast<int>(brick)) {
+      bucket.push_back(brick);
+      numUniqueBricks_++;
+    }
+    brickAliases_[brick] = alias;
+  }
+
+  fclose(in);
+
+  INFO("Unique bricks: " << numUniqueBricks_ << " of " << numTotalNodes_);
+
+  return true;
+}
+
+bool TSP::ApplyBrickAliases() {
+
+  if (brickAliases_.size() != numTotalNodes_) {
+    ERROR("ApplyBrickAliases() - no alias table");
+    return false;
+  }
+
+  for (unsigned int i=0; i<numTotalNodes_; ++i) {
+    data_[i*NUM_DATA + BRICK_INDEX] = brickAliases_[i];
+  }
+
+  double aliasedGB = static_cast<double>(numTotalNodes_-numUniqueBricks_) * 
+    static_cast<double>(paddedBrickDim_*paddedBrickDim_*paddedBrickDim_) *
+    sizeof(float) / 1073741824.0;
+  INFO("Aliased bricks: " << numTotalNodes_-numUniqueBricks_ << 
+       " (" << aliasedGB << " GB that never needs streaming)");
+
+  return true;
+}
+
+bool TSP::ReadAliasCache() {
+
+  std::string cacheFilename = config_->TSPFilename() + ".alias";
+
+  std::FILE *in = fopen(cacheFilename.c_str(), "rb");
+  if (!in) {
+    INFO("No alias cache " << cacheFilename);
+    return false;
+  }
+
+  // The cache is only valid for the same epsilon and TSP file
+  float epsilon = 0.f;
+  unsigned int numBricks = 0;
+  uint64_t tspSize = 0;
+  uint64_t tspTime = 0;
+  bool read = fread(&epsilon, sizeof(float), 1, in) == 1 &&
+              fread(&numBricks, sizeof(unsigned int), 1, in) == 1 &&
+              fread(&tspSize, sizeof(uint64_t), 1, in) == 1 &&
+              fread(&tspTime, sizeof(uint64_t), 1, in) == 1;
+  uint64_t size, time;
+  if (!read || !FileStamp(config_->TSPFilename(), size, time) ||
+      epsilon != config_->BrickAliasEpsilon() || 
+      numBricks != numTotalNodes_ || tspSize != size || tspTime != time) {
+    INFO("Alias cache " << cacheFilename << " is out of date");
+    fclose(in);
+    return false;
+  }
+
+  brickAliases_.resize(numTotalNodes_);
+  read = fread(&numUniqueBricks_, sizeof(unsigned int), 1, in) == 1 &&
+         fread(&brickAliases_[0], sizeof(int), numTotalNodes_, in) == 
+           numTotalNodes_;
+  fclose(in);
+  if (!read) {
+    INFO("Alias cache " << cacheFilename << " is incomplete");
+    brickAliases_.clear();
+    return false;
+  }
+
+  INFO("\nCached unique bricks: " << numUniqueBricks_ << " of " << 
+       numTotalNodes_);
+
+  return true;
+}
+
+bool TSP::WriteAliasCache() {
+
+  std::string cacheFilename = config_->TSPFilename() + ".alias";
+  INFO("Writing alias cache to " << cacheFilename);
+
+  uint64_t tspSize, tspTime;
+  if (!FileStamp(config_->TSPFilename(), tspSize, tspTime)) return false;
+
+  // Written under a temporary name, so that an interrupted run never 
+  // leaves a partial cache behind
+  std::string tmpFilename = TempFilename(cacheFilename);
+  std::FILE *out = fopen(tmpFilename.c_str(), "wb");
+  if (!out) {
+    ERROR("Failed to init " << cacheFilename);
+    return false;
+  }
+
+  float epsilon = config_->BrickAliasEpsilon();
+  bool written = 
+    fwrite(&epsilon, sizeof(float), 1, out) == 1 &&
+    fwrite(&numTotalNodes_, sizeof(unsigned int), 1, out) == 1 &&
+    fwrite(&tspSize, sizeof(uint64_t), 1, out) == 1 &&
+    fwrite(&tspTime, sizeof(uint64_t), 1, out) == 1 &&
+    fwrite(&numUniqueBricks_, sizeof(unsigned int), 1, out) == 1 &&
+    fwrite(&brickAliases_[0], sizeof(int), brickAliases_.size(), out) ==
+      brickAliases_.size();
+
+  return FinishTempFile(out, tmpFilename, cacheFilename, written);
+}
+
+bool TSP::CalculateBrickRanges() {
+
+  std::string inFilename = config_->TSPFilename();
+  std::FILE *in = fopen(inFilename.c_str(), "r");
+  if (!in) {
+    ERROR("Failed to open " << inFilename);
+    return false;
+  }
+
+  INFO("\nCalculating brick ranges");
+
+  unsigned int numBrickVals = paddedBrickDim_*paddedBrickDim_*paddedBrickDim_;
+  std::vector<float> buffer(numBrickVals);
+  brickRanges_.resize(2*numTotalNodes_);
+
+  for (unsigned int brick=0; brick<numTotalNodes_; ++brick) {
+    if (!ReadBrick(in, brick, buffer)) {
+      fclose(in);
+      return false;
+    }
+    float min = buffer[0];
+    float max = buffer[0];
+    for (unsigned int i=1; i<numBrickVals; ++i) {
+      if (buffer[i] < min) min = buffer[i];
+      if (buffer[i] > max) max = buffer[i];
+    }
+    brickRanges_[2*brick+0] = min;
+    brickRanges_[2*brick+1] = max;
+  }
+
+  fclose(in);
+
+  return true;
+}
+
+bool TSP::ReadRangeCache() {
+
+  std::string cacheFilename = config_->TSPFilename() + ".ranges";
+
+  std::FILE *in = fopen(cacheFilename.c_str(), "r");
+  if (!in) {
+    INFO("No brick range cache " << cacheFilename);
+    return false;
+  }
+
+  unsigned int numBricks;
+  fread(reinterpret_cast<void*>(&numBricks), sizeof(unsigned int), 1, in);
+  if (numBricks != numTotalNodes_) {
+    INFO("Brick range cache " << cacheFilename << " is out of date");
+    fclose(in);
+    return false;
+  }
+
+  brickRanges_.resize(2*numTotalNodes_);
+  fread(reinterpret_cast<void*>(&brickRanges_[0]), 
+        brickRanges_.size()*sizeof(float), 1, in);
+
+  fclose(in);
+
+  INFO("\nUsing cached brick ranges");
+
+  return true;
+}
+
+bool TSP::WriteRangeCache() {
+
+  std::string cacheFilename = config_->TSPFilename() + ".ranges";
+  INFO("Writing brick range cache to " << cacheFilename);
+
+  std::FILE *out = fopen(cacheFilename.c_str(), "w");
+  if (!out) {
+    ERROR("Failed to init " << cacheFilename);
+    return false;
+  }
+
+  fwrite(reinterpret_cast<void*>(&numTotalNodes_), 
+         sizeof(unsigned int), 1, out);
+  fwrite(reinterpret_cast<void*>(&brickRanges_[0]), 
+         brickRanges_.size()*sizeof(float), 1, out);
+
+  fclose(out);
+
+  return true;
+}
+
 
 /*
 
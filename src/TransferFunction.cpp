@@ -12,6 +12,7 @@
 #include <boost/tokenizer.hpp>
 #include <boost/lexical_cast.hpp>
 #include <math.h>
+#include <algorithm>
 #include <Texture2D.h>
 
 using namespace osp;
@@ -22,11 +23,13 @@ TransferFunction * TransferFunction::New() {
 
 TransferFunction::TransferFunction() : 
   texture_(NULL),
+  preintegratedTexture_(NULL),
   floatData_(NULL),
   width_(0),
   lower_(0.f),
   upper_(1.f),
   generatedTexture_(false),
+  preintegrated_(false),
   inFilename_("NotSet"),
   interpolation_(TransferFunction::LINEAR) {}
 
@@ -36,7 +39,14 @@ TransferFunction::TransferFunction(const TransferFunction &_tf) {
 }
 
 
-TransferFunction::~TransferFunction() {}
+TransferFunction::~TransferFunction() {
+  if (texture_) delete texture_;
+  if (preintegratedTexture_) delete preintegratedTexture_;
+}
+
+void TransferFunction::SetPreintegrated(bool _preintegrated) {
+  preintegrated_ = _preintegrated;
+}
 
 bool TransferFunction::ReadFile() {
   std::ifstream in;
@@ -134,6 +144,116 @@ bool TransferFunction::Sample(float &_r, float &_g, float &_b, float &_a,
   return true;
 }
 
+void TransferFunction::BuildAlphaTables() {
+  minAlpha_.assign(1, std::vector<float>(width_));
+  maxAlpha_.assign(1, std::vector<float>(width_));
+  for (unsigned int i=0; i<width_; ++i) {
+    minAlpha_[0][i] = maxAlpha_[0][i] = floatData_[4*i+3];
+  }
+  for (unsigned int k=1; (1u << k) <= width_; ++k) {
+    unsigned int half = 1 << (k-1);
+    unsigned int num = width_ - (1 << k) + 1;
+    minAlpha_.push_back(std::vector<float>(num));
+    maxAlpha_.push_back(std::vector<float>(num));
+    for (unsigned int i=0; i<num; ++i) {
+      minAlpha_[k][i] = std::min(minAlpha_[k-1][i], minAlpha_[k-1][i+half]);
+      maxAlpha_[k][i] = std::max(maxAlpha_[k-1][i], maxAlpha_[k-1][i+half]);
+    }
+  }
+}
+
+void TransferFunction::TexelRange(float _lower, float _upper, 
+                                  int &_first, int &_last, 
+                                  unsigned int &_level) const {
+  // Texel centers are at (i+0.5)/width, a filtered lookup blends the two
+  // texels around the intensity
+  int last = static_cast<int>(width_) - 1;
+  _first = static_cast<int>(floorf(_lower*width_ - 0.5f));
+  _last = static_cast<int>(floorf(_upper*width_ - 0.5f)) + 1;
+  _first = std::max(0, std::min(_first, last));
+  _last = std::max(0, std::min(_last, last));
+  if (_last < _first) std::swap(_first, _last);
+  // Two overlapping power of two spans cover the range
+  _level = 0;
+  while ((2u << _level) <= static_cast<unsigned int>(_last-_first+1)) {
+    _level++;
+  }
+  _last = _last - (1 << _level) + 1;
+}
+
+float TransferFunction::MinAlpha(float _lower, float _upper) const {
+  if (minAlpha_.empty()) return 0.f;
+  int first, last;
+  unsigned int k;
+  TexelRange(_lower, _upper, first, last, k);
+  return std::min(minAlpha_[k][first], minAlpha_[k][last]);
+}
+
+float TransferFunction::MaxAlpha(float _lower, float _upper) const {
+  if (maxAlpha_.empty()) return 1.f;
+  int first, last;
+  unsigned int k;
+  TexelRange(_lower, _upper, first, last, k);
+  return std::max(maxAlpha_[k][first], maxAlpha_[k][last]);
+}
+
+double TransferFunction::Integral(const std::vector<double> &_edges,
+                                  unsigned int _stride, unsigned int _c,
+                                  double _i) const {
+  double x = std::max(0.0, std::min(_i*width_, (double)width_));
+  unsigned int i0 = std::min(static_cast<unsigned int>(x), width_-1);
+  double d = x - i0;
+  return _edges[_stride*i0+_c]*(1.0-d) + _edges[_stride*(i0+1)+_c]*d;
+}
+
+bool TransferFunction::ConstructPreintegratedTexture() {
+
+  // Running integrals of extinction and color over intensity, at the 
+  // texel edges. TF values are for one base step, so extinction is 
+  // -ln(1-alpha) and color is taken as premultiplied, like the 
+  // raycaster's compositing does.
+  std::vector<double> tau(width_+1, 0.0);
+  std::vector<double> rgb(3*(width_+1), 0.0);
+  for (unsigned int i=0; i<width_; ++i) {
+    double a = std::min(floatData_[4*i+3], 0.9999f);
+    tau[i+1] = tau[i] - log(1.0-a)/width_;
+    for (unsigned int c=0; c<3; ++c) {
+      rgb[3*(i+1)+c] = rgb[3*i+c] + floatData_[4*i+c]/width_;
+    }
+  }
+
+  // A segment gets the average extinction and color over the intensities
+  // between its ends (no self-attenuation). Equal ends use the table 
+  // cell around them.
+  unsigned int size = std::min(width_, MAX_PREINTEGRATION_SIZE);
+  std::vector<float> table(4*size*size);
+  for (unsigned int back=0; back<size; ++back) {
+    for (unsigned int front=0; front<size; ++front) {
+      double f = (front+0.5)/size;
+      double b = (back+0.5)/size;
+      if (front == back) {
+        f -= 0.5/size;
+        b += 0.5/size;
+      }
+      double length = b - f;
+      float *texel = &table[4*(back*size+front)];
+      for (unsigned int c=0; c<3; ++c) {
+        texel[c] = static_cast<float>(
+          (Integral(rgb, 3, c, b) - Integral(rgb, 3, c, f))/length);
+      }
+      double meanTau = 
+        (Integral(tau, 1, 0, b) - Integral(tau, 1, 0, f))/length;
+      texel[3] = static_cast<float>(1.0 - exp(-meanTau));
+    }
+  }
+
+  std::vector<unsigned int> dim(2);
+  dim[0] = size;
+  dim[1] = size;
+  preintegratedTexture_ = Texture2D::New(dim);
+  return preintegratedTexture_->Init(&table[0]);
+}
+
 bool TransferFunction::ConstructTexture() {
 
   if (mappingKeys_.empty()) {
@@ -199,13 +319,22 @@ bool TransferFunction::ConstructTexture() {
       }
     }
 
+    BuildAlphaTables();
+
     // Create and fill the texture
     std::vector<unsigned int> dim(2);
     dim[0] = width_;
     dim[1] = 1;
+    if (texture_) delete texture_;
     texture_ = Texture2D::New(dim);
     texture_->Init(&floatData_[0]);
     generatedTexture_ = true; 
+
+    if (preintegratedTexture_) {
+      delete preintegratedTexture_;
+      preintegratedTexture_ = NULL;
+    }
+    if (preintegrated_ && !ConstructPreintegratedTexture()) return false;
     
     //delete[] values;
   } else {
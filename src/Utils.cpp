@@ -4,6 +4,14 @@
  */
 #include <GL/glew.h>
 #include <Utils.h>
+#include <sstream>
+#include <cstdlib>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <process.h>
+#endif
 
 unsigned int osp::CheckGLError(std::string _location) {
   unsigned int error = glGetError();
@@ -37,3 +45,56 @@ unsigned int osp::CheckGLError(std::string _location) {
   }
   return error;
 }
+
+uint64_t osp::Hash64(const void *_data, size_t _sizeInBytes, uint64_t _seed) {
+  const unsigned char *bytes = static_cast<const unsigned char*>(_data);
+  uint64_t hash = _seed;
+  for (size_t i=0; i<_sizeInBytes; ++i) {
+    hash ^= static_cast<uint64_t>(bytes[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::string osp::TempFilename(const std::string &_filename) {
+  std::stringstream ss;
+  ss << _filename << ".";
+#ifndef _WIN32
+  char host[256] = "";
+  gethostname(host, sizeof(host)-1);
+  ss << host << "." << getpid();
+#else
+  const char *host = getenv("COMPUTERNAME");
+  ss << (host ? host : "") << "." << _getpid();
+#endif
+  ss << ".tmp";
+  return ss.str();
+}
+
+bool osp::FinishTempFile(std::FILE *_out, const std::string &_tmpFilename,
+                         const std::string &_filename, bool _success) {
+  bool written = _success && ferror(_out) == 0;
+  written = fclose(_out) == 0 && written;
+  if (written && rename(_tmpFilename.c_str(), _filename.c_str()) != 0) {
+    // Renaming onto an existing file fails on some platforms
+    remove(_filename.c_str());
+    written = rename(_tmpFilename.c_str(), _filename.c_str()) == 0;
+  }
+  if (!written) {
+    ERROR("Failed to write " << _filename);
+    remove(_tmpFilename.c_str());
+  }
+  return written;
+}
+
+bool osp::FileStamp(const std::string &_filename, uint64_t &_size,
+                    uint64_t &_time) {
+  struct stat info;
+  if (stat(_filename.c_str(), &info) != 0) {
+    ERROR("Failed to stat " << _filename);
+    return false;
+  }
+  _size = static_cast<uint64_t>(info.st_size);
+  _time = static_cast<uint64_t>(info.st_mtime);
+  return true;
+}